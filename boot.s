@@ -13,7 +13,18 @@
 .long CHECKSUM
 
 .set KERNEL_VIRTUAL_BASE, 0xc0000000
+#ifdef PAE_ENABLED
+# with PAE, there are 2048 page directory entries of 8 bytes, 2 MB each
+.set KERNEL_PAGE_NUMBER, (KERNEL_VIRTUAL_BASE >> 21)
+.set PAGE_DIRECTORY_ENTRIES, 2048
+.set PAGE_DIRECTORY_ENTRY_SIZE, 8
+.set LARGE_PAGE_SIZE, 0x00200000
+#else
 .set KERNEL_PAGE_NUMBER, (KERNEL_VIRTUAL_BASE >> 22)
+.set PAGE_DIRECTORY_ENTRIES, 1024
+.set PAGE_DIRECTORY_ENTRY_SIZE, 4
+.set LARGE_PAGE_SIZE, 0x00400000
+#endif
 
 .section .bootstrap_stack, "aw", @nobits
 stack_bottom:
@@ -24,6 +35,24 @@ stack_top:
 .section .data
 .align 0x1000
 _boot_page_directory:
+#ifdef PAE_ENABLED
+	# identity map the first 4 MB
+	.quad 0x00000083
+	.quad 0x00200083
+	# no pages until upper half
+	.rept (KERNEL_PAGE_NUMBER - 2)
+	.quad 0
+	.endr
+	# upper half will be fully mapped to lower half
+	.rept (PAGE_DIRECTORY_ENTRIES - KERNEL_PAGE_NUMBER)
+	.quad 0
+	.endr
+_boot_page_directory_pointers:
+	# filled in with the four page directories above
+	.rept 4
+	.quad 0
+	.endr
+#else
 	# identity map the first 4 MB
 	.long 0x00000083
 	# no pages until upper half
@@ -31,9 +60,10 @@ _boot_page_directory:
 	.long 0
 	.endr
 	# upper half will be fully mapped to lower half
-	.rept (1024 - KERNEL_PAGE_NUMBER)
+	.rept (PAGE_DIRECTORY_ENTRIES - KERNEL_PAGE_NUMBER)
 	.long 0
 	.endr
+#endif
 .global _kernel_virtual_base
 _kernel_virtual_base:
 	.long KERNEL_VIRTUAL_BASE
@@ -56,17 +86,37 @@ _start:
 
 	# initialize page directory
 	mov $0x00000083, %edx
-	mov $(_boot_page_directory - KERNEL_VIRTUAL_BASE + KERNEL_PAGE_NUMBER * 4), %ecx
-	mov $(1024 - KERNEL_PAGE_NUMBER), %ebp
+	mov $(_boot_page_directory - KERNEL_VIRTUAL_BASE + KERNEL_PAGE_NUMBER * PAGE_DIRECTORY_ENTRY_SIZE), %ecx
+	mov $(PAGE_DIRECTORY_ENTRIES - KERNEL_PAGE_NUMBER), %ebp
 	# map only 32 pages
 	#mov $32, %ebp
 l1:
 	movl %edx, (%ecx)
-	add $0x00400000, %edx
-	add $4, %ecx
+	add $LARGE_PAGE_SIZE, %edx
+	add $PAGE_DIRECTORY_ENTRY_SIZE, %ecx
 	dec %ebp
 	jnz l1
 
+#ifdef PAE_ENABLED
+	# point the page directory pointers at the four page directories
+	mov $(_boot_page_directory - KERNEL_VIRTUAL_BASE + 0x1), %edx
+	mov $(_boot_page_directory_pointers - KERNEL_VIRTUAL_BASE), %ecx
+	mov $4, %ebp
+l2:
+	movl %edx, (%ecx)
+	add $0x1000, %edx
+	add $8, %ecx
+	dec %ebp
+	jnz l2
+
+	mov $(_boot_page_directory_pointers - KERNEL_VIRTUAL_BASE), %ecx
+	mov %ecx, %cr3
+
+	# enable PAE, which implies 2 mb pages
+	mov %cr4, %ecx
+	or $0x00000020, %ecx
+	mov %ecx, %cr4
+#else
 	mov $(_boot_page_directory - KERNEL_VIRTUAL_BASE), %ecx
 	mov %ecx, %cr3
 
@@ -74,6 +124,7 @@ l1:
 	mov %cr4, %ecx
 	or $0x00000010, %ecx
 	mov %ecx, %cr4
+#endif
 
 	# enable paging
 	mov %cr0, %ecx
@@ -86,6 +137,9 @@ l1:
 higher_half:
 	# Unmap the identity-mapped pages
 	movl $0, _boot_page_directory
+#ifdef PAE_ENABLED
+	movl $0, (_boot_page_directory + 8)
+#endif
 
 	movl $stack_top, %esp
 	# Mark end of call stack for unwinding
@@ -1,4 +1,5 @@
 #include "condition.hpp"
+#include <fd/sched_trace.hpp>
 #include <fd/scheduler.hpp>
 #include <global.hpp>
 
@@ -7,7 +8,10 @@ using namespace cloudos;
 thread_condition::thread_condition(thread_condition_signaler *s)
 : signaler(s)
 , satisfied(false)
-{}
+{
+	signaler_item.data = this;
+	waiter_item.data = this;
+}
 
 thread_condition::~thread_condition()
 {
@@ -58,7 +62,7 @@ thread_condition_signaler::~thread_condition_signaler()
 	while(conditions) {
 		conditions->data->signaler = nullptr; /* we're going away, remove dangling pointer */
 		auto *next = conditions->next;
-		deallocate(conditions);
+		conditions->next = nullptr;
 		conditions = next;
 	}
 }
@@ -74,20 +78,20 @@ bool thread_condition_signaler::already_satisfied(thread_condition *c) {
 
 void thread_condition_signaler::subscribe_condition(thread_condition *c)
 {
-	auto item = allocate<thread_condition_list>(c);
 	// append myself, don't prepend, to prevent starvation
-	append(&conditions, item);
+	append(&conditions, &c->signaler_item);
 }
 
 void thread_condition_signaler::remove_condition(thread_condition *c)
 {
 	remove_one(&conditions, [&](thread_condition_list *item){
 		return item->data == c;
-	});
+	}, intrusive_list_deallocator<thread_condition*>());
 }
 
 void thread_condition_signaler::condition_notify() {
 	if(conditions) {
+		sched_trace_record(TRACE_SIGNAL, nullptr, reinterpret_cast<uintptr_t>(this));
 		auto *c = conditions;
 		conditions->data->satisfy();
 		// satisfy will call remove_condition(), which will call
@@ -97,6 +101,9 @@ void thread_condition_signaler::condition_notify() {
 }
 
 void thread_condition_signaler::condition_broadcast() {
+	if(conditions) {
+		sched_trace_record(TRACE_SIGNAL, nullptr, reinterpret_cast<uintptr_t>(this));
+	}
 	while(conditions) {
 		auto *c = conditions;
 		conditions->data->satisfy();
@@ -116,13 +123,12 @@ thread_condition_waiter::~thread_condition_waiter()
 		auto *list = finish();
 		remove_all(&list, [](thread_condition_list *) {
 			return true;
-		});
+		}, intrusive_list_deallocator<thread_condition*>());
 	}
 }
 
 void thread_condition_waiter::add_condition(thread_condition *c) {
-	auto item = allocate<thread_condition_list>(c);
-	append(&conditions, item);
+	append(&conditions, &c->waiter_item);
 }
 
 void thread_condition_waiter::wait() {
@@ -158,6 +164,8 @@ void thread_condition_waiter::wait() {
 	//   whether conditions are already satisfied; then, if a condition becomes
 	//   satisfied during that period, the thread will be unblocked and will
 	//   automatically be scheduled again sometime after the yield
+	// Until then, there must be no preemption point between subscribing
+	// and blocking.
 
 	if(!initially_satisfied) {
 		// Block ourselves waiting on a satisfaction
@@ -178,7 +186,7 @@ thread_condition_list *thread_condition_waiter::finish() {
 	// remove all unsatisfied conditions
 	remove_all(&conditions, [&](thread_condition_list *item) {
 		return !item->data->satisfied;
-	});
+	}, intrusive_list_deallocator<thread_condition*>());
 
 	assert(conditions != nullptr); /* no satisfied conditions? */
 
@@ -19,7 +19,8 @@ struct thread_condition_waiter;
  * done in local scope.
  *
  * A condition is usually created on-stack in local scope, and is not
- * otherwise owned.
+ * otherwise owned. It contains its own list items for the signaler and the
+ * waiter, so it can be in at most one of each.
  */
 struct thread_condition {
 	thread_condition(thread_condition_signaler *signaler);
@@ -36,6 +37,11 @@ private:
 	weak_ptr<thread> thread;
 	bool satisfied;
 
+	// The items by which the signaler and the waiter hold this
+	// condition, so that waiting doesn't allocate
+	thread_condition_list signaler_item;
+	thread_condition_list waiter_item;
+
 	friend thread_condition_signaler;
 	friend thread_condition_waiter;
 };
@@ -80,7 +86,9 @@ private:
  * its initial, empty state.
  *
  * The waiter is usually created on the stack in local scope. It does not own
- * the conditions, which are also often created on the stack.
+ * the conditions, which are also often created on the stack. The list returned
+ * by finish() consists of the items embedded in the conditions, so it must be
+ * emptied with the intrusive_list_deallocator.
  */
 struct thread_condition_waiter {
 	thread_condition_waiter();
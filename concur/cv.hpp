@@ -22,8 +22,9 @@ namespace cloudos {
  * CV::wait() is called, the condition becomes true and the CV is notified.
  * Because the thread enters the waiting list too late, it is never woken up,
  * even though the condition became true. However, because this kernel is
- * uniprocessor and does not do kernel thread preemption, this race condition
- * can never occur.
+ * uniprocessor and only preempts kernel threads at explicit preemption points,
+ * this race condition can't occur as long as there is no preemption point
+ * between checking the condition and calling wait().
  */
 struct cv_t {
 	inline thread_condition_signaler &get_signaler() {
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace cloudos {
+
+struct thread;
+
+enum sched_trace_event_type : uint8_t {
+	TRACE_SIGNAL = 5,
+};
+
+inline void sched_trace_record(sched_trace_event_type, thread *, uint32_t = 0) {}
+
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <fd/thread.hpp>
+
+namespace cloudos {
+
+// Stand-in for the kernel scheduler, only knowing the running thread
+struct scheduler {
+	shared_ptr<thread> get_running_thread() {
+		return running;
+	}
+
+	shared_ptr<thread> running;
+};
+
+}
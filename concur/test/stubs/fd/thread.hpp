@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory/smart_ptr.hpp>
+
+namespace cloudos {
+
+/* Stand-in for the kernel thread, so that thread conditions can be tested on
+ * the host. Blocking doesn't yield; instead, it runs while_blocked, which
+ * plays the part of the other threads that run until this one is woken up.
+ */
+struct thread {
+	inline bool is_blocked() { return blocked; }
+
+	void thread_block() {
+		assert(!blocked);
+		blocked = true;
+		if(while_blocked) {
+			while_blocked(while_blocked_userdata);
+		}
+	}
+
+	void thread_unblock() {
+		assert(blocked);
+		blocked = false;
+		unblocks++;
+	}
+
+	void (*while_blocked)(void*) = nullptr;
+	void *while_blocked_userdata = nullptr;
+	bool blocked = false;
+	int unblocks = 0;
+};
+
+}
@@ -0,0 +1,158 @@
+#include <concur/condition.hpp>
+#include <fd/scheduler.hpp>
+#include <global.hpp>
+#include <catch.hpp>
+#include <stdlib.h>
+
+using namespace cloudos;
+
+// An allocator that counts its calls, so that the tests can check which
+// paths allocate
+static size_t allocations = 0;
+static size_t deallocations = 0;
+
+Blk cloudos::allocate(size_t n) {
+	allocations++;
+	return Blk(malloc(n), n);
+}
+
+Blk cloudos::allocate_aligned(size_t n, size_t alignment) {
+	allocations++;
+	void *ptr = nullptr;
+	if(posix_memalign(&ptr, alignment, n) != 0) {
+		return {};
+	}
+	return Blk(ptr, n);
+}
+
+void cloudos::deallocate(Blk b) {
+	deallocations++;
+	free(b.ptr);
+}
+
+struct condition_fixture {
+	condition_fixture() {
+		previous_state = global_state_;
+		global_state_ = &state;
+		state.scheduler = &sched;
+		sched.running = make_shared<thread>();
+	}
+
+	~condition_fixture() {
+		sched.running.reset();
+		global_state_ = previous_state;
+	}
+
+	global_state state;
+	global_state *previous_state;
+	scheduler sched;
+};
+
+static bool always_satisfied(void*, thread_condition*) {
+	return true;
+}
+
+TEST_CASE("waking up a thread doesn't allocate") {
+	condition_fixture f;
+	thread_condition_signaler readable, writable, timeout;
+
+	// while the thread is blocked, another thread makes it writable
+	f.sched.running->while_blocked = [](void *userdata) {
+		reinterpret_cast<thread_condition_signaler*>(userdata)->condition_notify();
+	};
+	f.sched.running->while_blocked_userdata = &writable;
+
+	size_t allocations_before = allocations;
+	size_t deallocations_before = deallocations;
+
+	for(int round = 0; round < 3; ++round) {
+		thread_condition c1(&readable);
+		thread_condition c2(&writable);
+		thread_condition c3(&timeout);
+
+		thread_condition_waiter waiter;
+		waiter.add_condition(&c1);
+		waiter.add_condition(&c2);
+		waiter.add_condition(&c3);
+		waiter.wait();
+
+		REQUIRE(!f.sched.running->is_blocked());
+		REQUIRE(f.sched.running->unblocks == round + 1);
+
+		thread_condition_list *satisfied = waiter.finish();
+		REQUIRE(satisfied != nullptr);
+		REQUIRE(satisfied->data == &c2);
+		REQUIRE(satisfied->next == nullptr);
+		remove_all(&satisfied, [](thread_condition_list *) {
+			return true;
+		}, intrusive_list_deallocator<thread_condition*>());
+	}
+
+	REQUIRE(allocations == allocations_before);
+	REQUIRE(deallocations == deallocations_before);
+}
+
+TEST_CASE("an already satisfied condition doesn't block or allocate") {
+	condition_fixture f;
+	thread_condition_signaler ready, other;
+	ready.set_already_satisfied_function(always_satisfied, nullptr);
+
+	size_t allocations_before = allocations;
+	size_t deallocations_before = deallocations;
+
+	thread_condition c1(&ready);
+	thread_condition c2(&other);
+	thread_condition_waiter waiter;
+	waiter.add_condition(&c1);
+	waiter.add_condition(&c2);
+	waiter.wait();
+
+	REQUIRE(!f.sched.running->is_blocked());
+	REQUIRE(f.sched.running->unblocks == 0);
+
+	thread_condition_list *satisfied = waiter.finish();
+	REQUIRE(satisfied != nullptr);
+	REQUIRE(satisfied->data == &c1);
+	REQUIRE(satisfied->next == nullptr);
+	remove_all(&satisfied, [](thread_condition_list *) {
+		return true;
+	}, intrusive_list_deallocator<thread_condition*>());
+
+	REQUIRE(allocations == allocations_before);
+	REQUIRE(deallocations == deallocations_before);
+}
+
+TEST_CASE("broadcast wakes up all conditions without allocating") {
+	condition_fixture f;
+	thread_condition_signaler signaler;
+
+	// both conditions are subscribed to the same signaler
+	thread_condition c1(&signaler);
+	thread_condition c2(&signaler);
+
+	f.sched.running->while_blocked = [](void *userdata) {
+		reinterpret_cast<thread_condition_signaler*>(userdata)->condition_broadcast();
+	};
+	f.sched.running->while_blocked_userdata = &signaler;
+
+	size_t allocations_before = allocations;
+	size_t deallocations_before = deallocations;
+
+	thread_condition_waiter waiter;
+	waiter.add_condition(&c1);
+	waiter.add_condition(&c2);
+	waiter.wait();
+
+	REQUIRE(f.sched.running->unblocks == 1);
+	thread_condition_list *satisfied = waiter.finish();
+	REQUIRE(satisfied != nullptr);
+	REQUIRE(satisfied->data == &c1);
+	REQUIRE(satisfied->next != nullptr);
+	REQUIRE(satisfied->next->data == &c2);
+	remove_all(&satisfied, [](thread_condition_list *) {
+		return true;
+	}, intrusive_list_deallocator<thread_condition*>());
+
+	REQUIRE(allocations == allocations_before);
+	REQUIRE(deallocations == deallocations_before);
+}
@@ -0,0 +1,20 @@
+#define CATCH_CONFIG_RUNNER
+#include <catch.hpp>
+#include "global.hpp"
+#include <oslibc/string.h>
+
+namespace cloudos {
+cloudos::global_state *global_state_;
+}
+
+using namespace cloudos;
+
+// normally defined in kernel_main.cpp
+global_state::global_state() {
+	memset(this, 0, sizeof(*this));
+}
+
+int main(int argc, char *argv[]) {
+	cloudos::global_state_ = 0;
+	return Catch::Session().run(argc, argv);
+}
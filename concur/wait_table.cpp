@@ -0,0 +1,107 @@
+#include "wait_table.hpp"
+#include <memory/allocator.hpp>
+
+using namespace cloudos;
+
+static_assert((wait_table::NUM_BUCKETS & (wait_table::NUM_BUCKETS - 1)) == 0, "NUM_BUCKETS must be a power of two");
+
+size_t wait_table::bucket(wait_key const &key)
+{
+	// locks and condvars are at least 4-byte aligned, so the lowest bits
+	// of the address carry no information
+	uint32_t h = static_cast<uint32_t>(key.address >> 2)
+		^ static_cast<uint32_t>(key.address >> 32)
+		^ (reinterpret_cast<uintptr_t>(key.process) >> 4);
+	h *= 2654435761u;
+	return (h >> 16) & (NUM_BUCKETS - 1);
+}
+
+userland_lock_waiters_t *wait_table::get_lock_info(wait_key const &key)
+{
+	auto res = find(locks[bucket(key)], [&](userland_lock_waiters_list *item) {
+		return item->data->key == key;
+	});
+	return res == nullptr ? nullptr : res->data;
+}
+
+userland_lock_waiters_t *wait_table::get_or_create_lock_info(wait_key const &key)
+{
+	auto res = get_lock_info(key);
+	if(res != nullptr) {
+		return res;
+	}
+
+	userland_lock_waiters_t *new_info = allocate<userland_lock_waiters_t>();
+	new_info->key = key;
+
+	userland_lock_waiters_list *new_list = allocate<userland_lock_waiters_list>(new_info);
+	append(&locks[bucket(key)], new_list);
+	return new_info;
+}
+
+static void deallocate_lock_info(userland_lock_waiters_list *item)
+{
+	remove_all(&item->data->waiting_writers, [](userland_waiter_list *) {
+		return true;
+	});
+	deallocate(item->data);
+	deallocate(item);
+}
+
+void wait_table::forget_lock_info(wait_key const &key)
+{
+	remove_one(&locks[bucket(key)], [&](userland_lock_waiters_list *item) {
+		return item->data->key == key;
+	}, deallocate_lock_info);
+}
+
+userland_condvar_waiters_t *wait_table::get_condvar_info(wait_key const &key)
+{
+	auto res = find(condvars[bucket(key)], [&](userland_condvar_waiters_list *item) {
+		return item->data->key == key;
+	});
+	return res == nullptr ? nullptr : res->data;
+}
+
+userland_condvar_waiters_t *wait_table::get_or_create_condvar_info(wait_key const &key)
+{
+	auto res = get_condvar_info(key);
+	if(res != nullptr) {
+		return res;
+	}
+
+	userland_condvar_waiters_t *new_info = allocate<userland_condvar_waiters_t>();
+	new_info->key = key;
+
+	userland_condvar_waiters_list *new_list = allocate<userland_condvar_waiters_list>(new_info);
+	append(&condvars[bucket(key)], new_list);
+	return new_info;
+}
+
+static void deallocate_condvar_info(userland_condvar_waiters_list *item)
+{
+	remove_all(&item->data->waiters, [](userland_condvar_waiter_list *) {
+		return true;
+	});
+	deallocate(item->data);
+	deallocate(item);
+}
+
+void wait_table::forget_condvar_info(wait_key const &key)
+{
+	remove_one(&condvars[bucket(key)], [&](userland_condvar_waiters_list *item) {
+		return item->data->key == key;
+	}, deallocate_condvar_info);
+}
+
+void wait_table::forget_process(process_fd *process)
+{
+	for(size_t i = 0; i < NUM_BUCKETS; ++i) {
+		remove_all(&locks[i], [&](userland_lock_waiters_list *item) {
+			return item->data->key.process == process;
+		}, deallocate_lock_info);
+		remove_all(&condvars[i], [&](userland_condvar_waiters_list *item) {
+			return item->data->key.process == process;
+		}, deallocate_condvar_info);
+	}
+}
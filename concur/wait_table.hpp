@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <oslibc/list.hpp>
+#include <fd/thread.hpp>
+#include <memory/paging.hpp>
+#include "cv.hpp"
+
+namespace cloudos {
+
+struct process_fd;
+
+/** The key by which the kernel knows a userland lock or condition variable.
+ *
+ * Private locks and condvars are only used within one address space, so
+ * they are known by their process and virtual address. Shared ones may be
+ * mapped at different virtual addresses in different processes, so they are
+ * known by their physical address, without a process.
+ */
+struct wait_key {
+	process_fd *process;
+	physaddr_t address;
+
+	inline bool operator==(wait_key const &other) const {
+		return process == other.process && address == other.address;
+	}
+};
+
+/* A thread waiting for a userland lock or condvar. It is woken up by
+ * satisfying its wakeup signaler, which lives on its kernel stack, so this
+ * may only be done while the thread has not exited. */
+struct userland_waiter_t {
+	weak_ptr<thread> thr;
+	thread_condition_signaler *wakeup = nullptr;
+};
+
+typedef linked_list<userland_waiter_t> userland_waiter_list;
+
+struct userland_lock_waiters_t {
+	wait_key key;
+	cv_t readers_cv;
+	size_t number_of_readers = 0;
+	userland_waiter_list *waiting_writers = nullptr;
+};
+
+typedef linked_list<userland_lock_waiters_t*> userland_lock_waiters_list;
+
+struct userland_condvar_waiter_t {
+	userland_waiter_t waiter;
+	// The lock the waiter reacquires once it is signalled, and its key
+	_Atomic(cloudabi_lock_t) *lock = nullptr;
+	wait_key lock_key;
+};
+
+typedef linked_list<userland_condvar_waiter_t> userland_condvar_waiter_list;
+
+struct userland_condvar_waiters_t {
+	wait_key key;
+	userland_condvar_waiter_list *waiters = nullptr;
+};
+
+typedef linked_list<userland_condvar_waiters_t*> userland_condvar_waiters_list;
+
+/** Wait table for userland locks and condition variables
+ *
+ * A lock or condvar only becomes known to the kernel once it is contended,
+ * and is forgotten again once it isn't. The kernel information of such locks
+ * and condvars is kept in a hash table with a fixed number of buckets,
+ * indexed by their wait_key, so that looking them up does not depend on the
+ * number of contended locks in the system.
+ */
+struct wait_table {
+	/* If given lock is known to the kernel, return its info. Otherwise, return nullptr. */
+	userland_lock_waiters_t *get_lock_info(wait_key const &key);
+	/* If given lock is known to the kernel, return its info. Otherwise, make given lock
+	 * known to the kernel, and return a new info object. */
+	userland_lock_waiters_t *get_or_create_lock_info(wait_key const &key);
+	/* Forget about the given lock: it just became unmanaged. */
+	void forget_lock_info(wait_key const &key);
+
+	/* Likewise, but for userland condition variables. */
+	userland_condvar_waiters_t *get_condvar_info(wait_key const &key);
+	userland_condvar_waiters_t *get_or_create_condvar_info(wait_key const &key);
+	void forget_condvar_info(wait_key const &key);
+
+	/* Forget about all private locks and condvars of the given process,
+	 * whose threads must have exited. */
+	void forget_process(process_fd *process);
+
+	static const size_t NUM_BUCKETS = 256;
+
+private:
+	static size_t bucket(wait_key const &key);
+
+	userland_lock_waiters_list *locks[NUM_BUCKETS] = {};
+	userland_condvar_waiters_list *condvars[NUM_BUCKETS] = {};
+};
+
+}
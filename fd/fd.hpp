@@ -49,7 +49,9 @@ struct fd_t {
 	 */
 	cloudabi_device_t device = 0;
 
-	size_t refcount = 1;
+	// Set while a pseudo FD has a request outstanding on this reverse FD,
+	// see pseudo_fd::send_request()
+	bool request_outstanding = false;
 	bool invalid = false;
 
 	char name[64]; /* for debugging */
@@ -84,6 +86,10 @@ struct fd_t {
 		*s = nullptr;
 		return EINVAL;
 	}
+	virtual cloudabi_errno_t get_write_signaler(thread_condition_signaler **s) {
+		*s = nullptr;
+		return EINVAL;
+	}
 
 	/* For directories */
 	/** Open a path. In the cloudabi_fdstat_t, rights_base and rights_inheriting specify the
@@ -0,0 +1,36 @@
+#include "kernel_stack_pool.hpp"
+#include <global.hpp>
+#include <memory/map_virtual.hpp>
+
+using namespace cloudos;
+
+kernel_stack_pool::kernel_stack_pool()
+{
+	for(num_free = 0; num_free < POOL_SIZE; ++num_free) {
+		Blk stack = get_map_virtual()->allocate_guarded(STACK_SIZE);
+		if(stack.ptr == nullptr) {
+			kernel_panic("Failed to fill the kernel stack pool");
+		}
+		free_stacks[num_free] = stack;
+	}
+}
+
+Blk kernel_stack_pool::get_stack()
+{
+	if(num_free > 0) {
+		hits++;
+		return free_stacks[--num_free];
+	}
+	misses++;
+	return get_map_virtual()->allocate_guarded(STACK_SIZE);
+}
+
+void kernel_stack_pool::put_stack(Blk stack)
+{
+	assert(stack.size == STACK_SIZE);
+	if(num_free < POOL_SIZE) {
+		free_stacks[num_free++] = stack;
+	} else {
+		get_map_virtual()->deallocate_guarded(stack);
+	}
+}
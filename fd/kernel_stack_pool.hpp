@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <memory/allocation.hpp>
+
+#ifndef KERNEL_STACK_POOL_SIZE
+#define KERNEL_STACK_POOL_SIZE 16
+#endif
+
+namespace cloudos {
+
+/** Pool of kernel stacks
+ *
+ * Every thread needs a kernel stack. Instead of allocating and mapping a new
+ * stack for every thread and unmapping it again when the thread is
+ * destructed, stacks are taken from this pool and returned to it. The pool
+ * is filled when it is created, and holds at most POOL_SIZE free stacks;
+ * when it is empty, a new stack is allocated, and when it is full, a
+ * returned stack is freed.
+ *
+ * Every stack is preceded by an unmapped guard page, so that a kernel stack
+ * overflow faults instead of overwriting other kernel memory.
+ */
+struct kernel_stack_pool {
+	kernel_stack_pool();
+
+	// Returns a stack of STACK_SIZE bytes, or an empty Blk if no memory
+	// was available
+	Blk get_stack();
+	void put_stack(Blk stack);
+
+	inline size_t get_free() { return num_free; }
+	inline size_t get_hits() { return hits; }
+	inline size_t get_misses() { return misses; }
+
+	static const size_t STACK_SIZE = 0x10000 /* 64 kb */;
+	static const size_t POOL_SIZE = KERNEL_STACK_POOL_SIZE;
+
+private:
+	Blk free_stacks[POOL_SIZE];
+	size_t num_free = 0;
+
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+}
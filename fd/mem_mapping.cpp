@@ -47,24 +47,27 @@ mem_mapping_t::mem_mapping_t(process_fd *o, mem_mapping_t *other)
 {
 }
 
-void mem_mapping_t::copy_from(mem_mapping_t *other)
+void mem_mapping_t::copy_from(process_fd *source)
 {
-	if(other->number_of_pages != number_of_pages) {
-		kernel_panic("copy_from length mismatch");
-	}
 	// TODO: remove this method and use copy-on-write
 	char buf[PAGE_SIZE];
-	for(size_t i = 0; i < other->number_of_pages; ++i) {
-		if(other->is_backed(i)) {
-			uint8_t *copy_from = reinterpret_cast<uint8_t*>(other->virtual_address) + PAGE_SIZE * i;
-			uint8_t *copy_to = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * i;
+	for(size_t i = 0; i < number_of_pages; ++i) {
+		// Let other threads run in between pages. The other threads of
+		// the source process may change its mappings meanwhile, so its
+		// page tables are checked again for every page.
+		get_scheduler()->preempt_point();
+
+		uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * i;
+		if(source->is_backed(address)) {
 			ensure_backed(i);
-			other->owner->install_page_directory();
-			memcpy(buf, copy_from, PAGE_SIZE);
+			source->install_page_directory();
+			memcpy(buf, address, PAGE_SIZE);
 			owner->install_page_directory();
-			memcpy(copy_to, buf, PAGE_SIZE);
+			memcpy(address, buf, PAGE_SIZE);
 		}
 	}
+	// a preemption may have installed the page directory of the source
+	owner->install_page_directory();
 }
 
 bool mem_mapping_t::covers(void *addr, size_t len)
@@ -84,31 +87,36 @@ void mem_mapping_t::set_protection(cloudabi_mprot_t p)
 	// TODO: set all backed page table entries to these bits
 }
 
-uint32_t *mem_mapping_t::get_page_entry(size_t page)
+page_entry_t *mem_mapping_t::get_page_entry(size_t page)
 {
 	assert(page < number_of_pages);
 	uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * page;
-	uint16_t page_table_num = reinterpret_cast<uint64_t>(address) >> 22;
-	uint32_t *page_table = owner->get_page_table(page_table_num);
+	uint16_t page_table_num = page_table_index(reinterpret_cast<uintptr_t>(address));
+	page_entry_t *page_table = owner->get_page_table(page_table_num);
 	if(page_table == nullptr) {
 		return nullptr;
 	}
-	uint16_t page_entry_num = reinterpret_cast<uint64_t>(address) >> 12 & 0x03ff;
+	uint16_t page_entry_num = page_entry_index(reinterpret_cast<uintptr_t>(address));
 	return &page_table[page_entry_num];
 }
 
-uint32_t *mem_mapping_t::ensure_get_page_entry(size_t page)
+page_entry_t *mem_mapping_t::ensure_get_page_entry(size_t page)
 {
 	assert(page < number_of_pages);
 	uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * page;
-	uint16_t page_table_num = reinterpret_cast<uint64_t>(address) >> 22;
-	uint32_t *page_table = owner->ensure_get_page_table(page_table_num);
-	uint16_t page_entry_num = reinterpret_cast<uint64_t>(address) >> 12 & 0x03ff;
+	uint16_t page_table_num = page_table_index(reinterpret_cast<uintptr_t>(address));
+	page_entry_t *page_table = owner->ensure_get_page_table(page_table_num);
+	uint16_t page_entry_num = page_entry_index(reinterpret_cast<uintptr_t>(address));
 	return &page_table[page_entry_num];
 }
 
 bool mem_mapping_t::is_backed(size_t page)
 {
+	assert(page < number_of_pages);
+	uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * page;
+	if(owner->get_hugepage(page_table_index(reinterpret_cast<uintptr_t>(address))) != 0) {
+		return true;
+	}
 	auto *page_entry = get_page_entry(page);
 	if(page_entry == nullptr) {
 		return false;
@@ -118,13 +126,24 @@ bool mem_mapping_t::is_backed(size_t page)
 
 void mem_mapping_t::ensure_backed(size_t page)
 {
+	if(is_backed(page)) {
+		// don't demote hugepages if the page is backed already
+		return;
+	}
 	auto *page_entry = ensure_get_page_entry(page);
 	if(!(*page_entry & 0x1)) {
-		Blk b = get_map_virtual()->allocate(PAGE_SIZE);
-		if(b.ptr == 0) {
+		// This page is only accessed through the page tables, so it may
+		// come from anywhere in physical memory
+		physaddr_t phys = get_page_allocator()->allocate_phys_page();
+		if(phys == 0) {
 			kernel_panic("Failed to allocate page to back a mapping");
 		}
 
+		Blk b = get_map_virtual()->map_pages_only(phys, PAGE_SIZE);
+		if(b.ptr == 0) {
+			kernel_panic("Failed to map page to back a mapping");
+		}
+
 		assert((reinterpret_cast<uint32_t>(b.ptr) & 0xfff) == 0);
 		// Fill mapping with zeroes
 		// TODO: if this mapping is fd-backed, fill it with fd contents
@@ -132,8 +151,7 @@ void mem_mapping_t::ensure_backed(size_t page)
 		memset(b.ptr, 0, PAGE_SIZE);
 
 		// Re-map to userland
-		void *phys = get_map_virtual()->to_physical_address(b.ptr);
-		*page_entry = reinterpret_cast<uint32_t>(phys) | 0x07; // TODO: use the correct permission bits
+		*page_entry = phys | 0x07; // TODO: use the correct permission bits
 		get_map_virtual()->unmap_page_only(b.ptr);
 	}
 }
@@ -145,33 +163,95 @@ void mem_mapping_t::ensure_completely_backed()
 	}
 }
 
+void mem_mapping_t::handle_fault(size_t page)
+{
+	assert(page < number_of_pages);
+	size_t first = page;
+	size_t last = page + 1;
+	switch(advice) {
+	case CLOUDABI_ADVICE_RANDOM:
+		// neighbouring pages are unlikely to be needed soon
+		break;
+	case CLOUDABI_ADVICE_SEQUENTIAL:
+		// the pages after this one will probably be needed next
+		last = page + FAULT_AHEAD_PAGES;
+		break;
+	default:
+		first = page - page % FAULT_AROUND_PAGES;
+		last = first + FAULT_AROUND_PAGES;
+		break;
+	}
+	if(last > number_of_pages) {
+		last = number_of_pages;
+	}
+	for(size_t i = first; i < last; ++i) {
+		ensure_backed(i);
+	}
+}
+
+size_t mem_mapping_t::back_with_hugepages()
+{
+	size_t installed = 0;
+	uint32_t address = reinterpret_cast<uint32_t>(virtual_address);
+	uint32_t end = address + number_of_pages * PAGE_SIZE;
+	uint32_t huge_address = align_up(address, process_fd::HUGEPAGE_SIZE);
+	for(; huge_address + process_fd::HUGEPAGE_SIZE <= end; huge_address += process_fd::HUGEPAGE_SIZE) {
+		if(!owner->map_hugepage(page_table_index(huge_address), protection)) {
+			// out of contiguous memory; the rest uses normal pages
+			break;
+		}
+		installed++;
+	}
+	return installed;
+}
+
 void mem_mapping_t::unmap(size_t page)
 {
 	if(page > number_of_pages) {
 		kernel_panic("page out of range");
 	}
+	uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * page;
+	uint16_t page_table_num = page_table_index(reinterpret_cast<uintptr_t>(address));
+	if(owner->get_hugepage(page_table_num) != 0) {
+		// only part of this hugepage is unmapped
+		owner->demote_hugepage(page_table_num);
+	}
 	auto *page_entry = get_page_entry(page);
-	if(page_entry == nullptr) {
+	if(page_entry == nullptr || !(*page_entry & 0x1)) {
 		return;
 	}
-	void *phys = reinterpret_cast<void*>(*page_entry & 0xfffff000);
+	physaddr_t phys = *page_entry & PAGE_ENTRY_ADDRESS_MASK;
 
 	*page_entry = 0;
 
-	uint8_t *address = reinterpret_cast<uint8_t*>(virtual_address) + PAGE_SIZE * page;
 	asm volatile ( "invlpg (%0)" : : "b"(address) : "memory");
 
 	// TODO: don't deallocate physical page if the page is shared!
-	get_page_allocator()->deallocate_phys({phys, PAGE_SIZE});
+	get_page_allocator()->deallocate_phys_page(phys);
 }
 
-void mem_mapping_t::unmap_completely()
+void mem_mapping_t::unmap_range(size_t page, size_t num_pages)
 {
-	for(size_t i = 0; i < number_of_pages; ++i) {
+	assert(page + num_pages <= number_of_pages);
+	for(size_t i = page; i < page + num_pages; ++i) {
+		uint32_t address = reinterpret_cast<uint32_t>(virtual_address) + PAGE_SIZE * i;
+		if((address % process_fd::HUGEPAGE_SIZE) == 0
+		&& i + process_fd::PAGES_PER_HUGEPAGE <= page + num_pages
+		&& owner->get_hugepage(page_table_index(address)) != 0) {
+			// the whole hugepage goes at once
+			owner->unmap_hugepage(page_table_index(address));
+			i += process_fd::PAGES_PER_HUGEPAGE - 1;
+			continue;
+		}
 		unmap(i);
 	}
 }
 
+void mem_mapping_t::unmap_completely()
+{
+	unmap_range(0, number_of_pages);
+}
+
 mem_mapping_t *mem_mapping_t::split_at(size_t page, bool return_left) {
 	assert(page > 0);
 	assert(page < number_of_pages);
@@ -204,6 +284,13 @@ mem_mapping_t *mem_mapping_t::split_at(size_t page, bool return_left) {
 		their_new_offset = backing_offset + PAGE_SIZE * my_new_num_pages;
 	}
 
+	// a hugepage can only belong to a single mapping, so if the split
+	// point falls inside one, it must be broken up into normal pages
+	uint32_t split_address = reinterpret_cast<uint32_t>(virtual_address) + PAGE_SIZE * page;
+	if((split_address % process_fd::HUGEPAGE_SIZE) != 0 && owner->get_hugepage(page_table_index(split_address)) != 0) {
+		owner->demote_hugepage(page_table_index(split_address));
+	}
+
 	mem_mapping_t *new_mapping =
 		allocate<mem_mapping_t>(owner, their_new_address, their_new_num_pages, backing_fd, their_new_offset, protection, advice);
 
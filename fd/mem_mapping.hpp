@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <oslibc/list.hpp>
 #include <cloudabi_types.h>
+#include <memory/paging.hpp>
 
 namespace cloudos {
 
@@ -39,9 +40,10 @@ struct mem_mapping_t {
 
 	// Make a new mapping from the old one
 	mem_mapping_t(process_fd *owner, mem_mapping_t *other);
-	// Copy the contents of the old mapping. This assumes this->owner
-	// is currently active, and also returns as such.
-	void copy_from(mem_mapping_t *other);
+	// Copy the contents of the same range in the given process. This
+	// assumes this->owner is currently active, and also returns as such.
+	// It contains preemption points.
+	void copy_from(process_fd *source);
 
 	bool covers(void *addr, size_t len = 0);
 
@@ -57,14 +59,26 @@ struct mem_mapping_t {
 	// Either way, all uninitialized bytes need to be filled with zeroes.
 	void ensure_backed(size_t page);
 	void ensure_completely_backed();
-
+	// Back every hugepage-aligned hugepage-sized range of this mapping
+	// that isn't backed yet with a hugepage, as long as contiguous physical memory
+	// is available. Returns the number of hugepages installed; any pages
+	// left over can be backed normally using ensure_backed().
+	size_t back_with_hugepages();
+
+	// Handle a page fault on the given page: back it, and, depending on
+	// the advice given for this mapping, the pages around it as well.
+	void handle_fault(size_t page);
+
+	// Release the physical pages backing this page or range of pages, but
+	// keep them in the mapping. Unbacked pages are skipped.
 	void unmap(size_t page);
+	void unmap_range(size_t page, size_t num_pages);
 	void unmap_completely();
 
 	mem_mapping_t *split_at(size_t page, bool return_left);
 
-	uint32_t *get_page_entry(size_t page);
-	uint32_t *ensure_get_page_entry(size_t page);
+	page_entry_t *get_page_entry(size_t page);
+	page_entry_t *ensure_get_page_entry(size_t page);
 
 	void *virtual_address; /* always page-aligned */
 	size_t number_of_pages;
@@ -76,6 +90,13 @@ struct mem_mapping_t {
 	cloudabi_filesize_t backing_offset;
 
 	cloudabi_advice_t advice;
+
+	// Number of pages backed around a faulting page, for mappings with
+	// normal advice. The window is aligned to its own size.
+	static const size_t FAULT_AROUND_PAGES = 16;
+	// Number of pages backed from a faulting page onwards, for mappings
+	// with sequential advice.
+	static const size_t FAULT_AHEAD_PAGES = 64;
 };
 
 }
@@ -2,54 +2,156 @@
 
 using namespace cloudos;
 
-pipe_fd::pipe_fd(size_t c, const char *n)
-: fd_t(CLOUDABI_FILETYPE_FIFO, n)
-, buffer(nullptr)
+static bool is_power_of_two(size_t x) {
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+static bool pipe_is_readable(void *p, thread_condition*) {
+	return reinterpret_cast<pipe_buffer*>(p)->is_readable();
+}
+
+static bool pipe_is_writable(void *p, thread_condition*) {
+	return reinterpret_cast<pipe_buffer*>(p)->is_writable();
+}
+
+pipe_buffer::pipe_buffer(size_t c, size_t m)
+: buffer(nullptr)
+, head(0)
 , used(0)
 , capacity(c)
+, max_capacity(m)
 {
+	assert(is_power_of_two(capacity) && is_power_of_two(max_capacity));
+	assert(capacity <= max_capacity);
 	Blk b = allocate(capacity);
 	buffer = reinterpret_cast<char*>(b.ptr);
+
+	readcv.get_signaler().set_already_satisfied_function(pipe_is_readable, this);
+	writecv.get_signaler().set_already_satisfied_function(pipe_is_writable, this);
+}
+
+pipe_buffer::~pipe_buffer()
+{
+	deallocate({buffer, capacity});
 }
 
-pipe_fd::~pipe_fd()
+void pipe_buffer::grow(size_t needed)
 {
+	size_t new_capacity = capacity;
+	while(new_capacity < needed && new_capacity < max_capacity) {
+		new_capacity *= 2;
+	}
+	if(new_capacity == capacity) {
+		return;
+	}
+
+	Blk b = allocate(new_capacity);
+	if(b.ptr == nullptr) {
+		// keep using the current buffer
+		return;
+	}
+	char *new_buffer = reinterpret_cast<char*>(b.ptr);
+
+	// move the data to the start of the new buffer
+	size_t first = used < capacity - head ? used : capacity - head;
+	memcpy(new_buffer, buffer + head, first);
+	memcpy(new_buffer + first, buffer, used - first);
+
 	deallocate({buffer, capacity});
+	buffer = new_buffer;
+	capacity = new_capacity;
+	head = 0;
 }
 
-size_t pipe_fd::read(void *dest, size_t count)
+size_t pipe_buffer::read(void *dest, size_t count, bool nonblock, cloudabi_errno_t *error)
 {
 	// count > capacity is no problem, we limit to the used size
-	error = 0;
+	*error = 0;
 
 	while(used == 0) {
+		if(nonblock) {
+			*error = EAGAIN;
+			return 0;
+		}
 		readcv.wait();
 	}
 	size_t num_bytes = count <= used ? count : used;
-	memcpy(dest, buffer, num_bytes);
 
-	size_t remaining_bytes = used - num_bytes;
-	if(remaining_bytes > 0) {
-		memcpy(buffer, buffer + num_bytes, remaining_bytes);
-	}
-	used = remaining_bytes;
+	// the data may wrap around the end of the buffer
+	size_t first = num_bytes < capacity - head ? num_bytes : capacity - head;
+	memcpy(dest, buffer + head, first);
+	memcpy(reinterpret_cast<char*>(dest) + first, buffer, num_bytes - first);
+
+	head = (head + num_bytes) & (capacity - 1);
+	used -= num_bytes;
 	writecv.broadcast();
 	return num_bytes;
 }
 
-size_t pipe_fd::write(const char *str, size_t count)
+size_t pipe_buffer::write(const char *str, size_t count, bool nonblock, cloudabi_errno_t *error)
 {
-	if(count > capacity) {
-		count = capacity;
+	if(used + count > capacity) {
+		grow(used + count);
 	}
 
-	while(used + count > capacity) {
-		writecv.wait();
-	}
+	// if it still doesn't fit, write it in chunks as the reader makes room
+	size_t written = 0;
+	while(written < count) {
+		while(used == capacity) {
+			if(nonblock) {
+				*error = written == 0 ? EAGAIN : 0;
+				return written;
+			}
+			writecv.wait();
+		}
+
+		size_t tail = (head + used) & (capacity - 1);
+		size_t num_bytes = count - written;
+		if(num_bytes > capacity - used) {
+			num_bytes = capacity - used;
+		}
+		size_t first = num_bytes < capacity - tail ? num_bytes : capacity - tail;
+		memcpy(buffer + tail, str + written, first);
+		memcpy(buffer, str + written + first, num_bytes - first);
 
-	memcpy(buffer + used, str, count);
-	used += count;
-	readcv.broadcast();
-	error = 0;
+		used += num_bytes;
+		written += num_bytes;
+		readcv.broadcast();
+	}
+	*error = 0;
 	return count;
 }
+
+pipe_read_fd::pipe_read_fd(shared_ptr<pipe_buffer> p, const char *n)
+: fd_t(CLOUDABI_FILETYPE_FIFO, n)
+, pipe(p)
+{
+}
+
+size_t pipe_read_fd::read(void *dest, size_t count)
+{
+	return pipe->read(dest, count, flags & CLOUDABI_FDFLAG_NONBLOCK, &error);
+}
+
+cloudabi_errno_t pipe_read_fd::get_read_signaler(thread_condition_signaler **s)
+{
+	*s = &pipe->get_read_signaler();
+	return 0;
+}
+
+pipe_write_fd::pipe_write_fd(shared_ptr<pipe_buffer> p, const char *n)
+: fd_t(CLOUDABI_FILETYPE_FIFO, n)
+, pipe(p)
+{
+}
+
+size_t pipe_write_fd::write(const char *str, size_t count)
+{
+	return pipe->write(str, count, flags & CLOUDABI_FDFLAG_NONBLOCK, &error);
+}
+
+cloudabi_errno_t pipe_write_fd::get_write_signaler(thread_condition_signaler **s)
+{
+	*s = &pipe->get_write_signaler();
+	return 0;
+}
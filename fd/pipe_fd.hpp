@@ -6,35 +6,86 @@
 namespace cloudos {
 
 /**
- * A pipe/fifo FD.
+ * The buffer of a pipe/fifo, shared by its read end and its write end.
  *
- * This FD implements a FIFO pipe: anything written to it, can also be read
- * from it. Normally, this FD is added to a process twice: once in read mode,
- * once in write mode -- but this is not enforced by the pipe_fd
- * implementation.
+ * The data is kept in a ring buffer whose capacity is a power of two, so
+ * that reads and writes copy at most two pieces and never move the data
+ * that remains. When a write doesn't fit, the buffer is grown, up to
+ * max_capacity.
  */
-struct pipe_fd : fd_t {
-	pipe_fd(size_t capacity, const char *n);
-	~pipe_fd() override;
+struct pipe_buffer {
+	pipe_buffer(size_t capacity, size_t max_capacity);
+	~pipe_buffer();
 
 	/** read() blocks until at least 1 byte of data is available;
 	 * then, it returns up to count bytes of data in the dest buffer.
-	 * It sets invalid_argument as the error if offset is not 0.
+	 * If the pipe is empty and nonblock is set, it sets EAGAIN.
 	 */
-	size_t read(void *dest, size_t count) override;
+	size_t read(void *dest, size_t count, bool nonblock, cloudabi_errno_t *error);
 
-	/** write() blocks until there is capacity for at least count
-	 * bytes, then, it appends the given buffer to the stored one.
+	/** write() appends the given buffer to the stored one, blocking
+	 * whenever the buffer is full until the reader made room for the
+	 * rest of it. If nonblock is set, it returns the number of bytes
+	 * that fit instead, or sets EAGAIN if none did.
 	 */
-	size_t write(const char * /*str*/, size_t /*count*/) override;
+	size_t write(const char *str, size_t count, bool nonblock, cloudabi_errno_t *error);
+
+	inline thread_condition_signaler &get_read_signaler() { return readcv.get_signaler(); }
+	inline thread_condition_signaler &get_write_signaler() { return writecv.get_signaler(); }
+
+	inline bool is_readable() { return used > 0; }
+	inline bool is_writable() { return used < capacity; }
+
+	static const size_t DEFAULT_CAPACITY = 1024 /* bytes */;
+	static const size_t DEFAULT_MAX_CAPACITY = 64 * 1024 /* bytes */;
 
 private:
+	// Try to grow the buffer so that it can hold at least the given
+	// number of bytes
+	void grow(size_t needed);
+
 	char *buffer;
+	// The position of the first byte to be read
+	size_t head;
 	size_t used;
 	size_t capacity;
+	size_t max_capacity;
 
 	cv_t readcv;
 	cv_t writecv;
 };
 
+/**
+ * The read end of a pipe/fifo.
+ *
+ * Both ends of a pipe are separate FDs referring to the same pipe_buffer,
+ * so that each has its own flags. If the read end has
+ * CLOUDABI_FDFLAG_NONBLOCK set, reads that would block fail with EAGAIN
+ * instead.
+ */
+struct pipe_read_fd : fd_t {
+	pipe_read_fd(shared_ptr<pipe_buffer> pipe, const char *n);
+
+	size_t read(void *dest, size_t count) override;
+	cloudabi_errno_t get_read_signaler(thread_condition_signaler **s) override;
+
+private:
+	shared_ptr<pipe_buffer> pipe;
+};
+
+/**
+ * The write end of a pipe/fifo. If it has CLOUDABI_FDFLAG_NONBLOCK set,
+ * writes that would block write what fits, or fail with EAGAIN if nothing
+ * does.
+ */
+struct pipe_write_fd : fd_t {
+	pipe_write_fd(shared_ptr<pipe_buffer> pipe, const char *n);
+
+	size_t write(const char *str, size_t count) override;
+	cloudabi_errno_t get_write_signaler(thread_condition_signaler **s) override;
+
+private:
+	shared_ptr<pipe_buffer> pipe;
+};
+
 }
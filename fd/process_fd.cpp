@@ -1,4 +1,5 @@
 #include <concur/cv.hpp>
+#include <concur/wait_table.hpp>
 #include <elf.h>
 #include <fd/bootfs.hpp>
 #include <fd/ifstoresock.hpp>
@@ -22,24 +23,29 @@ static bool process_already_terminated(void *userdata, thread_condition*) {
 	return reinterpret_cast<process_fd*>(userdata)->is_terminated();
 }
 
+static process_list *all_processes = nullptr;
+
 process_fd::process_fd(const char *n)
 : fd_t(CLOUDABI_FILETYPE_PROCESS, n)
 {
-	Blk page_directory_alloc = allocate_aligned(PAGE_SIZE, PAGE_SIZE);
+	all_item.data = this;
+	append(&all_processes, &all_item);
+
+	Blk page_directory_alloc = allocate_aligned(PAGE_DIRECTORY_ALLOC_SIZE, PAGE_SIZE);
 	if(page_directory_alloc.ptr == 0) {
 		kernel_panic("Couldn't allocate page directory for new process");
 	}
-	page_directory = reinterpret_cast<uint32_t*>(page_directory_alloc.ptr);
-	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(uint32_t));
+	page_directory = reinterpret_cast<page_entry_t*>(page_directory_alloc.ptr);
+	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(page_entry_t));
 
 	get_map_virtual()->fill_kernel_pages(page_directory);
 
-	Blk page_tables_alloc = allocate(0x300 * sizeof(uint32_t*));
+	Blk page_tables_alloc = allocate(KERNEL_PAGE_OFFSET * sizeof(page_entry_t*));
 	if(page_tables_alloc.ptr == 0) {
 		kernel_panic("Couldn't allocate page tables list for new process");
 	}
-	page_tables = reinterpret_cast<uint32_t**>(page_tables_alloc.ptr);
-	for(size_t i = 0; i < 0x300; ++i) {
+	page_tables = reinterpret_cast<page_entry_t**>(page_tables_alloc.ptr);
+	for(size_t i = 0; i < KERNEL_PAGE_OFFSET; ++i) {
 		page_tables[i] = nullptr;
 	}
 
@@ -49,13 +55,18 @@ process_fd::process_fd(const char *n)
 process_fd::~process_fd()
 {
 	if(running) {
-		// immediately exit
-		exit(0, CLOUDABI_SIGKILL);
+		// immediately exit; it's too late to hand this process to the
+		// reaper, so its memory is released below
+		terminate(0, CLOUDABI_SIGKILL);
 	}
 	assert(!running);
 
 	assert(threads == nullptr);
 
+	remove_one(&all_processes, [&](process_list *item) {
+		return item == &all_item;
+	}, intrusive_list_deallocator<process_fd*>());
+
 	if(fds != nullptr) {
 		deallocate({fds, fd_capacity * sizeof(fd_mapping_t*)});
 		fds = nullptr;
@@ -70,13 +81,13 @@ process_fd::~process_fd()
 		deallocate(item);
 	});
 
-	deallocate({page_directory, PAGE_SIZE});
-	for(size_t i = 0; i < 0x300; ++i) {
+	deallocate({page_directory, PAGE_DIRECTORY_ALLOC_SIZE});
+	for(size_t i = 0; i < KERNEL_PAGE_OFFSET; ++i) {
 		if(page_tables[i] != 0) {
 			deallocate({page_tables[i], PAGE_SIZE});
 		}
 	}
-	deallocate({page_tables, 0x300 * sizeof(uint32_t*)});
+	deallocate({page_tables, KERNEL_PAGE_OFFSET * sizeof(page_entry_t*)});
 }
 
 void process_fd::add_initial_fds() {
@@ -205,21 +216,25 @@ cloudabi_errno_t process_fd::close_fd(cloudabi_fd_t num) {
 	return res;
 }
 
-uint32_t *process_fd::get_page_table(int i) {
-	if(i >= 0x300) {
+page_entry_t *process_fd::get_page_table(int i) {
+	if(i >= KERNEL_PAGE_OFFSET) {
 		kernel_panic("process_fd::get_page_table() cannot answer for kernel pages");
 	}
-	if(page_directory[i] & 0x1 /* present */) {
+	if((page_directory[i] & 0x81) == 0x1 /* present, not a hugepage */) {
 		return page_tables[i];
 	} else {
 		return nullptr;
 	}
 }
 
-uint32_t *process_fd::ensure_get_page_table(int i) {
-	if(i >= 0x300) {
+page_entry_t *process_fd::ensure_get_page_table(int i) {
+	if(i >= KERNEL_PAGE_OFFSET) {
 		kernel_panic("process_fd::ensure_page_table() cannot answer for kernel pages");
 	}
+	if(get_hugepage(i) != 0) {
+		// the caller wants to handle individual pages, so split it up
+		demote_hugepage(i);
+	}
 	if(page_directory[i] & 0x1 /* present */) {
 		return page_tables[i];
 	}
@@ -235,21 +250,180 @@ uint32_t *process_fd::ensure_get_page_table(int i) {
 	assert((reinterpret_cast<uint32_t>(address) & 0xfff) == 0);
 
 	page_directory[i] = reinterpret_cast<uint64_t>(address) | 0x07;
-	page_tables[i] = reinterpret_cast<uint32_t*>(table_alloc.ptr);
+	page_tables[i] = reinterpret_cast<page_entry_t*>(table_alloc.ptr);
 	return page_tables[i];
 }
 
+page_entry_t process_fd::get_hugepage(int i) {
+	if(i >= KERNEL_PAGE_OFFSET) {
+		kernel_panic("process_fd::get_hugepage() cannot answer for kernel pages");
+	}
+	page_entry_t entry = page_directory[i];
+	if((entry & 0x81) == 0x81 /* present, hugepage */) {
+		return entry;
+	} else {
+		return 0;
+	}
+}
+
+bool process_fd::is_backed(void *addr) {
+	auto address = reinterpret_cast<uintptr_t>(addr);
+	size_t table = page_table_index(address);
+	if(get_hugepage(table) != 0) {
+		return true;
+	}
+	page_entry_t *page_table = get_page_table(table);
+	return page_table != nullptr && (page_table[page_entry_index(address)] & 0x1);
+}
+
+physaddr_t process_fd::get_physical_address(void *addr) {
+	auto address = reinterpret_cast<uintptr_t>(addr);
+	size_t table = page_table_index(address);
+	page_entry_t hugepage = get_hugepage(table);
+	if(hugepage != 0) {
+		return (hugepage & HUGEPAGE_ADDRESS_MASK) | (address & (HUGEPAGE_SIZE - 1));
+	}
+	page_entry_t *page_table = get_page_table(table);
+	if(page_table == nullptr || (page_table[page_entry_index(address)] & 0x1) == 0) {
+		return 0;
+	}
+	return (page_table[page_entry_index(address)] & PAGE_ENTRY_ADDRESS_MASK) | (address & (PAGE_SIZE - 1));
+}
+
+bool process_fd::copy_to(void *d, const void *s, size_t len) {
+	auto *dest = reinterpret_cast<uint8_t*>(d);
+	auto *src = reinterpret_cast<const uint8_t*>(s);
+	if(reinterpret_cast<uintptr_t>(dest) >= 0xc0000000) {
+		// kernel memory is mapped in every process
+		memcpy(dest, src, len);
+		return true;
+	}
+
+	while(len > 0) {
+		if(reinterpret_cast<uintptr_t>(dest) >= 0xc0000000) {
+			// userland buffer runs into kernel memory
+			return false;
+		}
+		physaddr_t phys = get_physical_address(dest);
+		if(phys == 0) {
+			if(!handle_page_fault(dest)) {
+				return false;
+			}
+			phys = get_physical_address(dest);
+			assert(phys != 0);
+		}
+
+		// copy at most until the end of the physical page
+		size_t page_offset = phys & (PAGE_SIZE - 1);
+		size_t copy = PAGE_SIZE - page_offset;
+		if(copy > len) {
+			copy = len;
+		}
+		Blk b = get_map_virtual()->map_pages_only(phys - page_offset, PAGE_SIZE);
+		if(b.ptr == nullptr) {
+			return false;
+		}
+		memcpy(reinterpret_cast<uint8_t*>(b.ptr) + page_offset, src, copy);
+		get_map_virtual()->unmap_page_only(b.ptr);
+
+		dest += copy;
+		src += copy;
+		len -= copy;
+	}
+	return true;
+}
+
+bool process_fd::map_hugepage(int i, cloudabi_mprot_t protection) {
+	if(i >= KERNEL_PAGE_OFFSET) {
+		kernel_panic("process_fd::map_hugepage() cannot map kernel pages");
+	}
+	if(page_directory[i] & 0x1 /* present */) {
+		// this range is already (partly) backed by normal pages
+		return false;
+	}
+
+	Blk phys = get_page_allocator()->allocate_contiguous_phys(PAGES_PER_HUGEPAGE, HUGEPAGE_SIZE);
+	if(phys.ptr == 0) {
+		return false;
+	}
+	assert((reinterpret_cast<uint32_t>(phys.ptr) & (HUGEPAGE_SIZE - 1)) == 0);
+
+	// Fill the hugepage with zeroes, one page at a time, so we don't need
+	// a hugepage worth of contiguous kernel address space
+	for(size_t p = 0; p < PAGES_PER_HUGEPAGE; ++p) {
+		void *page_phys = reinterpret_cast<uint8_t*>(phys.ptr) + p * PAGE_SIZE;
+		Blk b = get_map_virtual()->map_pages_only(page_phys, PAGE_SIZE);
+		if(b.ptr == 0) {
+			kernel_panic("Failed to map hugepage into kernel memory");
+		}
+		memset(b.ptr, 0, PAGE_SIZE);
+		get_map_virtual()->unmap_page_only(b.ptr);
+	}
+
+	// present, user and page size; read/write only if writes are allowed
+	page_entry_t flags = 0x85;
+	if(protection & CLOUDABI_PROT_WRITE) {
+		flags |= 0x02;
+	}
+	page_directory[i] = reinterpret_cast<uint32_t>(phys.ptr) | flags;
+	page_tables[i] = nullptr;
+	hugepages_in_use++;
+	return true;
+}
+
+void process_fd::demote_hugepage(int i) {
+	page_entry_t entry = get_hugepage(i);
+	assert(entry != 0);
+
+	Blk table_alloc = allocate_aligned(PAGE_SIZE, PAGE_SIZE);
+	if(table_alloc.ptr == 0) {
+		kernel_panic("Failed to allocate page table to demote hugepage");
+	}
+
+	// the physical pages stay where they are, only the bookkeeping moves
+	page_entry_t *table = reinterpret_cast<page_entry_t*>(table_alloc.ptr);
+	physaddr_t phys = entry & HUGEPAGE_ADDRESS_MASK;
+	// present and user, and read/write if the hugepage was
+	page_entry_t flags = 0x05 | (entry & 0x02);
+	for(size_t p = 0; p < PAGES_PER_HUGEPAGE; ++p) {
+		table[p] = (phys + p * PAGE_SIZE) | flags;
+	}
+
+	auto address = get_map_virtual()->to_physical_address(table_alloc.ptr);
+	assert((reinterpret_cast<uint32_t>(address) & 0xfff) == 0);
+
+	page_directory[i] = reinterpret_cast<uint32_t>(address) | 0x07;
+	page_tables[i] = table;
+	hugepages_in_use--;
+
+	uint32_t virtual_address = i * HUGEPAGE_SIZE;
+	asm volatile ( "invlpg (%0)" : : "b"(virtual_address) : "memory");
+}
+
+void process_fd::unmap_hugepage(int i) {
+	page_entry_t entry = get_hugepage(i);
+	assert(entry != 0);
+
+	page_directory[i] = 0;
+	hugepages_in_use--;
+
+	uint32_t virtual_address = i * HUGEPAGE_SIZE;
+	asm volatile ( "invlpg (%0)" : : "b"(virtual_address) : "memory");
+
+	// TODO: don't deallocate physical pages if the hugepage is shared!
+	get_page_allocator()->deallocate_phys({reinterpret_cast<void*>(static_cast<uint32_t>(entry & HUGEPAGE_ADDRESS_MASK)), HUGEPAGE_SIZE});
+}
+
 void process_fd::install_page_directory() {
 	/* some sanity checks to warn early if the page directory looks incorrect */
 	assert(get_map_virtual()->to_physical_address(this, reinterpret_cast<void*>(0xc00b8000)) == reinterpret_cast<void*>(0xb8000));
 	assert(get_map_virtual()->to_physical_address(this, reinterpret_cast<void*>(0xc01031c6)) == reinterpret_cast<void*>(0x1031c6));
 
 #ifndef TESTING_ENABLED
-	auto page_phys_address = get_map_virtual()->to_physical_address(&page_directory[0]);
-	assert((reinterpret_cast<uint32_t>(page_phys_address) & 0xfff) == 0);
+	auto paging_root = get_map_virtual()->get_paging_root(page_directory);
 
 	// Set the paging directory in cr3
-	asm volatile("mov %0, %%cr3" : : "a"(reinterpret_cast<uint32_t>(page_phys_address)) : "memory");
+	asm volatile("mov %0, %%cr3" : : "a"(paging_root) : "memory");
 #endif
 }
 
@@ -361,10 +535,110 @@ void process_fd::mem_unmap(void *begin_addr, size_t num_pages)
 	append(&mappings, new_mappings);
 }
 
-void *process_fd::find_free_virtual_range(size_t num_pages)
+cloudabi_errno_t process_fd::mem_advise(void *begin_addr, size_t num_pages, cloudabi_advice_t advice)
+{
+	auto begin = reinterpret_cast<size_t>(begin_addr);
+	auto end = begin + num_pages * PAGE_SIZE;
+	assert(begin < end);
+
+	// Check whether the whole range is mapped, before changing anything
+	size_t pages_covered = 0;
+	iterate(mappings, [&](mem_mapping_list *item) {
+		auto i_begin = reinterpret_cast<size_t>(item->data->virtual_address);
+		auto i_end = i_begin + item->data->number_of_pages * PAGE_SIZE;
+		if(end > i_begin && begin < i_end) {
+			pages_covered += ((end < i_end ? end : i_end) - (begin > i_begin ? begin : i_begin)) / PAGE_SIZE;
+		}
+	});
+	if(pages_covered != num_pages) {
+		return ENOMEM;
+	}
+
+	mem_mapping_list *new_mappings = nullptr;
+	iterate(mappings, [&](mem_mapping_list *item) {
+		mem_mapping_t *mapping = item->data;
+		auto i_begin = reinterpret_cast<size_t>(mapping->virtual_address);
+		auto i_end = i_begin + mapping->number_of_pages * PAGE_SIZE;
+		if(end <= i_begin || begin >= i_end) {
+			return;
+		}
+
+		size_t first = begin > i_begin ? (begin - i_begin) / PAGE_SIZE : 0;
+		size_t last = end < i_end ? (end - i_begin) / PAGE_SIZE : mapping->number_of_pages;
+
+		switch(advice) {
+		case CLOUDABI_ADVICE_WILLNEED:
+			// TODO: once fd-backed mappings exist, read their contents
+			// ahead here as well
+			for(size_t i = first; i < last; ++i) {
+				mapping->ensure_backed(i);
+			}
+			break;
+		case CLOUDABI_ADVICE_DONTNEED:
+			// The pages are given back to the page allocator; the
+			// next access faults in a zero-filled page
+			mapping->unmap_range(first, last - first);
+			break;
+		default:
+			if(mapping->advice == advice) {
+				break;
+			}
+			// split the mapping, such that this item remains the
+			// part the advice applies to
+			if(first > 0) {
+				mem_mapping_t *mapping_left = mapping->split_at(first, true);
+				append(&new_mappings, allocate<mem_mapping_list>(mapping_left));
+				last -= first;
+				first = 0;
+			}
+			if(last < mapping->number_of_pages) {
+				mem_mapping_t *mapping_right = mapping->split_at(last, false);
+				append(&new_mappings, allocate<mem_mapping_list>(mapping_right));
+			}
+			assert(mapping->virtual_address >= begin_addr);
+			mapping->advice = advice;
+			break;
+		}
+	});
+	append(&mappings, new_mappings);
+	return 0;
+}
+
+bool process_fd::handle_page_fault(void *addr)
+{
+	if(reinterpret_cast<uint32_t>(addr) >= 0xc0000000) {
+		// kernel memory is never faulted in
+		return false;
+	}
+
+	mem_mapping_t *mapping = nullptr;
+	iterate(mappings, [&](mem_mapping_list *item) {
+		if(item->data->covers(addr)) {
+			mapping = item->data;
+		}
+	});
+	if(mapping == nullptr) {
+		return false;
+	}
+
+	size_t page = (reinterpret_cast<uint32_t>(addr) - reinterpret_cast<uint32_t>(mapping->virtual_address)) / PAGE_SIZE;
+	if(mapping->is_backed(page)) {
+		// not caused by a non-present page
+		return false;
+	}
+	mapping->handle_fault(page);
+	return true;
+}
+
+void *process_fd::find_free_virtual_range(size_t num_pages, size_t alignment)
 {
 	uint32_t address = 0x90000000;
-	while(address + num_pages * PAGE_SIZE < 0xc0000000) {
+	while(true) {
+		address = align_up(address, alignment);
+		if(address + num_pages * PAGE_SIZE >= 0xc0000000) {
+			break;
+		}
+
 		// - find the first lowest map after address
 		mem_mapping_t *lowest = nullptr;
 		iterate(mappings, [&](mem_mapping_list *item) {
@@ -391,6 +665,16 @@ void *process_fd::find_free_virtual_range(size_t num_pages)
 	return nullptr;
 }
 
+void process_fd::get_mapping_stats(size_t *num_mappings, size_t *num_pages)
+{
+	*num_mappings = 0;
+	*num_pages = 0;
+	iterate(mappings, [&](mem_mapping_list *item) {
+		(*num_mappings)++;
+		*num_pages += item->data->number_of_pages;
+	});
+}
+
 cloudabi_errno_t process_fd::exec(shared_ptr<fd_t> fd, size_t fdslen, fd_mapping_t **new_fds, void const *argdata, size_t argdatalen) {
 	// read from this fd until it gives EOF, then exec(buf, buf_size)
 	// TODO: memory map instead of reading it in full
@@ -410,6 +694,8 @@ cloudabi_errno_t process_fd::exec(shared_ptr<fd_t> fd, size_t fdslen, fd_mapping
 		if(read < blk.size) {
 			break;
 		}
+		// Let other threads run while reading a large binary
+		get_scheduler()->preempt_point();
 	} while(fd->error == 0);
 
 	if(fd->error != 0) {
@@ -434,6 +720,7 @@ cloudabi_errno_t process_fd::exec(shared_ptr<fd_t> fd, size_t fdslen, fd_mapping
 
 		deallocate(item->data);
 		deallocate(item);
+		get_scheduler()->preempt_point();
 	}
 	assert(elf_pieces == nullptr);
 	assert(total_size == 0);
@@ -446,28 +733,28 @@ cloudabi_errno_t process_fd::exec(shared_ptr<fd_t> fd, size_t fdslen, fd_mapping
 
 	char old_name[sizeof(name)];
 	strncpy(old_name, name, sizeof(name));
-	uint32_t *old_page_directory = page_directory;
-	uint32_t **old_page_tables = page_tables;
+	page_entry_t *old_page_directory = page_directory;
+	page_entry_t **old_page_tables = page_tables;
 	mem_mapping_list *old_mappings = mappings;
 
 	strncpy(name, "exec<-", sizeof(name));
 	strncat(name, fd->name, sizeof(name) - strlen(name) - 1);
 
-	Blk page_directory_alloc = allocate_aligned(PAGE_SIZE, PAGE_SIZE);
+	Blk page_directory_alloc = allocate_aligned(PAGE_DIRECTORY_ALLOC_SIZE, PAGE_SIZE);
 	if(page_directory_alloc.ptr == 0) {
 		kernel_panic("Failed to allocate process paging directory");
 	}
-	page_directory = reinterpret_cast<uint32_t*>(page_directory_alloc.ptr);
-	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(uint32_t));
+	page_directory = reinterpret_cast<page_entry_t*>(page_directory_alloc.ptr);
+	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(page_entry_t));
 
 	get_map_virtual()->fill_kernel_pages(page_directory);
 
-	Blk page_tables_alloc = allocate(0x300 * sizeof(uint32_t*));
+	Blk page_tables_alloc = allocate(KERNEL_PAGE_OFFSET * sizeof(page_entry_t*));
 	if(page_tables_alloc.ptr == 0) {
 		kernel_panic("Failed to allocate page table list");
 	}
-	page_tables = reinterpret_cast<uint32_t**>(page_tables_alloc.ptr);
-	for(size_t i = 0; i < 0x300; ++i) {
+	page_tables = reinterpret_cast<page_entry_t**>(page_tables_alloc.ptr);
+	for(size_t i = 0; i < KERNEL_PAGE_OFFSET; ++i) {
 		page_tables[i] = nullptr;
 	}
 	mappings = nullptr;
@@ -539,13 +826,13 @@ cloudabi_errno_t process_fd::exec(shared_ptr<fd_t> fd, size_t fdslen, fd_mapping
 		deallocate(item);
 	});
 
-	deallocate({old_page_directory, PAGE_SIZE});
-	for(size_t i = 0; i < 0x300; ++i) {
+	deallocate({old_page_directory, PAGE_DIRECTORY_ALLOC_SIZE});
+	for(size_t i = 0; i < KERNEL_PAGE_OFFSET; ++i) {
 		if(old_page_tables[i] != 0) {
 			deallocate({old_page_tables[i], PAGE_SIZE});
 		}
 	}
-	deallocate({old_page_tables, 0x300 * sizeof(uint32_t*)});
+	deallocate({old_page_tables, KERNEL_PAGE_OFFSET * sizeof(page_entry_t*)});
 
 	// now, when process is scheduled again, we will return to the entrypoint of the new binary
 	return 0;
@@ -619,6 +906,11 @@ cloudabi_errno_t process_fd::exec(uint8_t *buffer, size_t buffer_size, uint8_t *
 
 	memcpy(elf_phdr, buffer + header->e_phoff, elf_ph_size);
 
+	// Copying the LOAD sections may be preempted in between pages, but
+	// only if no other threads of this process exist; they would run in
+	// the address space that is being built
+	bool preemptible = size(threads) == 1;
+
 	// Map the LOAD sections
 	for(size_t phi = 0; phi < elf_phnum; ++phi) {
 		size_t offset = header->e_phoff + phi * header->e_phentsize;
@@ -643,7 +935,13 @@ cloudabi_errno_t process_fd::exec(uint8_t *buffer, size_t buffer_size, uint8_t *
 			mem_mapping_t *t = allocate<mem_mapping_t>(this, vaddr, len_to_pages(phdr->p_memsz), nullptr, 0, CLOUDABI_PROT_EXEC | CLOUDABI_PROT_READ);
 			add_mem_mapping(t);
 			t->ensure_completely_backed();
-			memcpy(vaddr, code_offset, phdr->p_filesz);
+			for(size_t copied = 0; copied < phdr->p_filesz; copied += PAGE_SIZE) {
+				if(preemptible) {
+					get_scheduler()->preempt_point();
+				}
+				size_t copy = phdr->p_filesz - copied < PAGE_SIZE ? phdr->p_filesz - copied : PAGE_SIZE;
+				memcpy(vaddr + copied, code_offset + copied, copy);
+			}
 			memset(vaddr + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
 		}
 	}
@@ -722,6 +1020,7 @@ void process_fd::fork(shared_ptr<thread> otherthread) {
 
 	strncpy(name, otherprocess->name, sizeof(name));
 	strncat(name, "->forked", sizeof(name) - strlen(name) - 1);
+	priority = otherprocess->priority;
 
 	// set return values for the child. The thread constructor immediately
 	// copies the state to an iret frame on the initial kernel stack, so
@@ -766,9 +1065,13 @@ void process_fd::fork(shared_ptr<thread> otherthread) {
 	iterate(otherprocess->mappings, [&](mem_mapping_list *item) {
 		mem_mapping_t *mapping = allocate<mem_mapping_t>(this, item->data);
 		add_mem_mapping(mapping);
+	});
 
+	// Copying may be preempted, after which the mappings of the other
+	// process may have changed, so iterate over our own copies instead
+	iterate(mappings, [&](mem_mapping_list *item) {
 		// TODO: implement copy-on-write
-		mapping->copy_from(item->data);
+		item->data->copy_from(otherprocess);
 	});
 
 	add_thread(mainthread);
@@ -790,7 +1093,54 @@ shared_ptr<thread> process_fd::add_thread(void *stack_bottom, size_t stack_len,
 	return thr;
 }
 
+shared_ptr<thread> process_fd::add_kernel_thread(kernel_thread_entry_t entry, void *userdata)
+{
+	assert(mappings == nullptr);
+	running = true;
+
+	auto thr = make_shared_aligned<thread>(16, this, entry, userdata, ++last_thread);
+	add_thread(thr);
+	return thr;
+}
+
+size_t process_fd::release_mappings(size_t max_pages)
+{
+	assert(!running);
+
+	size_t released = 0;
+	while(mappings != nullptr && released < max_pages) {
+		mem_mapping_t *mapping = mappings->data;
+		size_t remaining = max_pages - released;
+		if(mapping->number_of_pages > remaining) {
+			// release the tail of this mapping, and keep the rest
+			// for a next batch
+			size_t keep = mapping->number_of_pages - remaining;
+			mapping->unmap_range(keep, remaining);
+			mapping->number_of_pages = keep;
+			return max_pages;
+		}
+
+		released += mapping->number_of_pages;
+		mapping->unmap_completely();
+
+		auto *item = mappings;
+		mappings = item->next;
+		deallocate(mapping);
+		deallocate(item);
+	}
+	return released;
+}
+
 void process_fd::exit(cloudabi_exitcode_t c, cloudabi_signal_t s)
+{
+	terminate(c, s);
+
+	// let the reaper release our memory, instead of doing it in whichever
+	// context drops the last reference to this process
+	get_reaper()->reap_process(shared_from_this());
+}
+
+void process_fd::terminate(cloudabi_exitcode_t c, cloudabi_signal_t s)
 {
 	if(this == global_state_->init) {
 		get_vga_stream() << "init exited with signal " << s << ", exit code " << c << "\n";
@@ -812,10 +1162,13 @@ void process_fd::exit(cloudabi_exitcode_t c, cloudabi_signal_t s)
 		close_fd(i);
 	}
 
-	// deallocation will happen in the destructor
+	// memory is released by the reaper, or in the destructor
 
 	// unschedule all threads
 	exit_all_threads();
+
+	// its private locks and condvars can't be waited on anymore
+	get_wait_table()->forget_process(this);
 }
 
 void process_fd::signal(cloudabi_signal_t s)
@@ -848,80 +1201,69 @@ void process_fd::signal(cloudabi_signal_t s)
 	}
 }
 
-userland_lock_waiters_t *process_fd::get_userland_lock_info(_Atomic(cloudabi_lock_t) *lock)
+void process_fd::remove_thread(shared_ptr<thread> t)
 {
-	auto res = find(userland_locks, [&](userland_lock_waiters_list *item) {
-		return item->data->lock == lock;
+	bool removed = remove_one(&threads, [&t](thread_list *item) {
+		return item->data == t;
 	});
-	return res == nullptr ? nullptr : res->data;
-}
-
-userland_lock_waiters_t *process_fd::get_or_create_userland_lock_info(_Atomic(cloudabi_lock_t) *lock)
-{
-	auto res = get_userland_lock_info(lock);
-	if(res != nullptr) {
-		return res;
-	}
 
-	userland_lock_waiters_t *new_info = allocate<userland_lock_waiters_t>();
-	new_info->lock = lock;
+	(void)removed;
+	assert(removed);
 
-	userland_lock_waiters_list *new_list = allocate<userland_lock_waiters_list>(new_info);
-	append(&userland_locks, new_list);
-	return new_info;
+	exited_runtime += get_scheduler()->get_runtime(t.get());
+	exited_cycles += get_scheduler()->get_cycles(t.get());
+	exited_user_cycles += get_scheduler()->get_user_cycles(t.get());
+	exited_system_cycles += get_scheduler()->get_system_cycles(t.get());
 }
 
-void process_fd::forget_userland_lock_info(_Atomic(cloudabi_lock_t) *lock)
+cloudabi_timestamp_t process_fd::get_runtime()
 {
-	remove_one(&userland_locks, [&](userland_lock_waiters_list *item) {
-		return item->data->lock == lock;
-	}, [&](userland_lock_waiters_list *item) {
-		deallocate(item->data);
-		deallocate(item);
+	cloudabi_timestamp_t runtime = exited_runtime;
+	iterate(threads, [&](thread_list *item) {
+		runtime += get_scheduler()->get_runtime(item->data.get());
 	});
+	return runtime;
 }
 
-userland_condvar_waiters_t *process_fd::get_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar)
+uint64_t process_fd::get_cycles()
 {
-	auto res = find(userland_condvars, [&](userland_condvar_waiters_list *item) {
-		return item->data->condvar == condvar;
+	uint64_t cycles = exited_cycles;
+	iterate(threads, [&](thread_list *item) {
+		cycles += get_scheduler()->get_cycles(item->data.get());
 	});
-	return res == nullptr ? nullptr : res->data;
+	return cycles;
 }
 
-userland_condvar_waiters_t *process_fd::get_or_create_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar)
+uint64_t process_fd::get_user_cycles()
 {
-	auto res = get_userland_condvar_cv(condvar);
-	if(res != nullptr) {
-		return res;
-	}
-
-	userland_condvar_waiters_t *new_info = allocate<userland_condvar_waiters_t>();
-	new_info->condvar = condvar;
-
-	userland_condvar_waiters_list *new_list = allocate<userland_condvar_waiters_list>(new_info);
-	append(&userland_condvars, new_list);
-	return new_info;
+	uint64_t cycles = exited_user_cycles;
+	iterate(threads, [&](thread_list *item) {
+		cycles += get_scheduler()->get_user_cycles(item->data.get());
+	});
+	return cycles;
 }
 
-void process_fd::forget_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar)
+uint64_t process_fd::get_system_cycles()
 {
-	remove_one(&userland_condvars, [&](userland_condvar_waiters_list *item) {
-		return item->data->condvar == condvar;
-	}, [&](userland_condvar_waiters_list *item) {
-		deallocate(item->data);
-		deallocate(item);
+	uint64_t cycles = exited_system_cycles;
+	iterate(threads, [&](thread_list *item) {
+		cycles += get_scheduler()->get_system_cycles(item->data.get());
 	});
+	return cycles;
 }
 
-void process_fd::remove_thread(shared_ptr<thread> t)
+process_list *process_fd::get_all_processes()
 {
-	bool removed = remove_one(&threads, [&t](thread_list *item) {
-		return item->data == t;
-	});
+	return all_processes;
+}
 
-	(void)removed;
-	assert(removed);
+void process_fd::set_priority(uint8_t p)
+{
+	assert(p < scheduler::NUM_PRIORITIES);
+	priority = p;
+	iterate(threads, [&](thread_list *item) {
+		item->data->reset_priority();
+	});
 }
 
 void process_fd::exit_all_threads() {
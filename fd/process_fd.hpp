@@ -3,10 +3,12 @@
 #include "fd.hpp"
 #include "mem_mapping.hpp"
 #include "thread.hpp"
+#include "scheduler.hpp"
 #include <oslibc/list.hpp>
 #include <cloudabi/headers/cloudabi_types.h>
 #include <concur/condition.hpp>
 #include <concur/cv.hpp>
+#include <memory/paging.hpp>
 
 namespace cloudos {
 
@@ -22,23 +24,6 @@ struct fd_mapping_t {
 	cloudabi_rights_t rights_inheriting;
 };
 
-struct userland_lock_waiters_t {
-	_Atomic(cloudabi_lock_t) *lock = nullptr;
-	cv_t readers_cv;
-	size_t number_of_readers = 0;
-	thread_weaklist *waiting_writers = nullptr;
-};
-
-typedef linked_list<userland_lock_waiters_t*> userland_lock_waiters_list;
-
-struct userland_condvar_waiters_t {
-	_Atomic(cloudabi_condvar_t) *condvar = nullptr;
-	size_t waiters = 0;
-	cv_t cv;
-};
-
-typedef linked_list<userland_condvar_waiters_t*> userland_condvar_waiters_list;
-
 /** Process file descriptor
  *
  * This file descriptor contains all information necessary for running a
@@ -47,9 +32,9 @@ typedef linked_list<userland_condvar_waiters_t*> userland_condvar_waiters_list;
  * A process_fd holds its file descriptors, but does not own them, because they
  * may be shared by multiple processes.
  *
- * A process_fd holds and owns its own page directory and the lower 0x300 page
- * tables. The upper 0x100 page tables are in the page directory, but owned by
- * the page_allocator.
+ * A process_fd holds and owns its own page directory and the lower
+ * KERNEL_PAGE_OFFSET page tables. The upper page tables are in the page
+ * directory, but owned by the page_allocator.
  *
  * The process_fd also holds and owns its threads. A process_fd starts without
  * threads, but creates one upon exec(), and copies the calling thread upon
@@ -59,15 +44,35 @@ typedef linked_list<userland_condvar_waiters_t*> userland_condvar_waiters_list;
  * all FDs in the file descriptor list are de-refcounted (and possibly cleaned
  * up). Also, we must ensure that the process FD does not end up in the
  * ready/blocked list again.
+ *
+ * When a process exits, it is handed to the reaper, which releases its memory
+ * mappings in the background and holds a reference to the process until it
+ * is done.
  */
-struct process_fd : public fd_t {
+struct process_fd : public fd_t, public enable_shared_from_this<process_fd> {
 	process_fd(const char *n);
 	~process_fd() override;
 	void add_initial_fds();
 
 	void install_page_directory();
-	uint32_t *get_page_table(int i);
-	uint32_t *ensure_get_page_table(int i);
+	page_entry_t *get_page_table(int i);
+	page_entry_t *ensure_get_page_table(int i);
+
+	// Returns the page directory entry if the given page table index is
+	// mapped using a hugepage, or 0 otherwise.
+	page_entry_t get_hugepage(int i);
+	// Back the given (currently unmapped) page table index with a zeroed
+	// hugepage, writable only if protection allows writes. Returns false
+	// if no suitable physical memory was available; the caller should fall
+	// back to normal pages.
+	bool map_hugepage(int i, cloudabi_mprot_t protection);
+	// Replace the hugepage at the given index by a page table pointing at
+	// the same physical memory, so that its pages can be handled one by one.
+	// The pages keep the permissions of the hugepage.
+	void demote_hugepage(int i);
+	// Unmap the hugepage at the given index and free its physical memory.
+	void unmap_hugepage(int i);
+	inline size_t get_hugepages_in_use() { return hugepages_in_use; }
 
 	// Read an ELF from this fd, map it, and prepare it for execution. This
 	// function will not remove previous process contents, use unexec() for
@@ -95,9 +100,33 @@ struct process_fd : public fd_t {
 	cloudabi_errno_t add_mem_mapping(mem_mapping_t *mapping, bool overwrite = false);
 	// Unmap the given address range
 	void mem_unmap(void *addr, size_t num_pages);
-
-	// Find a piece of the address space that's free to be mapped.
-	void *find_free_virtual_range(size_t num_pages);
+	// Apply the given advice to the given address range. Returns ENOMEM if
+	// part of the range isn't mapped.
+	cloudabi_errno_t mem_advise(void *addr, size_t num_pages, cloudabi_advice_t advice);
+
+	// Try to resolve a page fault on a non-present page at the given
+	// address, by backing it if it is part of a mapping. Returns false
+	// if the fault could not be resolved.
+	bool handle_page_fault(void *addr);
+
+	// Find a piece of the address space that's free to be mapped,
+	// starting at the given alignment.
+	void *find_free_virtual_range(size_t num_pages, size_t alignment = PAGE_SIZE);
+
+	// Returns whether the page at the given userland address is present
+	bool is_backed(void *addr);
+	// Returns the physical address backing the given userland address, or
+	// 0 if its page is not present
+	physaddr_t get_physical_address(void *addr);
+	// Copy the given kernel buffer to the given userland address of this
+	// process, which doesn't need to be the running one. Pages of the
+	// destination that are not present are faulted in. Returns false if
+	// part of the destination isn't mapped; part of it may be written
+	// already then.
+	bool copy_to(void *dest, const void *src, size_t len);
+
+	// Count the mappings in this process, and the pages they span
+	void get_mapping_stats(size_t *num_mappings, size_t *num_pages);
 
 	/* Add a thread to this process.
 	 * auxv_address and entrypoint must already point to valid memory in
@@ -106,20 +135,21 @@ struct process_fd : public fd_t {
 	 */
 	shared_ptr<thread> add_thread(void *stack_bottom, size_t stack_len, void *auxv_address, void *entrypoint);
 
-	static const int PAGE_SIZE = 4096 /* bytes */;
+	/* Add a kernel thread to this process, which must not have a userland.
+	 * The process is marked running, so that the thread can be scheduled.
+	 */
+	shared_ptr<thread> add_kernel_thread(kernel_thread_entry_t entry, void *userdata);
 
-	/* If given lock is known to the kernel, return its info. Otherwise, return nullptr. */
-	userland_lock_waiters_t *get_userland_lock_info(_Atomic(cloudabi_lock_t) *lock);
-	/* If given lock is known to the kernel, return its info. Otherwise, make given lock
-	 * known to the kernel, and return a new info object. */
-	userland_lock_waiters_t *get_or_create_userland_lock_info(_Atomic(cloudabi_lock_t) *lock);
-	/* Forget about the given lock: it just became unmanaged. */
-	void forget_userland_lock_info(_Atomic(cloudabi_lock_t) *lock);
+	// Release the memory of at most max_pages pages of the mappings of
+	// this exited process, removing mappings that are completely
+	// released. Returns the number of pages released.
+	size_t release_mappings(size_t max_pages);
+	inline bool has_mappings() { return mappings != nullptr; }
 
-	/* Likewise, but for userland condition variables. */
-	userland_condvar_waiters_t *get_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar);
-	userland_condvar_waiters_t *get_or_create_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar);
-	void forget_userland_condvar_cv(_Atomic(cloudabi_condvar_t) *condvar);
+	static const int PAGE_SIZE = 4096 /* bytes */;
+	// 4 MiB, or 2 MiB if PAE is enabled
+	static const int HUGEPAGE_SIZE = PAGE_TABLE_COVERS /* bytes */;
+	static const int PAGES_PER_HUGEPAGE = HUGEPAGE_SIZE / PAGE_SIZE;
 
 	inline thread_condition_signaler *get_termination_signaler() {
 		return &termination_signaler;
@@ -142,32 +172,62 @@ struct process_fd : public fd_t {
 	// Called by a thread when it is exiting.
 	void remove_thread(shared_ptr<thread> t);
 
+	// The CPU time used by the threads of this process, including the
+	// ones that exited, in nanoseconds and in cycles, and the cycles of
+	// it spent in userland and in the kernel
+	cloudabi_timestamp_t get_runtime();
+	uint64_t get_cycles();
+	uint64_t get_user_cycles();
+	uint64_t get_system_cycles();
+
+	// All processes that currently exist
+	static process_list *get_all_processes();
+
+	inline thread_list *get_threads() { return threads; }
+
+	// The scheduling priority of this process, see scheduler. Its
+	// threads may be demoted below it, but are never boosted above it.
+	inline uint8_t get_priority() { return priority; }
+	// Set the priority of this process, and reset its threads to it
+	void set_priority(uint8_t priority);
+
 private:
 	thread_list *threads = nullptr;
 	void add_thread(shared_ptr<thread> thr);
 	void exit_all_threads();
+	// Mark this process as exited, close its fds and exit its threads,
+	// but leave its memory to the caller.
+	void terminate(cloudabi_exitcode_t exitcode, cloudabi_signal_t exitsignal);
 
 	// TODO: for shared mutexes, all cloudabi_tid_t's should be globally
-	// unique; we don't have shared mutexes yet
+	// unique, so that the owner of a shared lock is unambiguous
 	cloudabi_tid_t last_thread = MAIN_THREAD - 1;
 
-	static const int PAGE_DIRECTORY_SIZE = 1024 /* entries */;
-
 	size_t fd_capacity = 0;
 	fd_mapping_t **fds = nullptr;
 
 	// Page directory, filled with physical addresses to page tables
-	uint32_t *page_directory = 0;
-	// The actual backing table virtual addresses; only the first 0x300
-	// entries are valid, the others are in page_allocator.kernel_page_tables
-	uint32_t **page_tables = 0;
+	page_entry_t *page_directory = 0;
+	// The actual backing table virtual addresses; only the first
+	// KERNEL_PAGE_OFFSET entries are valid, the others are in
+	// page_allocator.kernel_page_tables
+	page_entry_t **page_tables = 0;
 
 	// The memory mappings used by this process.
 	mem_mapping_list *mappings = 0;
+	// The number of page directory entries that map a hugepage.
+	size_t hugepages_in_use = 0;
+
+	uint8_t priority = scheduler::DEFAULT_PRIORITY;
+
+	// The CPU time used by the threads of this process that exited
+	cloudabi_timestamp_t exited_runtime = 0;
+	uint64_t exited_cycles = 0;
+	uint64_t exited_user_cycles = 0;
+	uint64_t exited_system_cycles = 0;
 
-	// The kernel managed lock & condvar information for this process.
-	userland_lock_waiters_list *userland_locks = 0;
-	userland_condvar_waiters_list *userland_condvars = 0;
+	// The item by which this process is in the list of all processes
+	process_list all_item;
 
 	bool running = false;
 	cloudabi_exitcode_t exitcode = 0;
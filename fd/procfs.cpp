@@ -1,6 +1,11 @@
 #include "procfs.hpp"
 #include "global.hpp"
+#include <fd/kernel_stack_pool.hpp>
 #include <fd/memory_fd.hpp>
+#include <fd/process_fd.hpp>
+#include <fd/profiler.hpp>
+#include <fd/sched_trace.hpp>
+#include <fd/scheduler.hpp>
 #include <oslibc/numeric.h>
 #include <memory/allocator.hpp>
 #include <time/clock_store.hpp>
@@ -30,6 +35,61 @@ struct procfs_uptime_fd : public memory_fd {
 	size_t read(void *dest, size_t count) override;
 };
 
+struct procfs_memstat_fd : public memory_fd {
+	procfs_memstat_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_priority_fd : public memory_fd {
+	procfs_priority_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+	size_t write(const char *buf, size_t count) override;
+};
+
+struct procfs_sched_fd : public memory_fd {
+	procfs_sched_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_processes_fd : public memory_fd {
+	procfs_processes_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_stat_fd : public memory_fd {
+	procfs_stat_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_loadavg_fd : public memory_fd {
+	procfs_loadavg_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_stackpool_fd : public memory_fd {
+	procfs_stackpool_fd(const char *n) : memory_fd(n) {}
+
+	size_t read(void *dest, size_t count) override;
+};
+
+struct procfs_sched_trace_fd : public memory_fd {
+	procfs_sched_trace_fd(const char *n);
+
+	size_t write(const char *buf, size_t count) override;
+};
+
+struct procfs_profile_fd : public memory_fd {
+	procfs_profile_fd(const char *n);
+
+	size_t write(const char *buf, size_t count) override;
+};
+
 struct procfs_alloctrack_fd : public fd_t {
 	procfs_alloctrack_fd(const char *n) : fd_t(CLOUDABI_FILETYPE_REGULAR_FILE, n) {}
 
@@ -126,6 +186,84 @@ shared_ptr<fd_t> procfs_directory_fd::openat(const char *pathname, size_t pathle
 			error = 0;
 			return make_shared<procfs_alloctrack_fd>(pathbuf);
 		}
+	} else if(strcmp(pathbuf, "kernel/processes") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_processes_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "kernel/stat") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_stat_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "kernel/loadavg") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_loadavg_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "kernel/stackpool") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_stackpool_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "kernel/sched_trace") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_sched_trace_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "kernel/profile") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_profile_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "self/memstat") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_memstat_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "self/priority") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_priority_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "self/sched") == 0) {
+		if(must_be_directory) {
+			error = ENOTDIR;
+			return nullptr;
+		} else {
+			error = 0;
+			return make_shared<procfs_sched_fd>(pathbuf);
+		}
+	} else if(strcmp(pathbuf, "self") == 0 || strcmp(pathbuf, "self/") == 0) {
+		error = 0;
+		char pb[2][PROCFS_FILE_MAX];
+		strncpy(pb[0], "self", PROCFS_FILE_MAX);
+		pb[1][0] = 0;
+		return make_shared<procfs_directory_fd>(pb, "procfs_self_dir");
 	} else if(strcmp(pathbuf, "kernel") == 0 || strcmp(pathbuf, "kernel/") == 0) {
 		error = 0;
 		char pb[2][PROCFS_FILE_MAX];
@@ -149,6 +287,248 @@ size_t procfs_uptime_fd::read(void *dest, size_t count) {
 	return res;
 }
 
+// The longest line append_stat() writes: a short name, a space, a 64-bit
+// number and a newline
+static const size_t STAT_LINE_MAX = 48;
+
+static void append_stat(char *buf, size_t bufsize, const char *name, uint64_t value) {
+	char numbuf[24];
+	strlcat(buf, name, bufsize);
+	strlcat(buf, " ", bufsize);
+	strlcat(buf, ui64toa_s(value, numbuf, sizeof(numbuf), 10), bufsize);
+	strlcat(buf, "\n", bufsize);
+}
+
+size_t procfs_memstat_fd::read(void *dest, size_t count) {
+	// Describes the memory of the process reading this file
+	process_fd *process = get_scheduler()->get_running_thread()->get_process();
+	size_t num_mappings, num_pages;
+	process->get_mapping_stats(&num_mappings, &num_pages);
+
+	char buf[128];
+	buf[0] = 0;
+	append_stat(buf, sizeof(buf), "mappings", num_mappings);
+	append_stat(buf, sizeof(buf), "pages", num_pages);
+	append_stat(buf, sizeof(buf), "hugepages", process->get_hugepages_in_use());
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	return res;
+}
+
+size_t procfs_priority_fd::read(void *dest, size_t count) {
+	// The priority of the process reading this file
+	process_fd *process = get_scheduler()->get_running_thread()->get_process();
+
+	char buf[8];
+	buf[0] = 0;
+	char numbuf[4];
+	strlcat(buf, ui64toa_s(process->get_priority(), numbuf, sizeof(numbuf), 10), sizeof(buf));
+	strlcat(buf, "\n", sizeof(buf));
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	return res;
+}
+
+size_t procfs_priority_fd::write(const char *buf, size_t count) {
+	// Set the priority of the process writing this file, from 0 (highest)
+	// to scheduler::LOWEST_PRIORITY
+	if(count == 0) {
+		error = 0;
+		return 0;
+	}
+	if(buf[0] < '0' || buf[0] > '0' + scheduler::LOWEST_PRIORITY) {
+		error = EINVAL;
+		return 0;
+	}
+	error = 0;
+	get_scheduler()->get_running_thread()->get_process()->set_priority(buf[0] - '0');
+	return count;
+}
+
+size_t procfs_sched_fd::read(void *dest, size_t count) {
+	// Scheduling statistics for the threads of the process reading this
+	// file, one line per thread, in nanoseconds
+	process_fd *process = get_scheduler()->get_running_thread()->get_process();
+
+	// four lines per thread, plus the terminator
+	const size_t bufsize = size(process->get_threads()) * 4 * STAT_LINE_MAX + 1;
+	Blk alloc = allocate(bufsize);
+	if(alloc.ptr == nullptr) {
+		error = ENOMEM;
+		return 0;
+	}
+	char *buf = reinterpret_cast<char*>(alloc.ptr);
+	buf[0] = 0;
+	iterate(process->get_threads(), [&](thread_list *item) {
+		auto &thr = item->data;
+		append_stat(buf, bufsize, "thread", thr->get_thread_id());
+		append_stat(buf, bufsize, "priority", thr->get_priority());
+		append_stat(buf, bufsize, "runtime", thr->get_runtime());
+		append_stat(buf, bufsize, "waittime", thr->get_wait_time());
+	});
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	deallocate(alloc);
+	return res;
+}
+
+size_t procfs_processes_fd::read(void *dest, size_t count) {
+	// All processes, with the CPU time used by their threads in
+	// nanoseconds and in cycles
+	// a name line and six stat lines per process, plus the terminator
+	const size_t bufsize = size(process_fd::get_all_processes())
+		* (sizeof("process \n") + sizeof(fd_t::name) + 6 * STAT_LINE_MAX) + 1;
+	Blk alloc = allocate(bufsize);
+	if(alloc.ptr == nullptr) {
+		error = ENOMEM;
+		return 0;
+	}
+	char *buf = reinterpret_cast<char*>(alloc.ptr);
+	buf[0] = 0;
+	iterate(process_fd::get_all_processes(), [&](process_list *item) {
+		process_fd *process = item->data;
+		strlcat(buf, "process ", bufsize);
+		strlcat(buf, process->name, bufsize);
+		strlcat(buf, "\n", bufsize);
+		append_stat(buf, bufsize, "running", process->is_running());
+		append_stat(buf, bufsize, "threads", size(process->get_threads()));
+		append_stat(buf, bufsize, "runtime", process->get_runtime());
+		append_stat(buf, bufsize, "cycles", process->get_cycles());
+		append_stat(buf, bufsize, "user", get_scheduler()->cycles_to_ns(process->get_user_cycles()));
+		append_stat(buf, bufsize, "system", get_scheduler()->cycles_to_ns(process->get_system_cycles()));
+	});
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	deallocate(alloc);
+	return res;
+}
+
+size_t procfs_stat_fd::read(void *dest, size_t count) {
+	// The time the CPU spent in userland, in the kernel, handling IRQs
+	// and idling since boot, in nanoseconds
+	scheduler *sched = get_scheduler();
+
+	char buf[128];
+	buf[0] = 0;
+	append_stat(buf, sizeof(buf), "user", sched->cycles_to_ns(sched->get_cpu_cycles(CPU_USER)));
+	append_stat(buf, sizeof(buf), "kernel", sched->cycles_to_ns(sched->get_cpu_cycles(CPU_KERNEL)));
+	append_stat(buf, sizeof(buf), "irq", sched->cycles_to_ns(sched->get_cpu_cycles(CPU_IRQ)));
+	append_stat(buf, sizeof(buf), "idle", sched->cycles_to_ns(sched->get_cpu_cycles(CPU_IDLE)));
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	return res;
+}
+
+static void append_load(char *buf, size_t bufsize, const char *name, uint32_t load) {
+	// load is a fixed-point number, print it with two decimals
+	char numbuf[16];
+	uint32_t hundredths = (load * 100 + scheduler::LOAD_ONE / 2) >> scheduler::LOAD_SHIFT;
+	strlcat(buf, name, bufsize);
+	strlcat(buf, " ", bufsize);
+	strlcat(buf, uitoa_s(hundredths / 100, numbuf, sizeof(numbuf), 10), bufsize);
+	strlcat(buf, hundredths % 100 < 10 ? ".0" : ".", bufsize);
+	strlcat(buf, uitoa_s(hundredths % 100, numbuf, sizeof(numbuf), 10), bufsize);
+	strlcat(buf, "\n", bufsize);
+}
+
+size_t procfs_loadavg_fd::read(void *dest, size_t count) {
+	// The number of running and ready threads, averaged over 1, 5 and
+	// 15 minutes
+	scheduler *sched = get_scheduler();
+
+	char buf[64];
+	buf[0] = 0;
+	append_load(buf, sizeof(buf), "load1", sched->get_load_average(0));
+	append_load(buf, sizeof(buf), "load5", sched->get_load_average(1));
+	append_load(buf, sizeof(buf), "load15", sched->get_load_average(2));
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	return res;
+}
+
+size_t procfs_stackpool_fd::read(void *dest, size_t count) {
+	// The free stacks in the kernel stack pool, and how often a new
+	// thread could or couldn't take its stack from it
+	kernel_stack_pool *pool = get_kernel_stack_pool();
+
+	char buf[128];
+	buf[0] = 0;
+	append_stat(buf, sizeof(buf), "free", pool->get_free());
+	append_stat(buf, sizeof(buf), "hits", pool->get_hits());
+	append_stat(buf, sizeof(buf), "misses", pool->get_misses());
+
+	reset(buf, strlen(buf));
+	auto res = memory_fd::read(dest, count);
+	reset();
+	return res;
+}
+
+procfs_sched_trace_fd::procfs_sched_trace_fd(const char *n)
+: memory_fd(n)
+{
+	// Take the snapshot when the file is opened, so that it doesn't
+	// change between reads
+	Blk snapshot = get_sched_trace()->snapshot();
+	if(snapshot.ptr != nullptr) {
+		reset(snapshot, snapshot.size);
+	}
+}
+
+size_t procfs_sched_trace_fd::write(const char *buf, size_t count) {
+	error = 0;
+	if(count == 0) {
+		return 0;
+	}
+	char b = buf[0];
+	if(b == '1') {
+		get_sched_trace()->enable();
+	} else if(b == '0') {
+		get_sched_trace()->disable();
+	} else {
+		error = EINVAL;
+		return 0;
+	}
+	return count;
+}
+
+procfs_profile_fd::procfs_profile_fd(const char *n)
+: memory_fd(n)
+{
+	Blk snapshot = get_profiler()->snapshot();
+	if(snapshot.ptr != nullptr) {
+		reset(snapshot, snapshot.size);
+	}
+}
+
+size_t procfs_profile_fd::write(const char *buf, size_t count) {
+	error = 0;
+	if(count == 0) {
+		return 0;
+	}
+	char b = buf[0];
+	if(b == '1') {
+		get_profiler()->enable();
+	} else if(b == '0') {
+		get_profiler()->disable();
+	} else {
+		error = EINVAL;
+		return 0;
+	}
+	return count;
+}
+
 size_t procfs_alloctrack_fd::write(const char *buf, size_t count) {
 	error = 0;
 	// TODO: static_assert 'if get_allocator()->get_allocator()->start_tracking() exists'
@@ -0,0 +1,175 @@
+#include "profiler.hpp"
+#include <fd/process_fd.hpp>
+#include <fd/scheduler.hpp>
+#include <fd/thread.hpp>
+#include <hw/cpu_io.hpp>
+#include <hw/interrupt.hpp>
+#include <memory/allocator.hpp>
+#include <memory/paging.hpp>
+#include <oslibc/string.h>
+#include <time/clock_store.hpp>
+
+using namespace cloudos;
+
+static cloudabi_timestamp_t get_monotonic_time() {
+	return get_clock_store()->get_clock(CLOUDABI_CLOCK_MONOTONIC)->get_time(0);
+}
+
+profiler::profiler()
+{}
+
+void profiler::enable() {
+	// Also when already enabled, start over with an empty profile. Stop
+	// sampling while doing so, so that no half-reset state is used
+	enabled = false;
+
+	if(samples == nullptr) {
+		Blk b = allocate(NUM_SAMPLES * sizeof(profiler_sample));
+		if(b.ptr == nullptr) {
+			kernel_panic("Failed to allocate profiler buffer");
+		}
+		samples = reinterpret_cast<profiler_sample*>(b.ptr);
+	}
+	if(processes == nullptr) {
+		Blk b = allocate(MAX_PROCESSES * sizeof(profiler_process));
+		if(b.ptr == nullptr) {
+			kernel_panic("Failed to allocate profiler process table");
+		}
+		processes = reinterpret_cast<profiler_process*>(b.ptr);
+	}
+	next = 0;
+	num_samples = 0;
+	dropped = 0;
+	num_processes = 0;
+
+	next_sample = get_monotonic_time() + INTERVAL;
+	enabled = true;
+}
+
+void profiler::disable() {
+	// The samples are kept, so that the profile can still be read
+	enabled = false;
+}
+
+uint32_t profiler::get_process_index(process_fd *process) {
+	uint32_t address = reinterpret_cast<uintptr_t>(process);
+	for(size_t i = num_processes; i > 0; --i) {
+		profiler_process &p = processes[i - 1];
+		if(p.address == address && strncmp(p.name, process->name, sizeof(p.name)) == 0) {
+			return i - 1;
+		}
+	}
+	if(num_processes == MAX_PROCESSES) {
+		return PROFILER_NO_PROCESS;
+	}
+	profiler_process &p = processes[num_processes];
+	p.address = address;
+	strncpy(p.name, process->name, sizeof(p.name));
+	p.name[sizeof(p.name) - 1] = 0;
+	return num_processes++;
+}
+
+size_t profiler::walk_user_stack(process_fd *process, uint32_t fp, uint32_t *pcs, size_t max) {
+	// The process of the running thread is installed, so its stack can be
+	// read directly, as long as every frame is checked to be backed
+	size_t depth = 0;
+	while(depth < max && fp != 0 && (fp & 3) == 0
+	&& page_table_index(fp + 8) < static_cast<size_t>(KERNEL_PAGE_OFFSET)
+	&& process->is_backed(reinterpret_cast<void*>(fp))
+	&& process->is_backed(reinterpret_cast<void*>(fp + 4))) {
+		uint32_t *frame = reinterpret_cast<uint32_t*>(fp);
+		pcs[depth++] = frame[1];
+		if(frame[0] <= fp) {
+			// stacks grow down, so callers have higher frames
+			break;
+		}
+		fp = frame[0];
+	}
+	return depth;
+}
+
+size_t profiler::walk_kernel_stack(uint32_t fp, uint32_t low, uint32_t high, uint32_t *pcs, size_t max) {
+	size_t depth = 0;
+	while(depth < max && (fp & 3) == 0 && fp >= low && fp + 8 <= high) {
+		uint32_t *frame = reinterpret_cast<uint32_t*>(fp);
+		pcs[depth++] = frame[1];
+		if(frame[0] <= fp) {
+			break;
+		}
+		fp = frame[0];
+	}
+	return depth;
+}
+
+void profiler::timer_interrupt(interrupt_state_t *regs) {
+	cloudabi_timestamp_t now = get_monotonic_time();
+	if(now < next_sample) {
+		return;
+	}
+	next_sample = now + INTERVAL;
+
+	profiler_sample &sample = samples[next];
+	sample.tsc = rdtsc();
+	sample.flags = regs->cs == 8 ? PROFILER_SAMPLE_KERNEL : 0;
+	sample.pcs[0] = regs->eip;
+	sample.depth = 1;
+
+	auto thr = get_scheduler()->get_running_thread();
+	if(thr) {
+		sample.process = get_process_index(thr->get_process());
+		sample.thread = thr->get_thread_id();
+		if(sample.flags & PROFILER_SAMPLE_KERNEL) {
+			// only follow frames on the kernel stack of this thread;
+			// the interrupted stack pointer is the lowest one
+			uint32_t high = reinterpret_cast<uintptr_t>(thr->get_kernel_stack_top());
+			sample.depth += walk_kernel_stack(regs->ebp, regs->esp, high, &sample.pcs[1], PROFILER_MAX_DEPTH - 1);
+		} else {
+			sample.depth += walk_user_stack(thr->get_process(), regs->ebp, &sample.pcs[1], PROFILER_MAX_DEPTH - 1);
+		}
+	} else {
+		// waiting for a thread to become ready
+		sample.process = PROFILER_NO_PROCESS;
+		sample.thread = 0;
+	}
+
+	next = (next + 1) % NUM_SAMPLES;
+	if(num_samples == NUM_SAMPLES) {
+		dropped++;
+	} else {
+		num_samples++;
+	}
+}
+
+Blk profiler::snapshot() {
+	size_t length = sizeof(profiler_header)
+		+ num_processes * sizeof(profiler_process)
+		+ num_samples * sizeof(profiler_sample);
+
+	Blk b = allocate(length);
+	if(b.ptr == nullptr) {
+		return b;
+	}
+	uint8_t *buf = reinterpret_cast<uint8_t*>(b.ptr);
+
+	profiler_header *header = reinterpret_cast<profiler_header*>(buf);
+	header->magic = PROFILER_MAGIC;
+	header->version = PROFILER_VERSION;
+	header->sample_size = sizeof(profiler_sample);
+	header->num_samples = num_samples;
+	header->num_processes = num_processes;
+	header->interval_ns = INTERVAL;
+	header->dropped = dropped;
+	header->reserved = 0;
+	buf += sizeof(profiler_header);
+
+	memcpy(buf, processes, num_processes * sizeof(profiler_process));
+	buf += num_processes * sizeof(profiler_process);
+
+	// oldest samples first
+	size_t first = (next + NUM_SAMPLES - num_samples) % NUM_SAMPLES;
+	size_t tail = num_samples < NUM_SAMPLES - first ? num_samples : NUM_SAMPLES - first;
+	memcpy(buf, &samples[first], tail * sizeof(profiler_sample));
+	buf += tail * sizeof(profiler_sample);
+	memcpy(buf, samples, (num_samples - tail) * sizeof(profiler_sample));
+	return b;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cloudabi/headers/cloudabi_types.h>
+#include <global.hpp>
+#include <memory/allocation.hpp>
+
+namespace cloudos {
+
+struct interrupt_state_t;
+struct process_fd;
+
+static const size_t PROFILER_MAX_DEPTH = 16;
+
+struct profiler_sample {
+	uint64_t tsc;
+	// index into the process table of the profile, or
+	// PROFILER_NO_PROCESS if no thread was running
+	uint32_t process;
+	uint32_t thread;
+	uint16_t flags;
+	uint16_t depth;
+	// the interrupted instruction pointer, followed by the return
+	// addresses of its callers
+	uint32_t pcs[PROFILER_MAX_DEPTH];
+};
+
+static const uint32_t PROFILER_NO_PROCESS = 0xffffffff;
+// the sample was taken in the kernel
+static const uint16_t PROFILER_SAMPLE_KERNEL = 0x1;
+
+struct profiler_process {
+	uint32_t address;
+	char name[64];
+};
+
+struct profiler_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sample_size;
+	uint32_t num_samples;
+	uint32_t num_processes;
+	uint32_t interval_ns;
+	// samples that were overwritten before this snapshot
+	uint32_t dropped;
+	uint32_t reserved;
+};
+
+static const uint32_t PROFILER_MAGIC = 0x50585343 /* "CSXP" */;
+static const uint32_t PROFILER_VERSION = 1;
+
+/** Statistical profiler
+ *
+ * While enabled, the timer interrupt takes a sample of the interrupted code
+ * every INTERVAL nanoseconds: its instruction pointer, the process and thread
+ * it belongs to, and a backtrace of at most PROFILER_MAX_DEPTH return
+ * addresses found by following the frame pointers. The timer is programmed to
+ * fire at least this often while the profiler is enabled. The samples are
+ * kept in a ring buffer, overwriting the oldest ones once it is full.
+ *
+ * Since the kernel only handles interrupts at preemption points, samples
+ * in the kernel mostly show where it waits or is preempted.
+ *
+ * The profiler is controlled and read through the kernel/profile procfs file:
+ * writing '1' clears and enables it, writing '0' disables it, and reading it
+ * returns a snapshot consisting of a profiler_header, num_processes
+ * profiler_process entries and num_samples profiler_samples, oldest first.
+ * misc/python/profile_symbolize.py turns it into folded stacks.
+ */
+struct profiler {
+	profiler();
+
+	void enable();
+	void disable();
+	inline bool is_enabled() { return enabled; }
+
+	// Take a sample if the interval passed since the last one
+	void timer_interrupt(interrupt_state_t *regs);
+
+	// The monotonic time at which the next sample is due, so that the
+	// timer can be programmed to fire in time
+	inline cloudabi_timestamp_t get_next_sample_time() { return next_sample; }
+
+	// Write a snapshot of the profile into a new allocation
+	Blk snapshot();
+
+	static const size_t NUM_SAMPLES = 4096;
+	static const size_t MAX_PROCESSES = 128;
+	static const cloudabi_timestamp_t INTERVAL = 1000000 /* ns */;
+
+private:
+	uint32_t get_process_index(process_fd *process);
+	size_t walk_user_stack(process_fd *process, uint32_t fp, uint32_t *pcs, size_t max);
+	size_t walk_kernel_stack(uint32_t fp, uint32_t low, uint32_t high, uint32_t *pcs, size_t max);
+
+	bool enabled = false;
+	cloudabi_timestamp_t next_sample = 0;
+
+	profiler_sample *samples = nullptr;
+	size_t next = 0;
+	size_t num_samples = 0;
+	size_t dropped = 0;
+
+	// The processes seen in samples. A process is added again when it
+	// changed its name by exec()ing, so that it is symbolized against
+	// the right binary.
+	profiler_process *processes = nullptr;
+	size_t num_processes = 0;
+};
+
+// Take a sample on a timer interrupt if profiling is enabled
+inline void profiler_timer_interrupt(interrupt_state_t *regs) {
+	profiler *prof = global_state_->profiler;
+	if(prof != nullptr && prof->is_enabled()) {
+		prof->timer_interrupt(regs);
+	}
+}
+
+}
@@ -19,16 +19,13 @@ pseudo_fd::pseudo_fd(pseudofd_t id, shared_ptr<fd_t> r, cloudabi_filetype_t t, c
 Blk pseudo_fd::send_request(reverse_request_t *request, const char *buffer, reverse_response_t *response) {
 	// Lock the reverse_fd. Multiple pseudo FD's may have a reference to
 	// this reverse_fd, and another one may have an outstanding request
-	// already.
-	// Since we have no true 'locks' yet, we are uniprocessor and no
-	// kernel thread preemption, we can 'lock' an FD by setting its
-	// refcount (a currently unused parameter) to 2. We yield until we
-	// catch our reverse FD with a refcount of 1. This approach has many
-	// problems but it's acceptable for now.
-	while(reverse_fd->refcount == 2) {
+	// already. The kernel runs on a single CPU and there is no
+	// preemption point between the check and the set, so a flag is
+	// enough; we yield until the other request is done.
+	while(reverse_fd->request_outstanding) {
 		get_scheduler()->thread_yield();
 	}
-	reverse_fd->refcount = 2;
+	reverse_fd->request_outstanding = true;
 
 	size_t received = 0;
 	Blk recv_buf;
@@ -66,7 +63,7 @@ Blk pseudo_fd::send_request(reverse_request_t *request, const char *buffer, reve
 		}
 		assert(received == response->send_length);
 	}
-	reverse_fd->refcount = 1;
+	reverse_fd->request_outstanding = false;
 	return recv_buf;
 
 error:
@@ -75,6 +72,7 @@ error:
 	response->flags = 0;
 	response->send_length = 0;
 	maybe_deallocate(recv_buf);
+	reverse_fd->request_outstanding = false;
 	return {};
 }
 
@@ -158,6 +156,11 @@ size_t pseudo_fd::write(const char *str, size_t size)
 	return size;
 }
 
+cloudabi_errno_t pseudo_fd::get_write_signaler(thread_condition_signaler **s)
+{
+	return reverse_fd->get_write_signaler(s);
+}
+
 shared_ptr<fd_t> pseudo_fd::openat(const char *path, size_t pathlen, cloudabi_oflags_t oflags, const cloudabi_fdstat_t * fdstat)
 {
 	int64_t inode;
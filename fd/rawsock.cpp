@@ -8,12 +8,17 @@ static bool rawsock_is_readable(void *r, thread_condition*) {
 	return rawsock->has_messages();
 }
 
+static bool rawsock_is_writable(void *, thread_condition*) {
+	return true;
+}
+
 rawsock::rawsock(interface *i, const char *n)
 : sock_t(CLOUDABI_FILETYPE_SOCKET_DGRAM, n)
 , iface(i)
 {
 	status = sockstatus_t::CONNECTED;
 	read_signaler.set_already_satisfied_function(rawsock_is_readable, this);
+	write_signaler.set_already_satisfied_function(rawsock_is_writable, this);
 }
 
 rawsock::~rawsock()
@@ -145,3 +150,9 @@ cloudabi_errno_t rawsock::get_read_signaler(thread_condition_signaler **s)
 	*s = &read_signaler;
 	return 0;
 }
+
+cloudabi_errno_t rawsock::get_write_signaler(thread_condition_signaler **s)
+{
+	*s = &write_signaler;
+	return 0;
+}
@@ -15,6 +15,8 @@ struct rawsock : public sock_t, public enable_shared_from_this<rawsock> {
 
 	bool has_messages() const;
 	cloudabi_errno_t get_read_signaler(thread_condition_signaler **s) override;
+	// Frames are sent out immediately, so a rawsock is always writable
+	cloudabi_errno_t get_write_signaler(thread_condition_signaler **s) override;
 
 	void sock_shutdown(cloudabi_sdflags_t how) override;
 	void sock_stat_get(cloudabi_sockstat_t* buf, cloudabi_ssflags_t flags) override;
@@ -28,6 +30,7 @@ private:
 	interface *iface;
 
 	thread_condition_signaler read_signaler;
+	thread_condition_signaler write_signaler;
 
 	linked_list<Blk> *messages = nullptr;
 	cv_t read_cv;
@@ -0,0 +1,88 @@
+#include <fd/process_fd.hpp>
+#include <fd/reaper.hpp>
+#include <fd/scheduler.hpp>
+#include <global.hpp>
+#include <memory/allocation.hpp>
+
+using namespace cloudos;
+
+reaper::reaper()
+{}
+
+void reaper::start()
+{
+	assert(process == nullptr);
+	process = allocate<process_fd>("reaper");
+	process->set_priority(scheduler::LOWEST_PRIORITY);
+	reaper_thread = process->add_kernel_thread(thread_entry, this);
+}
+
+void reaper::reap_process(shared_ptr<process_fd> p)
+{
+	assert(p->is_terminated());
+	append(&processes, allocate<process_reap_list>(p));
+	wake();
+}
+
+void reaper::reap_thread(thread_list *thr)
+{
+	assert(thr->next == nullptr);
+	assert(thr->data->is_exited());
+	append(&threads, thr);
+	wake();
+}
+
+void reaper::wake()
+{
+	if(reaper_thread && reaper_thread->is_blocked()) {
+		reaper_thread->thread_unblock();
+	}
+}
+
+void reaper::thread_entry(void *userdata)
+{
+	reinterpret_cast<reaper*>(userdata)->run();
+}
+
+void reaper::run()
+{
+	while(true) {
+		if(processes == nullptr && threads == nullptr) {
+			reaper_thread->thread_block();
+			continue;
+		}
+
+		remove_all(&threads, [&](thread_list *) {
+			return true;
+		}, [&](thread_list *item) {
+			assert(item->data);
+			weak_ptr<thread> thr_weak = item->data;
+			// the item is part of the thread, so move the
+			// reference out of it before dropping it
+			shared_ptr<thread> thr = move(item->data);
+			thr.reset();
+			assert(thr_weak.expired());
+		});
+
+		size_t budget = REAP_BATCH_PAGES;
+		while(processes != nullptr && budget > 0) {
+			size_t released = processes->data->release_mappings(budget);
+			budget -= released;
+			pages_reaped += released;
+			if(processes->data->has_mappings()) {
+				continue;
+			}
+
+			// all memory is released; drop our reference, which
+			// may destruct the process
+			auto *item = processes;
+			processes = item->next;
+			item->data.reset();
+			deallocate(item);
+			processes_reaped++;
+		}
+
+		// give other threads a chance to run before the next batch
+		get_scheduler()->thread_yield();
+	}
+}
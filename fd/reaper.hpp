@@ -0,0 +1,63 @@
+#pragma once
+
+#include "thread.hpp"
+#include <memory/smart_ptr.hpp>
+#include <oslibc/list.hpp>
+
+namespace cloudos {
+
+struct process_fd;
+typedef linked_list<shared_ptr<process_fd>> process_reap_list;
+
+/** Reaper for exited processes and threads
+ *
+ * Tearing down a process means releasing all its memory mappings, which can
+ * take a long time for a process with a large resident set. Instead of doing
+ * this in whichever context drops the last reference to a process, exited
+ * processes are handed to the reaper, which releases their memory in batches
+ * of at most REAP_BATCH_PAGES pages, yielding in between so that other
+ * threads can run.
+ *
+ * Exited threads are deallocated by the reaper as well, so that the
+ * scheduler does not need to do this during a context switch.
+ *
+ * The reaper runs as a kernel thread in its own kernel process. It blocks
+ * while there is nothing to reap.
+ */
+struct reaper {
+	reaper();
+
+	// Create the reaper kernel thread; it starts running once it is
+	// scheduled.
+	void start();
+
+	// Hand an exited process to the reaper. The reaper keeps a reference
+	// to it until all its memory is released.
+	void reap_process(shared_ptr<process_fd> process);
+
+	// Hand an exited thread, which must not be running anymore, to the
+	// reaper, which will drop the reference held by the given scheduler
+	// item of the thread.
+	void reap_thread(thread_list *thread);
+
+	inline size_t get_processes_reaped() { return processes_reaped; }
+	inline size_t get_pages_reaped() { return pages_reaped; }
+
+	static const size_t REAP_BATCH_PAGES = 256;
+
+private:
+	static void thread_entry(void *userdata);
+	[[noreturn]] void run();
+	void wake();
+
+	process_fd *process = nullptr;
+	shared_ptr<thread> reaper_thread;
+
+	process_reap_list *processes = nullptr;
+	thread_list *threads = nullptr;
+
+	size_t processes_reaped = 0;
+	size_t pages_reaped = 0;
+};
+
+}
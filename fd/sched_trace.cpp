@@ -0,0 +1,113 @@
+#include "sched_trace.hpp"
+#include <fd/process_fd.hpp>
+#include <fd/thread.hpp>
+#include <hw/cpu_io.hpp>
+#include <memory/allocator.hpp>
+#include <oslibc/string.h>
+#include <time/clock_store.hpp>
+
+using namespace cloudos;
+
+static uint64_t get_monotonic_time() {
+	return get_clock_store()->get_clock(CLOUDABI_CLOCK_MONOTONIC)->get_time(0);
+}
+
+sched_trace::sched_trace()
+{}
+
+size_t sched_trace::current_cpu() {
+	// All kernel code runs on the bootstrap processor
+	return 0;
+}
+
+void sched_trace::enable() {
+	// Also when already enabled, start over with an empty buffer. Stop
+	// recording while doing so, so that no half-reset state is used
+	enabled = false;
+
+	num_cpus = MAX_CPUS;
+	for(size_t i = 0; i < num_cpus; ++i) {
+		cpu_buffer &buffer = buffers[i];
+		if(buffer.events == nullptr) {
+			Blk b = allocate(EVENTS_PER_CPU * sizeof(sched_trace_event));
+			if(b.ptr == nullptr) {
+				kernel_panic("Failed to allocate scheduler trace buffer");
+			}
+			buffer.events = reinterpret_cast<sched_trace_event*>(b.ptr);
+		}
+		buffer.next = 0;
+		buffer.wrapped = false;
+	}
+
+	start_ns = get_monotonic_time();
+	start_tsc = rdtsc();
+	enabled = true;
+}
+
+void sched_trace::disable() {
+	// The buffers are kept, so that the trace can still be read
+	enabled = false;
+}
+
+void sched_trace::record(sched_trace_event_type type, thread *thr, uint32_t arg) {
+	size_t cpu = current_cpu();
+	cpu_buffer &buffer = buffers[cpu];
+
+	sched_trace_event &event = buffer.events[buffer.next];
+	event.tsc = rdtsc();
+	event.process = thr == nullptr ? 0 : reinterpret_cast<uintptr_t>(thr->get_process());
+	event.thread = thr == nullptr ? 0 : thr->get_thread_id();
+	event.arg = arg;
+	event.type = type;
+	event.cpu = cpu;
+	event.reserved = 0;
+
+	buffer.next++;
+	if(buffer.next == EVENTS_PER_CPU) {
+		buffer.next = 0;
+		buffer.wrapped = true;
+	}
+}
+
+Blk sched_trace::snapshot() {
+	size_t length = sizeof(sched_trace_header);
+	for(size_t i = 0; i < num_cpus; ++i) {
+		size_t num_events = buffers[i].wrapped ? EVENTS_PER_CPU : buffers[i].next;
+		length += sizeof(sched_trace_cpu_header) + num_events * sizeof(sched_trace_event);
+	}
+
+	Blk b = allocate(length);
+	if(b.ptr == nullptr) {
+		return b;
+	}
+	uint8_t *buf = reinterpret_cast<uint8_t*>(b.ptr);
+
+	sched_trace_header *header = reinterpret_cast<sched_trace_header*>(buf);
+	header->magic = SCHED_TRACE_MAGIC;
+	header->version = SCHED_TRACE_VERSION;
+	header->num_cpus = num_cpus;
+	header->event_size = sizeof(sched_trace_event);
+	header->start_tsc = start_tsc;
+	header->start_ns = start_ns;
+	header->end_ns = get_monotonic_time();
+	header->end_tsc = rdtsc();
+	buf += sizeof(sched_trace_header);
+
+	for(size_t i = 0; i < num_cpus; ++i) {
+		cpu_buffer &buffer = buffers[i];
+		sched_trace_cpu_header *cpu_header = reinterpret_cast<sched_trace_cpu_header*>(buf);
+		cpu_header->cpu = i;
+		cpu_header->num_events = buffer.wrapped ? EVENTS_PER_CPU : buffer.next;
+		buf += sizeof(sched_trace_cpu_header);
+
+		// oldest events first
+		if(buffer.wrapped) {
+			size_t tail = EVENTS_PER_CPU - buffer.next;
+			memcpy(buf, &buffer.events[buffer.next], tail * sizeof(sched_trace_event));
+			buf += tail * sizeof(sched_trace_event);
+		}
+		memcpy(buf, buffer.events, buffer.next * sizeof(sched_trace_event));
+		buf += buffer.next * sizeof(sched_trace_event);
+	}
+	return b;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory/allocation.hpp>
+#include <global.hpp>
+
+namespace cloudos {
+
+struct thread;
+
+enum sched_trace_event_type : uint8_t {
+	// the thread starts running; arg is unused
+	TRACE_SWITCH_IN = 1,
+	// the thread stops running; arg is 0 if it is still ready, 1 if
+	// it blocked, 2 if it exited
+	TRACE_SWITCH_OUT = 2,
+	// the thread blocks or is unblocked; arg is unused
+	TRACE_BLOCK = 3,
+	TRACE_UNBLOCK = 4,
+	// a signaler with waiting conditions is notified or broadcast; arg
+	// is the address of the signaler
+	TRACE_SIGNAL = 5,
+	// system call entry and exit; arg is the syscall number or the errno
+	TRACE_SYSCALL_ENTER = 6,
+	TRACE_SYSCALL_EXIT = 7,
+	// hardware interrupt entry and exit; arg is the IRQ number. The
+	// handler may switch threads before it returns.
+	TRACE_IRQ_ENTER = 8,
+	TRACE_IRQ_EXIT = 9,
+};
+
+struct sched_trace_event {
+	// time stamp counter
+	uint64_t tsc;
+	// address of the process and thread ID of the thread the event is
+	// about, or 0 for signal and IRQ events, which happen on behalf of
+	// whichever thread was switched in last on the CPU
+	uint32_t process;
+	uint32_t thread;
+	uint32_t arg;
+	uint8_t type;
+	uint8_t cpu;
+	uint16_t reserved;
+};
+
+static_assert(sizeof(sched_trace_event) == 24, "sched_trace_event must be packed");
+
+/** Scheduler event trace
+ *
+ * While enabled, the trace records thread switches, blocks and unblocks,
+ * signaler notifications, system calls and IRQs into a ring buffer per CPU,
+ * overwriting the oldest events once it is full. Recording an event only
+ * reads the time stamp counter and copies a few words, so that tracing
+ * doesn't change the timing being traced too much.
+ *
+ * The trace is controlled and read through the kernel/sched_trace procfs
+ * file: writing '1' clears and enables it, writing '0' disables it, and
+ * reading it returns a snapshot in the binary format described by
+ * sched_trace_header, followed by a sched_trace_cpu_header and the events
+ * of every CPU, oldest first. misc/python/sched_trace.py converts it to the
+ * Chrome trace format.
+ */
+struct sched_trace {
+	sched_trace();
+
+	void enable();
+	void disable();
+	inline bool is_enabled() { return enabled; }
+
+	void record(sched_trace_event_type type, thread *thr, uint32_t arg);
+
+	// Write a snapshot of the trace into a new allocation
+	Blk snapshot();
+
+	static const size_t EVENTS_PER_CPU = 8192;
+	// The kernel runs on a single CPU; the trace format allows for more
+	static const size_t MAX_CPUS = 1;
+
+private:
+	struct cpu_buffer {
+		sched_trace_event *events = nullptr;
+		size_t next = 0;
+		bool wrapped = false;
+	};
+
+	// The index of the CPU running the caller
+	static size_t current_cpu();
+
+	bool enabled = false;
+	// The number of CPUs that have a buffer
+	size_t num_cpus = 0;
+	cpu_buffer buffers[MAX_CPUS];
+	// a time stamp counter value and the monotonic time at which it was
+	// taken, so that time stamps can be converted to nanoseconds
+	uint64_t start_tsc = 0;
+	uint64_t start_ns = 0;
+};
+
+struct sched_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_cpus;
+	uint32_t event_size;
+	// two pairs of a time stamp counter value and the monotonic time at
+	// which it was taken
+	uint64_t start_tsc;
+	uint64_t start_ns;
+	uint64_t end_tsc;
+	uint64_t end_ns;
+};
+
+struct sched_trace_cpu_header {
+	uint32_t cpu;
+	uint32_t num_events;
+};
+
+static const uint32_t SCHED_TRACE_MAGIC = 0x54585343 /* "CSXT" */;
+static const uint32_t SCHED_TRACE_VERSION = 1;
+
+// Record an event if tracing is enabled
+inline void sched_trace_record(sched_trace_event_type type, thread *thr, uint32_t arg = 0) {
+	sched_trace *trace = global_state_->sched_trace;
+	if(trace != nullptr && trace->is_enabled()) {
+		trace->record(type, thr, arg);
+	}
+}
+
+}
@@ -1,13 +1,40 @@
 #include "scheduler.hpp"
 #include "global.hpp"
 #include <fd/process_fd.hpp>
+#include <fd/reaper.hpp>
+#include <fd/sched_trace.hpp>
+#include <hw/cpu_io.hpp>
 #include <hw/interrupt.hpp>
 #include <hw/segments.hpp>
+#include <hw/sse.hpp>
+#include <time/clock_store.hpp>
 
 extern "C" void switch_thread(void **old_sp, void *sp);
 
 using namespace cloudos;
 
+// Drop the reference of the scheduler to the thread in the given unlinked
+// item. The item is part of the thread, so the reference is moved out of it
+// first, since the thread may be destructed here.
+static void release_item(thread_list *item) {
+	assert(item->next == nullptr);
+	shared_ptr<thread> thr = move(item->data);
+	thr.reset();
+}
+
+static cloudabi_timestamp_t get_monotonic_time() {
+	// threads are already made ready during boot, before there is a clock
+	if(global_state_->clock_store == nullptr) {
+		return 0;
+	}
+	auto *clock = global_state_->clock_store->get_clock(CLOUDABI_CLOCK_MONOTONIC);
+	return clock == nullptr ? 0 : clock->get_time(0);
+}
+
+// exp(-LOAD_INTERVAL / period) for periods of 1, 5 and 15 minutes, as
+// fixed-point numbers with LOAD_SHIFT fractional bits
+static const uint32_t LOAD_DECAY[scheduler::NUM_LOAD_AVERAGES] = {1884, 2014, 2037};
+
 scheduler::scheduler()
 {}
 
@@ -36,17 +63,37 @@ void scheduler::thread_yield()
 	assert(running && running->data && !running->data->exited);
 
 	wait_for_next();
+}
+
+void scheduler::thread_preempt()
+{
+	assert(running && running->data && !running->data->exited);
+
+	auto &thr = running->data;
+	cloudabi_timestamp_t now = get_monotonic_time();
+	if(thr->slice_used + (now - thr->scheduled_at) < get_quantum(thr->priority)
+	&& !has_ready_above(thr->get_effective_priority()) && now < next_boost) {
+		// let it finish its quantum
+		return;
+	}
+
+	wait_for_next();
+}
+
+void scheduler::preempt_point()
+{
+	if(running == nullptr || waiting_for_ready_task) {
+		return;
+	}
 
-	// scheduler yielded back to this thread
-	remove_all(&dealloc_later, [&](thread_list *) {
-		return true;
-	}, [&](thread_list *dealloc) {
-		assert(dealloc->data);
-		weak_ptr<thread> thr_weak = dealloc->data;
-		dealloc->data.reset();
-		deallocate(dealloc);
-		assert(thr_weak.expired());
-	});
+	// The kernel runs with interrupts disabled; let pending interrupts in
+	// here, so that the timer interrupt can preempt this thread
+	asm volatile("sti; nop; cli" : : : "memory");
+
+	// Other interrupts may have woken up a more important thread
+	if(has_ready_above(running->data->get_effective_priority())) {
+		thread_preempt();
+	}
 }
 
 void scheduler::wait_for_next()
@@ -66,11 +113,11 @@ void scheduler::wait_for_next()
 		// timer interrupt from triggering another thread_yield(). This
 		// thread_yield would also wait until a timer interrupt, ad
 		// infinitum, so the variable prevents eventual stack overflow.
-
-		// TODO: we should also know when the next interesting clock
-		// event occurs and program our next timer interrupt to occur
-		// then, so we can handle the event immediately as it comes up.
+		// The timer is programmed for the next clock event, so we
+		// don't wake up for nothing.
+		cpu_state_t previous = set_cpu_state(CPU_IDLE);
 		asm volatile("sti; hlt; nop; cli;");
+		set_cpu_state(previous);
 	}
 	waiting_for_ready_task = false;
 
@@ -84,73 +131,236 @@ void scheduler::wait_for_next()
 
 void scheduler::schedule_next()
 {
+	cloudabi_timestamp_t now = get_monotonic_time();
+	uint64_t tsc = rdtsc();
+	account_cpu_time(tsc);
+	if(calibration_ns == 0 && now != 0) {
+		calibration_ns = now;
+		calibration_tsc = tsc;
+	} else if(tsc_khz == 0 && now - calibration_ns >= CALIBRATION_PERIOD && tsc > calibration_tsc) {
+		tsc_khz = (tsc - calibration_tsc) * 1000000 / (now - calibration_ns);
+	}
+
 	auto old_thread = running;
 	running = nullptr;
 
+	if(old_thread != 0) {
+		auto &thr = old_thread->data;
+		cloudabi_timestamp_t ran = now - thr->scheduled_at;
+		thr->runtime += ran;
+		thr->slice_used += ran;
+		thr->cycles += tsc - thr->scheduled_at_tsc;
+
+		if(thr->is_blocked()) {
+			// blocking before the quantum is used up, likely on
+			// I/O, boosts the thread
+			if(thr->priority > thr->get_process()->get_priority()) {
+				thr->priority--;
+			}
+			thr->slice_used = 0;
+		} else if(thr->slice_used >= get_quantum(thr->priority)) {
+			if(thr->priority < LOWEST_PRIORITY) {
+				thr->priority++;
+			}
+			thr->slice_used = 0;
+		}
+	}
+
+	if(now >= next_boost) {
+		boost_all(now);
+	}
+	if(now >= next_load_update) {
+		// counts the old thread as running
+		update_load_average(now);
+	}
+
 	if(old_thread != 0 && !old_thread->data->is_exited() && !old_thread->data->is_blocked()) {
 		// add this thread to the ready list, since we can reschedule it immediately
 		assert(old_thread->data->get_process()->is_running());
-		append(&ready, old_thread);
-	}
-
-	while(ready && !ready->data->is_ready()) {
-		// next thread is not ready for running, unschedule it, we'll re-schedule it
-		// later
-		ready->data->unscheduled = true;
-		auto *next = ready->next;
-		deallocate(ready);
-		ready = next;
+		enqueue(old_thread, now);
 	}
 
 	// Note: it's possible no thread was ready, in which case running is
 	// set to nullptr here
-	running = ready;
+	running = dequeue(now);
 	if(running) {
-		ready = running->next;
-		running->next = nullptr;
-
 		if(running->data->is_blocked() || running->data->is_exited() || !running->data->get_process()->is_running()) {
 			get_vga_stream() << "Thread: " << running->data << ", process: " << running->data->get_process() << ", " << running->data->get_process()->name << "\n";
 			kernel_panic("A thread in the ready list was blocked or had already exited");
 		}
+		running->data->scheduled_at = now;
+		running->data->scheduled_at_tsc = tsc;
 	}
 
 	if(old_thread != running) {
 		if(old_thread != 0) {
 			assert(old_thread->next == nullptr);
-			old_thread->data->save_sse_state();
+			thread *thr = old_thread->data.get();
+			sched_trace_record(TRACE_SWITCH_OUT, thr, thr->is_exited() ? 2 : thr->is_blocked() ? 1 : 0);
+			thr->cpu_state = cpu_state;
 
 			// reschedule, deallocate or forget about it
 			if(old_thread->data->is_exited()) {
-				// deallocate it when we next switch
+				// we may still be on its kernel stack, so let
+				// the reaper deallocate it
 				assert(old_thread->next == nullptr);
-				append(&dealloc_later, old_thread);
+				get_reaper()->reap_thread(old_thread);
 			} else if(old_thread->data->is_blocked()) {
 				old_thread->data->unscheduled = true;
 				// can safely forget about this thread here,
 				// since it's still running the process keeps
 				// it alive
 				assert(old_thread->data.use_count() > 1);
-				old_thread->data.reset();
-				deallocate(old_thread);
+				release_item(old_thread);
 				old_thread = nullptr;
 			}
 		}
 
 		if(running != 0) {
+			sched_trace_record(TRACE_SWITCH_IN, running->data.get());
+			cpu_state = running->data->cpu_state;
 			running->data->get_process()->install_page_directory();
 			get_gdt()->set_fsbase(running->data->get_fsbase());
 			get_gdt()->set_kernel_stack(running->data->get_kernel_stack_top());
-			running->data->restore_sse_state();
+			if(running->data.get() == fpu_owner) {
+				// its registers are still loaded
+				sse_clear_task_switched();
+			} else {
+				sse_set_task_switched();
+			}
+		}
+
+		if(timer) {
+			timer->quantum_changed();
+		}
+	}
+}
+
+void scheduler::fpu_trap()
+{
+	assert(running);
+	thread *thr = running->data.get();
+	sse_clear_task_switched();
+	if(fpu_owner == thr) {
+		return;
+	}
+	if(fpu_owner) {
+		fpu_owner->save_sse_state();
+	}
+	thr->restore_sse_state();
+	fpu_owner = thr;
+}
+
+void scheduler::fpu_save(thread *thr)
+{
+	if(fpu_owner != thr) {
+		// its saved state is already up to date
+		return;
+	}
+	sse_clear_task_switched();
+	thr->save_sse_state();
+	if(!running || running->data.get() != thr) {
+		sse_set_task_switched();
+	}
+}
+
+void scheduler::fpu_forget(thread *thr)
+{
+	if(fpu_owner == thr) {
+		fpu_owner = nullptr;
+	}
+}
+
+void scheduler::enqueue(thread_list *item, cloudabi_timestamp_t now)
+{
+	assert(item->next == nullptr);
+	auto &thr = item->data;
+	assert(thr->priority < NUM_PRIORITIES);
+	thr->ready_since = now;
+	append(&ready[thr->get_effective_priority()], item);
+}
+
+thread_list *scheduler::dequeue(cloudabi_timestamp_t now)
+{
+	for(size_t i = 0; i < NUM_PRIORITIES; ++i) {
+		while(ready[i] && !ready[i]->data->is_ready()) {
+			// next thread is not ready for running, unschedule it, we'll re-schedule it
+			// later
+			thread_list *item = ready[i];
+			ready[i] = item->next;
+			item->next = nullptr;
+			item->data->unscheduled = true;
+			release_item(item);
+		}
+
+		if(ready[i]) {
+			thread_list *item = ready[i];
+			ready[i] = item->next;
+			item->next = nullptr;
+			item->data->wait_time += now - item->data->ready_since;
+			return item;
+		}
+	}
+	return nullptr;
+}
+
+bool scheduler::has_ready_above(uint8_t priority)
+{
+	for(size_t i = 0; i < priority; ++i) {
+		if(ready[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void scheduler::update_load_average(cloudabi_timestamp_t now)
+{
+	next_load_update = now + LOAD_INTERVAL;
+
+	uint32_t active = running != nullptr ? 1 : 0;
+	for(size_t i = 0; i < NUM_PRIORITIES; ++i) {
+		active += size(ready[i]);
+	}
+	for(size_t i = 0; i < NUM_LOAD_AVERAGES; ++i) {
+		load_average[i] = (static_cast<uint64_t>(load_average[i]) * LOAD_DECAY[i]
+			+ static_cast<uint64_t>(active) * LOAD_ONE * (LOAD_ONE - LOAD_DECAY[i])) >> LOAD_SHIFT;
+	}
+}
+
+void scheduler::boost_all(cloudabi_timestamp_t now)
+{
+	next_boost = now + BOOST_INTERVAL;
+
+	// take all ready threads out of their lists, and put them back at
+	// the priority of their process
+	thread_list *all = nullptr;
+	for(size_t i = 0; i < NUM_PRIORITIES; ++i) {
+		if(ready[i]) {
+			append(&all, ready[i]);
+			ready[i] = nullptr;
 		}
 	}
+	while(all) {
+		thread_list *item = all;
+		all = item->next;
+		item->next = nullptr;
+		item->data->reset_priority();
+		// keep the time at which it became ready
+		append(&ready[item->data->get_effective_priority()], item);
+	}
+	if(running) {
+		running->data->reset_priority();
+	}
 }
 
-void scheduler::thread_ready(shared_ptr<thread> fd)
+void scheduler::thread_ready(shared_ptr<thread> thr)
 {
-	// add to ready
-	thread_list *e = allocate<thread_list>(fd);
-	append(&ready, e);
+	// add to ready, using the list item embedded in the thread
+	thread_list *e = &thr->sched_item;
+	assert(!e->data && e->next == nullptr);
+	e->data = move(thr);
+	enqueue(e, get_monotonic_time());
 }
 
 void scheduler::thread_exiting(shared_ptr<thread>)
@@ -169,3 +379,107 @@ shared_ptr<thread> scheduler::get_running_thread()
 {
 	return running == nullptr ? nullptr : running->data;
 }
+
+void scheduler::set_inherited_priority(thread *thr, uint8_t priority)
+{
+	assert(priority < NUM_PRIORITIES || priority == NO_INHERITED_PRIORITY);
+
+	// a ready thread is in the ready list of its priority, so move it
+	thread_list *e = &thr->sched_item;
+	bool was_ready = false;
+	if(e->data && running != e) {
+		for(size_t i = 0; i < NUM_PRIORITIES && !was_ready; ++i) {
+			was_ready = remove_one(&ready[i], [&](thread_list *item) {
+				return item == e;
+			}, intrusive_list_deallocator<shared_ptr<thread>>());
+		}
+	}
+
+	thr->inherited_priority = priority;
+
+	if(was_ready) {
+		// keep the time at which it became ready
+		append(&ready[thr->get_effective_priority()], e);
+	}
+}
+
+cloudabi_timestamp_t scheduler::get_runtime(thread *thr)
+{
+	if(running != nullptr && running->data.get() == thr) {
+		return thr->runtime + (get_monotonic_time() - thr->scheduled_at);
+	}
+	return thr->runtime;
+}
+
+uint64_t scheduler::get_cycles(thread *thr)
+{
+	if(running != nullptr && running->data.get() == thr) {
+		return thr->cycles + (rdtsc() - thr->scheduled_at_tsc);
+	}
+	return thr->cycles;
+}
+
+uint64_t scheduler::get_user_cycles(thread *thr)
+{
+	if(running != nullptr && running->data.get() == thr && cpu_state == CPU_USER) {
+		return thr->user_cycles + (rdtsc() - cpu_state_since);
+	}
+	return thr->user_cycles;
+}
+
+uint64_t scheduler::get_system_cycles(thread *thr)
+{
+	if(running != nullptr && running->data.get() == thr && cpu_state == CPU_KERNEL) {
+		return thr->system_cycles + (rdtsc() - cpu_state_since);
+	}
+	return thr->system_cycles;
+}
+
+void scheduler::account_cpu_time(uint64_t tsc)
+{
+	uint64_t elapsed = tsc - cpu_state_since;
+	cpu_state_since = tsc;
+	cpu_cycles[cpu_state] += elapsed;
+	if(running != nullptr) {
+		if(cpu_state == CPU_USER) {
+			running->data->user_cycles += elapsed;
+		} else if(cpu_state == CPU_KERNEL) {
+			running->data->system_cycles += elapsed;
+		}
+	}
+}
+
+cpu_state_t scheduler::set_cpu_state(cpu_state_t state)
+{
+	account_cpu_time(rdtsc());
+	cpu_state_t previous = cpu_state;
+	cpu_state = state;
+	return previous;
+}
+
+uint64_t scheduler::get_cpu_cycles(cpu_state_t state)
+{
+	account_cpu_time(rdtsc());
+	return cpu_cycles[state];
+}
+
+cloudabi_timestamp_t scheduler::cycles_to_ns(uint64_t cycles)
+{
+	if(tsc_khz == 0) {
+		// not calibrated yet
+		return 0;
+	}
+	// split up to prevent overflow
+	return (cycles / tsc_khz) * 1000000 + (cycles % tsc_khz) * 1000000 / tsc_khz;
+}
+
+cloudabi_timestamp_t scheduler::get_quantum_end()
+{
+	if(running == nullptr) {
+		return UINT64_MAX;
+	}
+	auto &thr = running->data;
+	cloudabi_timestamp_t quantum = get_quantum(thr->priority);
+	cloudabi_timestamp_t end = thr->scheduled_at + (thr->slice_used < quantum ? quantum - thr->slice_used : 0);
+	return end < next_boost ? end : next_boost;
+}
@@ -6,6 +6,33 @@ namespace cloudos {
 
 struct interrupt_state_t;
 
+/**
+ * A timer that interrupts the running thread at the end of its quantum, by
+ * calling scheduler::thread_preempt(). The scheduler notifies it when the
+ * running thread changes, so that it can be reprogrammed.
+ */
+struct quantum_timer {
+	virtual ~quantum_timer() {}
+	virtual void quantum_changed() = 0;
+};
+
+/**
+ * Multilevel feedback queue scheduler.
+ *
+ * Every priority level has its own ready list, and threads are always
+ * scheduled from the highest level (the lowest number) that has a ready
+ * thread. Threads run for a quantum that doubles with every level down.
+ *
+ * A thread starts at the priority of its process. When it uses up its whole
+ * quantum, it is demoted one level; when it blocks, for example on I/O, it
+ * is boosted one level, but never above the priority of its process. Every
+ * BOOST_INTERVAL, all ready threads are reset to the priority of their
+ * process, so that demoted threads cannot starve.
+ *
+ * A thread holding a userland write lock that a higher-priority thread waits
+ * for inherits the priority of that thread until it unlocks, so that a
+ * lower-priority thread holding the lock cannot make it wait indefinitely.
+ */
 struct scheduler {
 	scheduler();
 
@@ -16,6 +43,9 @@ struct scheduler {
 	[[noreturn]] void initial_yield();
 	[[noreturn]] void thread_final_yield();
 	void thread_yield();
+	// Called from the timer interrupt: yield if the running thread used
+	// up its quantum, or if a thread with a higher priority is ready.
+	void thread_preempt();
 
 	void thread_ready(shared_ptr<thread> thr);
 	void thread_exiting(shared_ptr<thread> thr);
@@ -23,14 +53,113 @@ struct scheduler {
 
 	shared_ptr<thread> get_running_thread();
 
+	// Let the given thread run at the given priority if that is higher
+	// than its own, or reset it to its own with NO_INHERITED_PRIORITY.
+	// Used for priority inheritance on userland locks.
+	void set_inherited_priority(thread *thr, uint8_t priority);
+
+	// The CPU time used by the given thread, in nanoseconds and in
+	// cycles, including the current slice if it is running
+	cloudabi_timestamp_t get_runtime(thread *thr);
+	uint64_t get_cycles(thread *thr);
+	uint64_t get_user_cycles(thread *thr);
+	uint64_t get_system_cycles(thread *thr);
+
+	// CPU time accounting. The CPU is always in one of the cpu_state_t
+	// states, and the cycles spent in a state are added to its total,
+	// and for userland and kernel time also to the running thread. The
+	// previous state is returned, so that it can be restored. When
+	// threads are switched, the state is switched along with them.
+	cpu_state_t set_cpu_state(cpu_state_t state);
+	// The cycles spent in the given state since boot
+	uint64_t get_cpu_cycles(cpu_state_t state);
+	// Convert cycles to nanoseconds, using the TSC frequency measured
+	// against the monotonic clock; 0 until it has been measured
+	cloudabi_timestamp_t cycles_to_ns(uint64_t cycles);
+
+	// The number of ready and running threads, averaged exponentially
+	// over 1, 5 and 15 minutes, as a fixed-point number with LOAD_SHIFT
+	// fractional bits. Updated every LOAD_INTERVAL.
+	inline uint32_t get_load_average(size_t i) { return load_average[i]; }
+
+	// Kernel preemption. The kernel runs with interrupts disabled, so a
+	// thread running in the kernel is only preempted at preemption points,
+	// where pending interrupts are let in so that the timer interrupt can
+	// reschedule. Must only be called where the running thread holds no
+	// pointers into state that other threads may change or free.
+	void preempt_point();
+
+	// The time at which the quantum of the running thread ends, or
+	// UINT64_MAX if no thread is running.
+	cloudabi_timestamp_t get_quantum_end();
+	inline void set_quantum_timer(quantum_timer *t) { timer = t; }
+
+	static const uint8_t NUM_PRIORITIES = 4;
+	static const uint8_t HIGHEST_PRIORITY = 0;
+	static const uint8_t LOWEST_PRIORITY = NUM_PRIORITIES - 1;
+	static const uint8_t DEFAULT_PRIORITY = 1;
+
+	// Time a thread at the highest priority may run before the timer
+	// interrupts it to schedule another one; doubled for every level down
+	static const cloudabi_timestamp_t QUANTUM = 10000000 /* ns */;
+	static const cloudabi_timestamp_t BOOST_INTERVAL = 1000000000 /* ns */;
+
+	static const size_t NUM_LOAD_AVERAGES = 3;
+	static const cloudabi_timestamp_t LOAD_INTERVAL = 5000000000 /* ns */;
+	static const uint32_t LOAD_SHIFT = 11;
+	static const uint32_t LOAD_ONE = 1 << LOAD_SHIFT;
+
+	static inline cloudabi_timestamp_t get_quantum(uint8_t priority) {
+		return QUANTUM << priority;
+	}
+
+	// The FPU and SSE registers are switched lazily: after a thread
+	// switch, CR0.TS is set, so that the first FPU or SSE instruction
+	// traps. Only then are the registers of the previous owner saved, and
+	// those of the running thread restored.
+	//
+	// Called on the Device Not Available exception (#NM).
+	void fpu_trap();
+	// Make sure the saved FPU and SSE state of the given thread is up to
+	// date, for example before copying it.
+	void fpu_save(thread *thr);
+	// Forget about the FPU and SSE registers of the given thread, because
+	// it is being destroyed.
+	void fpu_forget(thread *thr);
+
 private:
 	void wait_for_next();
 	void schedule_next();
 
+	void enqueue(thread_list *item, cloudabi_timestamp_t now);
+	thread_list *dequeue(cloudabi_timestamp_t now);
+	bool has_ready_above(uint8_t priority);
+	void boost_all(cloudabi_timestamp_t now);
+	void update_load_average(cloudabi_timestamp_t now);
+	// Add the cycles since the last call to the current CPU state
+	void account_cpu_time(uint64_t tsc);
+
+	quantum_timer *timer = nullptr;
 	thread_list *running = nullptr;
-	thread_list *ready = nullptr;
-	thread_list *dealloc_later = nullptr;
+	// the thread whose state is currently in the FPU and SSE registers
+	thread *fpu_owner = nullptr;
+	thread_list *ready[NUM_PRIORITIES] = {};
+	cloudabi_timestamp_t next_boost = 0;
 	bool waiting_for_ready_task = true;
+
+	cpu_state_t cpu_state = CPU_KERNEL;
+	uint64_t cpu_state_since = 0;
+	uint64_t cpu_cycles[NUM_CPU_STATES] = {};
+	// a time stamp counter value and the monotonic time at which it was
+	// taken, to measure the TSC frequency over CALIBRATION_PERIOD
+	// nanoseconds; tsc_khz stays 0 until then
+	static const cloudabi_timestamp_t CALIBRATION_PERIOD = 100000000;
+	uint64_t calibration_tsc = 0;
+	cloudabi_timestamp_t calibration_ns = 0;
+	uint64_t tsc_khz = 0;
+
+	uint32_t load_average[NUM_LOAD_AVERAGES] = {};
+	cloudabi_timestamp_t next_load_update = 0;
 };
 
 }
@@ -1,5 +1,8 @@
+#include <concur/wait_table.hpp>
+#include <fd/kernel_stack_pool.hpp>
 #include <fd/pipe_fd.hpp>
 #include <fd/process_fd.hpp>
+#include <fd/sched_trace.hpp>
 #include <fd/scheduler.hpp>
 #include <fd/thread.hpp>
 #include <global.hpp>
@@ -15,6 +18,18 @@ extern uint32_t _kernel_virtual_base;
 extern uint32_t initial_kernel_stack;
 extern uint32_t initial_kernel_stack_size;
 
+// The FXSAVE region as it is after FNINIT: all exceptions masked, and
+// registers empty
+static void init_sse_state(sse_state_t &sse_state) {
+	memset(sse_state, 0, sizeof(sse_state_t));
+	// x87 control word
+	sse_state[0] = 0x7f;
+	sse_state[1] = 0x03;
+	// MXCSR
+	sse_state[24] = 0x80;
+	sse_state[25] = 0x1f;
+}
+
 template <typename T>
 static inline T *allocate_on_stack(uint32_t &useresp) {
 	useresp -= sizeof(T);
@@ -30,12 +45,10 @@ thread::thread(process_fd *p, void *stack_bottom, size_t stack_len, void *auxv_a
 		kernel_panic("Upper 2 bits of the thread ID must not be set");
 	}
 
+	reset_priority();
+
 	// initialize the stack
-	kernel_stack_size = 0x10000 /* 64 kb */;
-	kernel_stack_alloc = allocate_aligned(kernel_stack_size, process_fd::PAGE_SIZE);
-	if(kernel_stack_alloc.ptr == nullptr) {
-		kernel_panic("Failed to allocate kernel stack");
-	}
+	allocate_kernel_stack();
 
 	// initialize all registers and return state to zero
 	memset(&state, 0, sizeof(state));
@@ -85,10 +98,7 @@ thread::thread(process_fd *p, void *stack_bottom, size_t stack_len, void *auxv_a
 
 	esp = kernel_stack;
 
-	/* initialize SSE FXRSTOR region */
-	// TODO: instead of doing this every time, do it once and mask
-	// off only the important bits
-	save_sse_state();
+	init_sse_state(sse_state);
 }
 
 thread::thread(process_fd *p, shared_ptr<thread> otherthread)
@@ -96,11 +106,13 @@ thread::thread(process_fd *p, shared_ptr<thread> otherthread)
 , thread_id(MAIN_THREAD)
 , userland_stack_top(otherthread->userland_stack_top)
 {
-	kernel_stack_size = otherthread->kernel_stack_size;
-	kernel_stack_alloc = allocate_aligned(kernel_stack_size, process_fd::PAGE_SIZE);
+	reset_priority();
+
+	allocate_kernel_stack();
 
 	// copy execution state
 	state = otherthread->state;
+	get_scheduler()->fpu_save(otherthread.get());
 	memcpy(sse_state, otherthread->sse_state, sizeof(sse_state));
 
 	uint8_t *kernel_stack = reinterpret_cast<uint8_t*>(get_kernel_stack_top());
@@ -115,6 +127,39 @@ thread::thread(process_fd *p, shared_ptr<thread> otherthread)
 	esp = kernel_stack;
 }
 
+static void kernel_thread_returned() {
+	kernel_panic("A kernel thread returned from its entry point");
+}
+
+thread::thread(process_fd *p, kernel_thread_entry_t entry, void *userdata, cloudabi_tid_t t)
+: process(p)
+, thread_id(t)
+{
+	reset_priority();
+
+	allocate_kernel_stack();
+
+	memset(&state, 0, sizeof(state));
+	cpu_state = CPU_KERNEL;
+
+	uint32_t *kernel_stack = reinterpret_cast<uint32_t*>(get_kernel_stack_top());
+
+	/* make it look like entry(userdata) is called, returning into a panic */
+	*--kernel_stack = reinterpret_cast<uint32_t>(userdata);
+	*--kernel_stack = reinterpret_cast<uint32_t>(&kernel_thread_returned);
+
+	/* initial kernel stack frame: callee saved registers, then switch_thread
+	 * returns into the entry point */
+	*--kernel_stack = reinterpret_cast<uint32_t>(entry);
+	for(size_t i = 0; i < 4; ++i) {
+		*--kernel_stack = 0;
+	}
+
+	esp = kernel_stack;
+
+	init_sse_state(sse_state);
+}
+
 thread::~thread() {
 	assert(exited);
 	assert(get_scheduler()->get_running_thread().get() != this);
@@ -122,7 +167,16 @@ thread::~thread() {
 	assert(reinterpret_cast<uintptr_t>(&on_stack) < reinterpret_cast<uintptr_t>(kernel_stack_alloc.ptr)
 	    || reinterpret_cast<uintptr_t>(&on_stack) >= reinterpret_cast<uintptr_t>(kernel_stack_alloc.ptr) + kernel_stack_alloc.size);
 	UNUSED(on_stack);
-	deallocate(kernel_stack_alloc);
+	get_scheduler()->fpu_forget(this);
+	get_kernel_stack_pool()->put_stack(kernel_stack_alloc);
+}
+
+void thread::allocate_kernel_stack() {
+	kernel_stack_alloc = get_kernel_stack_pool()->get_stack();
+	if(kernel_stack_alloc.ptr == nullptr) {
+		kernel_panic("Failed to allocate kernel stack");
+	}
+	kernel_stack_size = kernel_stack_alloc.size;
 }
 
 void thread::set_return_state(interrupt_state_t *new_state) {
@@ -188,6 +242,8 @@ void thread::handle_syscall() {
 	syscall_context c(this, reinterpret_cast<void*>(state.useresp));
 	cloudabi_errno_t error;
 
+	sched_trace_record(TRACE_SYSCALL_ENTER, this, state.eax);
+
 	switch(state.eax) {
 	case 0:  error = syscall_clock_res_get(c); break;
 	case 1:  error = syscall_clock_time_get(c); break;
@@ -250,6 +306,8 @@ void thread::handle_syscall() {
 		error = ENOSYS;
 	}
 
+	sched_trace_record(TRACE_SYSCALL_EXIT, this, error);
+
 	if(error) {
 		// failed, so set carry bit
 		state.eflags |= 0x1;
@@ -279,6 +337,11 @@ void thread::restore_sse_state() {
 	asm volatile("fxrstor %0" : "=m" (sse_state));
 }
 
+void thread::reset_priority() {
+	priority = process->get_priority();
+	slice_used = 0;
+}
+
 void thread::thread_exit() {
 	assert(!exited);
 	exited = true;
@@ -290,6 +353,7 @@ void thread::thread_block() {
 	assert(!blocked && !exited);
 	blocked = true;
 	unscheduled = false;
+	sched_trace_record(TRACE_BLOCK, this);
 	get_scheduler()->thread_blocked(shared_from_this());
 	get_scheduler()->thread_yield();
 }
@@ -300,6 +364,7 @@ void thread::thread_unblock() {
 	}
 
 	blocked = false;
+	sched_trace_record(TRACE_UNBLOCK, this);
 	if(unscheduled) {
 		// re-schedule
 		get_scheduler()->thread_ready(shared_from_this());
@@ -311,13 +376,92 @@ bool thread::is_ready() {
 	return !exited && process->is_running() && !blocked;
 }
 
-void thread::acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_eventtype_t locktype)
+cloudabi_errno_t thread::get_wait_key(void *address, cloudabi_scope_t scope, wait_key *key)
+{
+	if(scope == CLOUDABI_SCOPE_PRIVATE) {
+		key->process = process;
+		key->address = reinterpret_cast<uintptr_t>(address);
+		return 0;
+	} else if(scope == CLOUDABI_SCOPE_SHARED) {
+		// shared memory may be mapped at different addresses in
+		// different processes, but its physical address is the same
+		key->process = nullptr;
+		key->address = process->get_physical_address(address);
+		return key->address == 0 ? EFAULT : 0;
+	} else {
+		return EINVAL;
+	}
+}
+
+// Block until the given wakeup signaler is satisfied, or until the given
+// timeout signaler is, if any. Returns whether this thread was woken up by the
+// wakeup signaler, which may have happened even if the timeout passed as well.
+static bool wait_for_wakeup(thread_condition_signaler *wakeup, thread_condition_signaler *timeout)
+{
+	thread_condition woken(wakeup);
+	thread_condition timed_out(timeout);
+	thread_condition_waiter waiter;
+	waiter.add_condition(&woken);
+	if(timeout != nullptr) {
+		waiter.add_condition(&timed_out);
+	}
+	waiter.wait();
+
+	bool res = false;
+	thread_condition_list *satisfied = waiter.finish();
+	iterate(satisfied, [&](thread_condition_list *item) {
+		if(item->data == &woken) {
+			res = true;
+		}
+	});
+	remove_all(&satisfied, [](thread_condition_list *) {
+		return true;
+	}, intrusive_list_deallocator<thread_condition*>());
+	return res;
+}
+
+// Returns the thread of the given waiter, or an empty pointer if it exited
+// while waiting
+static shared_ptr<thread> get_live_waiter(userland_waiter_t &waiter)
+{
+	shared_ptr<thread> thr = waiter.thr.lock();
+	if(thr && thr->is_exited()) {
+		thr.reset();
+	}
+	return thr;
+}
+
+// Let the thread holding the given write-locked lock of the given process
+// inherit the given priority, if it is higher than the one it runs at. The
+// owner of a shared lock is not known, because thread IDs are only unique
+// within a process, so process is nullptr for those.
+static void inherit_priority(process_fd *process, cloudabi_lock_t lock, uint8_t priority)
+{
+	if(process == nullptr || (lock & CLOUDABI_LOCK_WRLOCKED) == 0) {
+		return;
+	}
+	cloudabi_tid_t owner_id = lock & 0x3fffffff;
+	auto owner = find(process->get_threads(), [&](thread_list *item) {
+		return item->data->get_thread_id() == owner_id;
+	});
+	if(owner != nullptr && priority < owner->data->get_effective_priority()) {
+		get_scheduler()->set_inherited_priority(owner->data.get(), priority);
+	}
+}
+
+cloudabi_errno_t thread::acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t scope, cloudabi_eventtype_t locktype, thread_condition_signaler *timeout)
 {
 	bool is_write_locked = (*lock & CLOUDABI_LOCK_WRLOCKED) != 0;
 	bool want_write_lock = locktype == CLOUDABI_EVENTTYPE_LOCK_WRLOCK;
 
 	// TODO: kernel-lock this userland lock
 
+	wait_key key;
+	cloudabi_errno_t res = get_wait_key(lock, scope, &key);
+	if(res != 0) {
+		return res;
+	}
+
 	if((*lock & 0x3fffffff) == 0) {
 		// The lock is unlocked, assume no contention
 		if(want_write_lock) {
@@ -327,16 +471,16 @@ void thread::acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_eve
 			// Make this thread reader
 			*lock = 1;
 		}
-		return;
+		return 0;
 	}
 
-	userland_lock_waiters_t *lock_info = process->get_userland_lock_info(lock);
+	userland_lock_waiters_t *lock_info = get_wait_table()->get_lock_info(key);
 
 	if(!is_write_locked && !want_write_lock && (lock_info == nullptr || lock_info->waiting_writers == nullptr)) {
 		// The lock is read-locked, this thread wants a read-lock, there are no waiting writers
 		// Add it as a reader, still not kernel-managed as this could have been done in userspace as well
 		*lock += 1;
-		return;
+		return 0;
 	}
 
 	// All other cases:
@@ -349,16 +493,42 @@ void thread::acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_eve
 
 	*lock = *lock | CLOUDABI_LOCK_KERNEL_MANAGED;
 	if(lock_info == nullptr) {
-		lock_info = process->get_or_create_userland_lock_info(lock);
+		lock_info = get_wait_table()->get_or_create_lock_info(key);
 	}
+	inherit_priority(key.process, *lock, get_effective_priority());
 
+	thread_condition_signaler wakeup;
+	bool woken;
 	if(want_write_lock) {
-		thread_weaklist *t = allocate<thread_weaklist>(weak_from_this());
-		append(&(lock_info->waiting_writers), t);
-		thread_block();
+		userland_waiter_list *waiter = allocate<userland_waiter_list>();
+		waiter->data.thr = weak_from_this();
+		waiter->data.wakeup = &wakeup;
+		append(&(lock_info->waiting_writers), waiter);
+		woken = wait_for_wakeup(&wakeup, timeout);
 	} else {
 		lock_info->number_of_readers += 1;
-		lock_info->readers_cv.wait();
+		woken = wait_for_wakeup(&lock_info->readers_cv.get_signaler(), timeout);
+	}
+
+	if(!woken) {
+		// The timeout passed, so stop waiting for the lock
+		lock_info = get_wait_table()->get_lock_info(key);
+		assert(lock_info != nullptr);
+		if(want_write_lock) {
+			bool removed = remove_one(&lock_info->waiting_writers, [&](userland_waiter_list *item) {
+				return item->data.wakeup == &wakeup;
+			});
+			(void)removed;
+			assert(removed);
+		} else {
+			lock_info->number_of_readers -= 1;
+		}
+		if(lock_info->waiting_writers == nullptr && lock_info->number_of_readers == 0) {
+			// lock is contention-free again
+			*lock = *lock & ~CLOUDABI_LOCK_KERNEL_MANAGED;
+			get_wait_table()->forget_lock_info(key);
+		}
+		return ETIMEDOUT;
 	}
 
 	// Verify that this thread has the lock now
@@ -375,9 +545,10 @@ void thread::acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_eve
 			get_vga_stream() << "Warning: Thought I had a readlock, but readcount is 0.\n";
 		}
 	}
+	return 0;
 }
 
-void thread::drop_userspace_lock(_Atomic(cloudabi_lock_t) *lock)
+cloudabi_errno_t thread::drop_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t scope)
 {
 	// as implemented by cloudlibc:
 	// if userspace wants to drop a readlock, they can freely do so if
@@ -386,75 +557,202 @@ void thread::drop_userspace_lock(_Atomic(cloudabi_lock_t) *lock)
 	// unlocking write-locks.
 	if((*lock & CLOUDABI_LOCK_WRLOCKED) == 0) {
 		get_vga_stream() << "drop_userspace_lock: lock not acquired for writing\n";
-		return;
+		return 0;
 	}
 
 	if((*lock & 0x3fffffff) != thread_id) {
 		get_vga_stream() << "drop_userspace_lock: lock not acquired by this thread\n";
-		return;
+		return 0;
 	}
 
-	// are there any write-waiters for this lock?
-	userland_lock_waiters_t *lock_info = process->get_userland_lock_info(lock);
-	if(lock_info != nullptr && lock_info->waiting_writers != nullptr) {
-		thread_weaklist *first_thread = lock_info->waiting_writers;
+	wait_key key;
+	cloudabi_errno_t res = get_wait_key(lock, scope, &key);
+	if(res != 0) {
+		return res;
+	}
+
+	// are there any write-waiters for this lock? skip the ones that
+	// exited while waiting, such as threads of a killed process waiting
+	// for a shared lock
+	// the priority this thread may have inherited was for holding the
+	// lock. If it holds another contended lock, it inherits again once a
+	// thread starts waiting for that one.
+	if(inherited_priority != NO_INHERITED_PRIORITY) {
+		get_scheduler()->set_inherited_priority(this, NO_INHERITED_PRIORITY);
+	}
+
+	userland_lock_waiters_t *lock_info = get_wait_table()->get_lock_info(key);
+	shared_ptr<thread> new_owner;
+	thread_condition_signaler *wakeup = nullptr;
+	while(lock_info != nullptr && lock_info->waiting_writers != nullptr && !new_owner) {
+		userland_waiter_list *first_thread = lock_info->waiting_writers;
 		lock_info->waiting_writers = first_thread->next;
-		shared_ptr<thread> new_owner = first_thread->data.lock();
-		// TODO: is this assertion correct, or should we continue to the next one if unset?
-		assert(new_owner);
-		*lock = CLOUDABI_LOCK_WRLOCKED | (new_owner->thread_id & 0x3fffffff);
+		new_owner = get_live_waiter(first_thread->data);
+		wakeup = first_thread->data.wakeup;
 		deallocate(first_thread);
+	}
+
+	if(new_owner) {
+		*lock = CLOUDABI_LOCK_WRLOCKED | (new_owner->thread_id & 0x3fffffff);
 
 		// no more readers and writers?
 		if(lock_info->waiting_writers == nullptr && lock_info->number_of_readers == 0) {
 			// lock is now contention-free
 			lock_info = nullptr;
-			process->forget_userland_lock_info(lock);
+			get_wait_table()->forget_lock_info(key);
 		} else {
 			// lock is still kernel managed
 			*lock |= CLOUDABI_LOCK_KERNEL_MANAGED;
+
+			// the new owner inherits the highest priority of the
+			// writers still waiting for it
+			uint8_t priority = NO_INHERITED_PRIORITY;
+			iterate(lock_info->waiting_writers, [&](userland_waiter_list *item) {
+				shared_ptr<thread> waiter = get_live_waiter(item->data);
+				if(waiter && waiter->get_effective_priority() < priority) {
+					priority = waiter->get_effective_priority();
+				}
+			});
+			inherit_priority(key.process, *lock, priority);
 		}
 
-		new_owner->thread_unblock();
-		return;
+		wakeup->condition_broadcast();
+		return 0;
 	}
 
 	// lock is no longer kernel-managed, because it's now contention-free
 	if(lock_info != nullptr) {
 		*lock = lock_info->number_of_readers;
 		lock_info->readers_cv.broadcast();
-		process->forget_userland_lock_info(lock);
+		get_wait_table()->forget_lock_info(key);
 	} else {
 		*lock = 0;
 	}
+	return 0;
 }
 
-void thread::wait_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar)
+cloudabi_errno_t thread::wait_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_scope_t scope, _Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t lock_scope, thread_condition_signaler *timeout)
 {
-	userland_condvar_waiters_t *condvar_cv = process->get_or_create_userland_condvar_cv(condvar);
-	condvar_cv->waiters += 1;
+	cloudabi_errno_t res = drop_userspace_lock(lock, lock_scope);
+	if(res != 0) {
+		return res;
+	}
+
 	*condvar = 1;
-	condvar_cv->cv.wait();
+
+	wait_key key;
+	wait_key lock_key;
+	res = get_wait_key(condvar, scope, &key);
+	if(res == 0) {
+		res = get_wait_key(lock, lock_scope, &lock_key);
+	}
+	if(res != 0) {
+		acquire_userspace_lock(lock, lock_scope, CLOUDABI_EVENTTYPE_LOCK_WRLOCK);
+		return res;
+	}
+
+	thread_condition_signaler wakeup;
+	userland_condvar_waiters_t *condvar_cv = get_wait_table()->get_or_create_condvar_info(key);
+	userland_condvar_waiter_list *waiter = allocate<userland_condvar_waiter_list>();
+	waiter->data.waiter.thr = weak_from_this();
+	waiter->data.waiter.wakeup = &wakeup;
+	waiter->data.lock = lock;
+	waiter->data.lock_key = lock_key;
+	append(&condvar_cv->waiters, waiter);
+
+	if(!wait_for_wakeup(&wakeup, timeout)) {
+		// The timeout passed. If this thread is still waiting for the
+		// condvar, stop waiting and reacquire the lock; the lock is
+		// always held again when returning.
+		condvar_cv = get_wait_table()->get_condvar_info(key);
+		bool removed = condvar_cv != nullptr && remove_one(&condvar_cv->waiters, [&](userland_condvar_waiter_list *item) {
+			return item->data.waiter.wakeup == &wakeup;
+		});
+		if(removed) {
+			if(condvar_cv->waiters == nullptr) {
+				*condvar = 0;
+				get_wait_table()->forget_condvar_info(key);
+			}
+			acquire_userspace_lock(lock, lock_scope, CLOUDABI_EVENTTYPE_LOCK_WRLOCK);
+			return ETIMEDOUT;
+		}
+
+		// Otherwise, it was signalled and moved to the waiters of the
+		// lock in the meantime, so it should wait for the lock
+		wait_for_wakeup(&wakeup, nullptr);
+	}
+
+	// Usually, the signaler moved this thread to the waiters of the lock,
+	// so that it is only woken up once it owns the lock. If it couldn't,
+	// this thread must acquire the lock itself.
+	if((*lock & CLOUDABI_LOCK_WRLOCKED) == 0 || (*lock & 0x3fffffff) != thread_id) {
+		return acquire_userspace_lock(lock, lock_scope, CLOUDABI_EVENTTYPE_LOCK_WRLOCK);
+	}
+	return 0;
+}
+
+// Make the given waiter, which is blocked waiting for a condvar, wait for the
+// given lock instead. It is woken up once it owns the lock.
+static void requeue_on_userspace_lock(shared_ptr<thread> &thr, userland_waiter_t &waiter, _Atomic(cloudabi_lock_t) *lock, wait_key const &lock_key)
+{
+	if((*lock & 0x3fffffff) == 0) {
+		// The lock is unlocked, so the waiter can have it right away
+		*lock = CLOUDABI_LOCK_WRLOCKED | (thr->get_thread_id() & 0x3fffffff);
+		waiter.wakeup->condition_broadcast();
+		return;
+	}
+
+	*lock = *lock | CLOUDABI_LOCK_KERNEL_MANAGED;
+	userland_lock_waiters_t *lock_info = get_wait_table()->get_or_create_lock_info(lock_key);
+	userland_waiter_list *item = allocate<userland_waiter_list>();
+	item->data.thr = waiter.thr;
+	item->data.wakeup = waiter.wakeup;
+	append(&lock_info->waiting_writers, item);
+	inherit_priority(lock_key.process, *lock, thr->get_effective_priority());
 }
 
-void thread::signal_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_nthreads_t nwaiters)
+cloudabi_errno_t thread::signal_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_scope_t scope, cloudabi_nthreads_t nwaiters)
 {
-	userland_condvar_waiters_t *condvar_cv = process->get_userland_condvar_cv(condvar);
+	if(*condvar == 0) {
+		// no waiters
+		return 0;
+	}
+
+	wait_key key;
+	cloudabi_errno_t res = get_wait_key(condvar, scope, &key);
+	if(res != 0) {
+		return res;
+	}
+
+	userland_condvar_waiters_t *condvar_cv = get_wait_table()->get_condvar_info(key);
 	if(!condvar_cv) {
 		// no waiters
-		return;
+		return 0;
 	}
 
-	// TODO: add the waked threads to the lock writers-waiting list, so that if the
-	// thread wakes up, it already atomically has the lock
-	if(condvar_cv->waiters <= nwaiters) {
-		*condvar = 0;
-		condvar_cv->cv.broadcast();
-		process->forget_userland_condvar_cv(condvar);
-	} else {
-		while(nwaiters-- > 0) {
-			condvar_cv->waiters -= 1;
-			condvar_cv->cv.notify();
+	// Waking up the signalled threads would only make them contend for
+	// the lock they reacquire, so instead, move them to the waiters of
+	// that lock. Then, they are woken up one at a time as they get it.
+	while(nwaiters > 0 && condvar_cv->waiters != nullptr) {
+		userland_condvar_waiter_list *item = condvar_cv->waiters;
+		condvar_cv->waiters = item->next;
+		shared_ptr<thread> waiter = get_live_waiter(item->data.waiter);
+		if(waiter) {
+			if(waiter->process == process) {
+				requeue_on_userspace_lock(waiter, item->data.waiter, item->data.lock, item->data.lock_key);
+			} else {
+				// a shared lock may be mapped elsewhere in the
+				// waiter's process, so it acquires it itself
+				item->data.waiter.wakeup->condition_broadcast();
+			}
+			--nwaiters;
 		}
+		deallocate(item);
+	}
+
+	if(condvar_cv->waiters == nullptr) {
+		*condvar = 0;
+		get_wait_table()->forget_condvar_info(key);
 	}
+	return 0;
 }
@@ -9,6 +9,8 @@ namespace cloudos {
 
 struct process_fd;
 struct scheduler;
+struct wait_key;
+struct thread_condition_signaler;
 
 struct thread;
 typedef linked_list<shared_ptr<thread>> thread_list;
@@ -21,6 +23,20 @@ static const cloudabi_tid_t MAIN_THREAD = 1;
 
 typedef uint8_t sse_state_t [512] __attribute__ ((aligned (16)));
 
+typedef void (*kernel_thread_entry_t)(void *userdata);
+
+// The inherited priority of a thread that doesn't hold any lock with waiters
+static const uint8_t NO_INHERITED_PRIORITY = 0xff;
+
+// What a CPU is doing, for CPU time accounting; see scheduler::set_cpu_state()
+enum cpu_state_t : uint8_t {
+	CPU_USER,
+	CPU_KERNEL,
+	CPU_IRQ,
+	CPU_IDLE,
+	NUM_CPU_STATES
+};
+
 /**
  * A thread is a unit of execution, belonging to a process. It consists of
  * a userland stack, a kernel stack, a stack pointer for switching from
@@ -40,6 +56,12 @@ struct thread : enable_shared_from_this<thread> {
 	/** Create a thread, forked off of another thread from another process. */
 	thread(process_fd *process, shared_ptr<thread> other_thread);
 
+	/** Create a kernel thread. It will start running at the given entry
+	 * point in kernel mode, with interrupts disabled, and only stops
+	 * running when it yields or blocks. The entry point must not return.
+	 */
+	thread(process_fd *process, kernel_thread_entry_t entry, void *userdata, cloudabi_tid_t thread_id);
+
 	~thread();
 
 	inline cloudabi_tid_t get_thread_id() {
@@ -59,6 +81,28 @@ struct thread : enable_shared_from_this<thread> {
 
 	inline process_fd *get_process() { return process; }
 
+	// Scheduling statistics, in nanoseconds: the time this thread has
+	// been running, and the time it has been waiting in a ready list. The
+	// runtime excludes the current slice of the running thread, see
+	// scheduler::get_runtime().
+	inline cloudabi_timestamp_t get_runtime() { return runtime; }
+	inline cloudabi_timestamp_t get_wait_time() { return wait_time; }
+	// The number of CPU cycles this thread has been running, and the
+	// part of them spent in userland and in the kernel on its behalf,
+	// excluding IRQs
+	inline uint64_t get_cycles() { return cycles; }
+	inline uint64_t get_user_cycles() { return user_cycles; }
+	inline uint64_t get_system_cycles() { return system_cycles; }
+	inline uint8_t get_priority() { return priority; }
+	// The priority the scheduler runs this thread at: its own, or the
+	// higher priority it inherited from a thread waiting for a userland
+	// lock it holds
+	inline uint8_t get_effective_priority() {
+		return inherited_priority < priority ? inherited_priority : priority;
+	}
+	// Reset the scheduling priority of this thread to that of its process
+	void reset_priority();
+
 	inline bool is_exited() { return exited; }
 	bool is_ready();
 	inline bool is_blocked() { return blocked; }
@@ -68,13 +112,25 @@ struct thread : enable_shared_from_this<thread> {
 	void thread_block();
 	void thread_unblock();
 
-	void acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_eventtype_t locktype);
-	void drop_userspace_lock(_Atomic(cloudabi_lock_t) *lock);
+	// Userland locks and condvars with CLOUDABI_SCOPE_PRIVATE are only
+	// used by threads of this process, while those with
+	// CLOUDABI_SCOPE_SHARED may be used by any process mapping them.
+	// Waits return ETIMEDOUT once the given timeout signaler, if any, is
+	// satisfied first.
+	cloudabi_errno_t acquire_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t scope, cloudabi_eventtype_t locktype, thread_condition_signaler *timeout = nullptr);
+	cloudabi_errno_t drop_userspace_lock(_Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t scope);
 
-	void wait_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar);
-	void signal_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_nthreads_t nwaiters);
+	// Drop the given write-locked lock, wait for the condvar to be
+	// signalled, and return once the lock is reacquired, also when
+	// timing out
+	cloudabi_errno_t wait_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_scope_t scope, _Atomic(cloudabi_lock_t) *lock, cloudabi_scope_t lock_scope, thread_condition_signaler *timeout = nullptr);
+	cloudabi_errno_t signal_userspace_cv(_Atomic(cloudabi_condvar_t) *condvar, cloudabi_scope_t scope, cloudabi_nthreads_t nwaiters);
 
 private:
+	// Find the key by which the given userland lock or condvar is known
+	// in the wait table. Its page must be present.
+	cloudabi_errno_t get_wait_key(void *address, cloudabi_scope_t scope, wait_key *key);
+
 	process_fd *process = 0;
 	// note: only the bottom 30 bits may be used
 	cloudabi_tid_t thread_id = 0;
@@ -83,12 +139,36 @@ private:
 	friend struct cloudos::scheduler;
 	void *esp = 0;
 
+	// The item by which the scheduler holds this thread while it is
+	// running or ready, so that scheduling it doesn't allocate. Its data
+	// is only set while the thread is in the scheduler.
+	thread_list sched_item;
+
 	bool blocked = false;
 	bool unscheduled = false;
 
+	// scheduling state, maintained by the scheduler
+	uint8_t priority = 0;
+	uint8_t inherited_priority = NO_INHERITED_PRIORITY;
+	cloudabi_timestamp_t slice_used = 0;
+	cloudabi_timestamp_t scheduled_at = 0;
+	cloudabi_timestamp_t ready_since = 0;
+	cloudabi_timestamp_t runtime = 0;
+	cloudabi_timestamp_t wait_time = 0;
+	uint64_t scheduled_at_tsc = 0;
+	uint64_t cycles = 0;
+	uint64_t user_cycles = 0;
+	uint64_t system_cycles = 0;
+	// the state of the CPU when this thread was switched out, which it
+	// continues in when it is switched in again; a new userland thread
+	// starts by returning to userland
+	cpu_state_t cpu_state = CPU_USER;
+
 	interrupt_state_t state;
 	sse_state_t sse_state;
 	void *userland_stack_top = 0;
+	// Take a kernel stack from the kernel stack pool
+	void allocate_kernel_stack();
 	Blk kernel_stack_alloc;
 	size_t kernel_stack_size = 0;
 };
@@ -35,9 +35,14 @@ shared_ptr<unixsock> unixsock_listen_store::get_unixsock(cloudabi_device_t dev,
 	return nullptr;
 }
 
+static bool unixsock_is_writable(void *u, thread_condition*) {
+	return reinterpret_cast<unixsock*>(u)->is_writable();
+}
+
 unixsock::unixsock(cloudabi_filetype_t sockettype, const char *n)
 : sock_t(sockettype, n)
 {
+	write_signaler.set_already_satisfied_function(unixsock_is_writable, this);
 }
 
 unixsock::~unixsock()
@@ -63,6 +68,7 @@ unixsock::~unixsock()
 		auto o = othersock.lock();
 		if(o) {
 			o->error = ECONNRESET;
+			o->write_signaler.condition_broadcast();
 		}
 		remove_all(&recv_messages, [&](unixsock_message_list *) {
 			return true;
@@ -74,9 +80,22 @@ unixsock::~unixsock()
 			deallocate(item->data);
 			deallocate(item);
 		});
+		remove_all(&stream_fds, [&](unixsock_fd_anchor_list *) {
+			return true;
+		}, [&](unixsock_fd_anchor_list *item) {
+			remove_all(&item->data.fd_list, [&](linked_list<fd_mapping_t> *) {
+				return true;
+			});
+			deallocate(item);
+		});
+	}
+
+	if(stream_buffer != nullptr) {
+		deallocate({stream_buffer, stream_capacity});
 	}
 
 	assert(recv_messages == nullptr);
+	assert(stream_fds == nullptr);
 }
 
 void unixsock::socketpair(shared_ptr<unixsock> other)
@@ -90,6 +109,158 @@ void unixsock::socketpair(shared_ptr<unixsock> other)
 	other->othersock = weak_from_this();
 }
 
+bool unixsock::stream_reserve(size_t needed)
+{
+	if(needed <= stream_capacity) {
+		return true;
+	}
+	size_t new_capacity = stream_capacity == 0 ? MIN_STREAM_CAPACITY : stream_capacity;
+	while(new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	if(new_capacity > MAX_SIZE_BUFFERS) {
+		return false;
+	}
+
+	Blk b = allocate(new_capacity);
+	if(b.ptr == nullptr) {
+		return false;
+	}
+	char *new_buffer = reinterpret_cast<char*>(b.ptr);
+
+	// move the data to the start of the new buffer
+	if(stream_buffer != nullptr) {
+		size_t first = num_recv_bytes < stream_capacity - stream_head ? num_recv_bytes : stream_capacity - stream_head;
+		memcpy(new_buffer, stream_buffer + stream_head, first);
+		memcpy(new_buffer + first, stream_buffer, num_recv_bytes - first);
+		deallocate({stream_buffer, stream_capacity});
+	}
+	stream_buffer = new_buffer;
+	stream_capacity = new_capacity;
+	stream_head = 0;
+	return true;
+}
+
+void unixsock::stream_write(const char *src, size_t count)
+{
+	assert(num_recv_bytes + count <= stream_capacity);
+	if(count == 0) {
+		return;
+	}
+
+	// the free space may wrap around the end of the buffer
+	size_t tail = (stream_head + num_recv_bytes) & (stream_capacity - 1);
+	size_t first = count < stream_capacity - tail ? count : stream_capacity - tail;
+	memcpy(stream_buffer + tail, src, first);
+	memcpy(stream_buffer, src + first, count - first);
+	num_recv_bytes += count;
+}
+
+void unixsock::stream_read(char *dest, size_t count)
+{
+	assert(count <= num_recv_bytes);
+	if(count == 0) {
+		return;
+	}
+
+	size_t first = count < stream_capacity - stream_head ? count : stream_capacity - stream_head;
+	memcpy(dest, stream_buffer + stream_head, first);
+	memcpy(dest + first, stream_buffer, count - first);
+	stream_head = (stream_head + count) & (stream_capacity - 1);
+	stream_read_offset += count;
+	num_recv_bytes -= count;
+}
+
+bool unixsock::register_handoff(const cloudabi_recv_in_t *in)
+{
+	if(in->ri_data_len == 0 || in->ri_data_len > MAX_HANDOFF_IOVECS) {
+		return false;
+	}
+	if(handoff.waiting) {
+		auto receiver = handoff.receiver.lock();
+		if(receiver && !receiver->is_exited()) {
+			// another thread is receiving already
+			return false;
+		}
+	}
+
+	// the sender runs in another address space, so keep a copy of the
+	// iovecs themselves
+	for(size_t i = 0; i < in->ri_data_len; ++i) {
+		handoff.iovecs[i] = in->ri_data[i];
+	}
+	handoff.iovecs_len = in->ri_data_len;
+	auto thr = get_scheduler()->get_running_thread();
+	handoff.receiver.reset();
+	handoff.receiver = thr;
+	handoff.datalen = 0;
+	handoff.done = false;
+	handoff.waiting = true;
+	return true;
+}
+
+size_t unixsock::try_handoff(const cloudabi_send_in_t *in, size_t total_message_size)
+{
+	if(!handoff.waiting || handoff.done || num_recv_bytes != 0
+	|| recv_messages != nullptr || stream_fds != nullptr) {
+		return 0;
+	}
+	auto receiver = handoff.receiver.lock();
+	if(!receiver || receiver->is_exited() || !receiver->get_process()->is_running()) {
+		// the receiver was killed while it was waiting
+		handoff.waiting = false;
+		return 0;
+	}
+	process_fd *process = receiver->get_process();
+
+	if(type == CLOUDABI_FILETYPE_SOCKET_DGRAM) {
+		// only hand off datagrams that aren't truncated
+		size_t space = 0;
+		for(size_t i = 0; i < handoff.iovecs_len; ++i) {
+			space += handoff.iovecs[i].buf_len;
+		}
+		if(space < total_message_size) {
+			return 0;
+		}
+	}
+
+	// copy from the iovecs of the sender to those of the receiver in one
+	// pass
+	size_t copied = 0;
+	size_t send_i = 0;
+	size_t send_pos = 0;
+	for(size_t recv_i = 0; recv_i < handoff.iovecs_len && send_i < in->si_data_len; ++recv_i) {
+		auto &iovec = handoff.iovecs[recv_i];
+		size_t recv_pos = 0;
+		while(recv_pos < iovec.buf_len && send_i < in->si_data_len) {
+			auto &data = in->si_data[send_i];
+			size_t copy = data.buf_len - send_pos;
+			if(copy > iovec.buf_len - recv_pos) {
+				copy = iovec.buf_len - recv_pos;
+			}
+			if(!process->copy_to(reinterpret_cast<char*>(iovec.buf) + recv_pos,
+					reinterpret_cast<const char*>(data.buf) + send_pos, copy)) {
+				// leave the data to the receive buffers, the
+				// receiver will get the error when it copies it
+				return 0;
+			}
+			recv_pos += copy;
+			send_pos += copy;
+			copied += copy;
+			if(send_pos == data.buf_len) {
+				send_i++;
+				send_pos = 0;
+			}
+		}
+	}
+
+	handoff.datalen = copied;
+	handoff.done = true;
+	// the receiver may not be the first thread waiting
+	recv_messages_cv.broadcast();
+	return copied;
+}
+
 size_t unixsock::read(void *dest, size_t count)
 {
 	cloudabi_iovec_t iovec[1];
@@ -335,10 +506,26 @@ void unixsock::sock_shutdown(cloudabi_sdflags_t how)
 	}
 	if(how & CLOUDABI_SHUT_WR) {
 		status = sockstatus_t::SHUTDOWN;
+		write_signaler.condition_broadcast();
 	}
 	error = 0;
 }
 
+bool unixsock::is_writable()
+{
+	if(status != sockstatus_t::CONNECTED) {
+		return true;
+	}
+	auto other = othersock.lock();
+	return !other || other->num_recv_bytes < MAX_SIZE_BUFFERS;
+}
+
+cloudabi_errno_t unixsock::get_write_signaler(thread_condition_signaler **s)
+{
+	*s = &write_signaler;
+	return 0;
+}
+
 void unixsock::sock_stat_get(cloudabi_sockstat_t* buf, cloudabi_ssflags_t flags)
 {
 	assert(buf);
@@ -372,7 +559,15 @@ void unixsock::sock_recv(const cloudabi_recv_in_t* in, cloudabi_recv_out_t *out)
 	assert(type == CLOUDABI_FILETYPE_SOCKET_DGRAM
 	    || type == CLOUDABI_FILETYPE_SOCKET_STREAM);
 
-	if(recv_messages == nullptr) {
+	auto is_empty = [&]() {
+		if(type == CLOUDABI_FILETYPE_SOCKET_DGRAM) {
+			return recv_messages == nullptr;
+		}
+		// fds are only received by a recv that has room for them
+		return num_recv_bytes == 0 && (stream_fds == nullptr || in->ri_fds_len == 0);
+	};
+
+	if(is_empty()) {
 		auto other = othersock.lock();
 		if(!other) {
 			// othersock is already destroyed
@@ -383,22 +578,36 @@ void unixsock::sock_recv(const cloudabi_recv_in_t* in, cloudabi_recv_out_t *out)
 
 		assert(other->status == sockstatus_t::CONNECTED || other->status == sockstatus_t::SHUTDOWN);
 
-		// wait until there is at least one more message
-		while(other->status == sockstatus_t::CONNECTED && recv_messages == nullptr) {
+		// wait until there is at least one more message, or a sender
+		// copied one into our buffers directly
+		bool handoff_registered = register_handoff(in);
+		while(other->status == sockstatus_t::CONNECTED && is_empty()
+		&& !(handoff_registered && handoff.done)) {
 			recv_messages_cv.wait();
 		}
 
-		if(recv_messages == nullptr) {
+		if(handoff_registered) {
+			handoff.waiting = false;
+			handoff.receiver.reset();
+			if(handoff.done) {
+				handoff.done = false;
+				out->ro_datalen = handoff.datalen;
+				error = 0;
+				return;
+			}
+		}
+
+		if(is_empty()) {
 			// other socket is in shutdown and there are no messages
 			error = 0;
 			return;
 		}
 	}
-	assert(recv_messages);
 
 	if(type == CLOUDABI_FILETYPE_SOCKET_DGRAM) {
 		// Datagram receiving: take next message; fill current buffers
 		// with only it
+		assert(recv_messages);
 		auto item = recv_messages;
 		auto message = item->data;
 		recv_messages = item->next;
@@ -445,45 +654,17 @@ void unixsock::sock_recv(const cloudabi_recv_in_t* in, cloudabi_recv_out_t *out)
 		out->ro_fdslen = fds_set;
 		error = 0;
 
+		num_recv_bytes -= message->buf.size;
 		deallocate(message->buf);
 		deallocate(message);
 	} else if(type == CLOUDABI_FILETYPE_SOCKET_STREAM) {
-		// Stream receiving: while the current buffers aren't full,
-		// fill them with parts of the next message, taking them off
-		// the list when they are fully consumed
-
-		auto *recv_message = recv_messages;
-		size_t total_written = 0;
-		for(size_t i = 0; i < in->ri_data_len && recv_message; ++i) {
-			auto &iovec = in->ri_data[i];
-			size_t written = 0;
-			while(written < iovec.buf_len && recv_message) {
-				auto *body = recv_message->data;
-				assert(body->buf.size >= body->stream_data_recv);
-				size_t message_remaining = body->buf.size - body->stream_data_recv;
-				if(message_remaining > 0) {
-					size_t iovec_remaining = iovec.buf_len - written;
-					size_t copy = iovec_remaining < message_remaining ? iovec_remaining : message_remaining;
-					memcpy(reinterpret_cast<char*>(iovec.buf) + written,
-						reinterpret_cast<char*>(body->buf.ptr) + body->stream_data_recv, copy);
-					body->stream_data_recv += copy;
-					written += copy;
-					message_remaining -= copy;
-				}
-				if(message_remaining == 0) {
-					// no data left in this buffer
-					recv_message = recv_message->next;
-				}
-			}
-			total_written += written;
-		}
-
-		recv_message = recv_messages;
+		// Stream receiving: first take the fds that were sent along
+		// with data that was read already, or is read now
 		size_t fds_set = 0;
 		auto process = get_scheduler()->get_running_thread()->get_process();
-		while(fds_set < in->ri_fds_len && recv_message) {
-			auto *body = recv_message->data;
-			auto *fd_item = body->fd_list;
+		while(fds_set < in->ri_fds_len && stream_fds && stream_fds->data.offset <= stream_read_offset) {
+			auto *anchor = stream_fds;
+			auto *fd_item = anchor->data.fd_list;
 			while(fds_set < in->ri_fds_len && fd_item) {
 				fd_mapping_t &fd_map = fd_item->data;
 				in->ri_fds[fds_set] = process->add_fd(fd_map.fd, fd_map.rights_base, fd_map.rights_inheriting);
@@ -492,25 +673,47 @@ void unixsock::sock_recv(const cloudabi_recv_in_t* in, cloudabi_recv_out_t *out)
 				fd_item = fd_item->next;
 				deallocate(d);
 			}
-			body->fd_list = fd_item;
-			recv_message = recv_message->next;
+			anchor->data.fd_list = fd_item;
+			if(fd_item == nullptr) {
+				stream_fds = anchor->next;
+				deallocate(anchor);
+			}
 		}
 
-		// deallocate all messages without fd's or body
-		remove_all(&recv_messages, [&](unixsock_message_list *item) {
-			auto *body = item->data;
-			assert(body->buf.size >= body->stream_data_recv);
-			return body->buf.size == body->stream_data_recv && body->fd_list == nullptr;
-		}, [&](unixsock_message_list *item) {
-			deallocate(item->data->buf);
-			deallocate(item->data);
-			deallocate(item);
-		});
+		// Then, fill the buffers with data, but stop at the next send
+		// that carried fds, so that they are received along with it
+		size_t available = num_recv_bytes;
+		for(auto *anchor = stream_fds; anchor; anchor = anchor->next) {
+			if(anchor->data.offset > stream_read_offset) {
+				size_t until_anchor = anchor->data.offset - stream_read_offset;
+				if(until_anchor < available) {
+					available = until_anchor;
+				}
+				break;
+			}
+		}
+
+		size_t total_written = 0;
+		for(size_t i = 0; i < in->ri_data_len && total_written < available; ++i) {
+			auto &iovec = in->ri_data[i];
+			size_t copy = available - total_written;
+			if(copy > iovec.buf_len) {
+				copy = iovec.buf_len;
+			}
+			stream_read(reinterpret_cast<char*>(iovec.buf), copy);
+			total_written += copy;
+		}
 
 		out->ro_datalen = total_written;
 		out->ro_fdslen = fds_set;
 		error = 0;
 	}
+
+	// the other side may be waiting for room in our receive buffers
+	auto other = othersock.lock();
+	if(other) {
+		other->write_signaler.condition_broadcast();
+	}
 }
 
 void unixsock::sock_send(const cloudabi_send_in_t* in, cloudabi_send_out_t *out)
@@ -543,35 +746,90 @@ void unixsock::sock_send(const cloudabi_send_in_t* in, cloudabi_send_out_t *out)
 		return;
 	}
 
-	auto *message = allocate<unixsock_message>();
-	message->buf = allocate(total_message_size);
-
-	char *buffer = reinterpret_cast<char*>(message->buf.ptr);
-	for(size_t i = 0; i < in->si_data_len; ++i) {
-		const cloudabi_ciovec_t &data = in->si_data[i];
-		memcpy(buffer, data.buf, data.buf_len);
-		buffer += data.buf_len;
-	}
-	assert(buffer == reinterpret_cast<char*>(message->buf.ptr) + message->buf.size);
-
+	linked_list<fd_mapping_t> *fd_list = nullptr;
 	auto process = get_scheduler()->get_running_thread()->get_process();
 	for(size_t i = 0; i < in->si_fds_len; ++i) {
 		cloudabi_fd_t fdnum = in->si_fds[i];
 		fd_mapping_t *fd_mapping;
 		error = process->get_fd(&fd_mapping, fdnum, 0);
 		if(error != 0) {
-			deallocate(message->buf);
-			deallocate(message);
+			remove_all(&fd_list, [&](linked_list<fd_mapping_t> *) {
+				return true;
+			});
 			return;
 		}
 		fd_mapping_t fd_mapping_copy = *fd_mapping;
 		auto *fd_item = allocate<linked_list<fd_mapping_t>>(fd_mapping_copy);
-		append(&message->fd_list, fd_item);
+		append(&fd_list, fd_item);
 	}
 
-	auto *message_item = allocate<unixsock_message_list>(message);
-	append(&other->recv_messages, message_item);
-	other->num_recv_bytes += total_message_size;
+	// a receiver that is waiting already gets the data directly; any
+	// fds go through the receive buffers, along with their data
+	size_t handed_off = 0;
+	if(fd_list == nullptr && total_message_size > 0) {
+		handed_off = other->try_handoff(in, total_message_size);
+		if(handed_off == total_message_size) {
+			out->so_datalen = total_message_size;
+			error = 0;
+			return;
+		}
+	}
+
+	if(type == CLOUDABI_FILETYPE_SOCKET_DGRAM) {
+		assert(handed_off == 0);
+		auto *message = allocate<unixsock_message>();
+		message->buf = allocate(total_message_size);
+		message->fd_list = fd_list;
+
+		char *buffer = reinterpret_cast<char*>(message->buf.ptr);
+		for(size_t i = 0; i < in->si_data_len; ++i) {
+			const cloudabi_ciovec_t &data = in->si_data[i];
+			memcpy(buffer, data.buf, data.buf_len);
+			buffer += data.buf_len;
+		}
+		assert(buffer == reinterpret_cast<char*>(message->buf.ptr) + message->buf.size);
+
+		auto *message_item = allocate<unixsock_message_list>(message);
+		append(&other->recv_messages, message_item);
+		other->num_recv_bytes += total_message_size;
+	} else {
+		if(!other->stream_reserve(other->num_recv_bytes + total_message_size - handed_off)) {
+			remove_all(&fd_list, [&](linked_list<fd_mapping_t> *) {
+				return true;
+			});
+			if(handed_off > 0) {
+				// only the part that was handed off is sent
+				out->so_datalen = handed_off;
+				error = 0;
+				return;
+			}
+			error = ENOBUFS;
+			return;
+		}
+
+		if(fd_list != nullptr) {
+			uint64_t offset = other->stream_read_offset + other->num_recv_bytes;
+			auto *anchor = allocate<unixsock_fd_anchor_list>(unixsock_fd_anchor{offset, fd_list});
+			append(&other->stream_fds, anchor);
+		} else if(total_message_size == 0) {
+			// nothing to receive
+			out->so_datalen = 0;
+			error = 0;
+			return;
+		}
+
+		// skip what was handed off to the receiver already
+		size_t skip = handed_off;
+		for(size_t i = 0; i < in->si_data_len; ++i) {
+			const cloudabi_ciovec_t &data = in->si_data[i];
+			if(skip >= data.buf_len) {
+				skip -= data.buf_len;
+				continue;
+			}
+			other->stream_write(reinterpret_cast<const char*>(data.buf) + skip, data.buf_len - skip);
+			skip = 0;
+		}
+	}
 	other->recv_messages_cv.notify();
 	out->so_datalen = total_message_size;
 	error = 0;
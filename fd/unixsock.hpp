@@ -10,13 +10,22 @@ typedef linked_list<unixsock_message*> unixsock_message_list;
 
 struct unixsock_message {
 	Blk buf;
-	size_t stream_data_recv = 0;
 	// fd_mapping_t contains a shared_ptr<fd_t>. With shared_ptr, fd's
 	// survive in-flight (i.e. they are not destructed when a close()
 	// happens between send() and recv()).
 	linked_list<fd_mapping_t> *fd_list = nullptr;
 };
 
+/** File descriptors sent over a stream socket. They are passed to the
+ * receiver along with the byte at the given stream offset, which is the
+ * first byte of the send they were part of.
+ */
+struct unixsock_fd_anchor {
+	uint64_t offset;
+	linked_list<fd_mapping_t> *fd_list;
+};
+typedef linked_list<unixsock_fd_anchor> unixsock_fd_anchor_list;
+
 struct unixsock;
 
 struct unixsock_listen_store {
@@ -54,6 +63,13 @@ struct unixsock : public sock_t, public enable_shared_from_this<unixsock> {
 	void sock_recv(const cloudabi_recv_in_t* in, cloudabi_recv_out_t *out) override;
 	void sock_send(const cloudabi_send_in_t* in, cloudabi_send_out_t *out) override;
 
+	/** A connected unixsock is writable while the receive buffers of the
+	 * other side are below MAX_SIZE_BUFFERS. If it is not connected, a
+	 * write fails immediately, so it is writable as well.
+	 */
+	bool is_writable();
+	cloudabi_errno_t get_write_signaler(thread_condition_signaler **s) override;
+
 private:
 	weak_ptr<unixsock> othersock;
 
@@ -76,10 +92,50 @@ private:
 	/* if CONNECTED or SHUTDOWN */
 	static constexpr size_t MAX_SIZE_BUFFERS = 1024 * 1024;
 	static constexpr size_t MAX_FD_PER_MESSAGE = 20;
+	static constexpr size_t MIN_STREAM_CAPACITY = 4096;
 
 	size_t num_recv_bytes = 0;
+	// Datagram sockets keep every message separately
 	unixsock_message_list *recv_messages = nullptr;
 	cv_t recv_messages_cv;
+
+	/** Stream sockets keep their received data in a ring buffer, so that
+	 * small sends coalesce without an allocation each. Its capacity is a
+	 * power of two, which grows up to MAX_SIZE_BUFFERS when a send
+	 * doesn't fit. File descriptors are kept next to it, in stream order.
+	 */
+	char *stream_buffer = nullptr;
+	size_t stream_capacity = 0;
+	// The position in stream_buffer of the first byte to be read
+	size_t stream_head = 0;
+	// The stream offset of the first byte to be read
+	uint64_t stream_read_offset = 0;
+	unixsock_fd_anchor_list *stream_fds = nullptr;
+
+	bool stream_reserve(size_t needed);
+	void stream_write(const char *src, size_t count);
+	void stream_read(char *dest, size_t count);
+
+	/** A receiver that blocks in sock_recv() on an empty socket leaves its
+	 * buffers here, so that a sender can copy its data straight into them
+	 * instead of through the receive buffers.
+	 */
+	static constexpr size_t MAX_HANDOFF_IOVECS = 8;
+	struct unixsock_handoff {
+		bool waiting = false;
+		bool done = false;
+		weak_ptr<thread> receiver;
+		cloudabi_iovec_t iovecs[MAX_HANDOFF_IOVECS];
+		size_t iovecs_len = 0;
+		size_t datalen = 0;
+	} handoff;
+
+	bool register_handoff(const cloudabi_recv_in_t *in);
+	size_t try_handoff(const cloudabi_send_in_t *in, size_t total_message_size);
+
+	// Broadcast when the other side read from its receive buffers, or
+	// when the connection is shut down
+	thread_condition_signaler write_signaler;
 };
 
 }
@@ -15,6 +15,11 @@ struct driver_store;
 struct interface_store;
 struct device;
 struct scheduler;
+struct reaper;
+struct wait_table;
+struct kernel_stack_pool;
+struct sched_trace;
+struct profiler;
 struct process_fd;
 struct rng;
 struct clock_store;
@@ -36,6 +41,11 @@ struct global_state {
 	cloudos::interface_store *interface_store;
 	cloudos::device *root_device;
 	cloudos::scheduler *scheduler;
+	cloudos::reaper *reaper;
+	cloudos::wait_table *wait_table;
+	cloudos::kernel_stack_pool *kernel_stack_pool;
+	cloudos::sched_trace *sched_trace;
+	cloudos::profiler *profiler;
 	cloudos::process_fd *init;
 	cloudos::rng *random;
 	cloudos::clock_store *clock_store;
@@ -66,6 +76,11 @@ GET_GLOBAL(driver_store, driver_store, driver_store)
 GET_GLOBAL(interface_store, interface_store, interface_store)
 GET_GLOBAL(root_device, device, root_device)
 GET_GLOBAL(scheduler, scheduler, scheduler)
+GET_GLOBAL(reaper, reaper, reaper)
+GET_GLOBAL(wait_table, wait_table, wait_table)
+GET_GLOBAL(kernel_stack_pool, kernel_stack_pool, kernel_stack_pool)
+GET_GLOBAL(sched_trace, sched_trace, sched_trace)
+GET_GLOBAL(profiler, profiler, profiler)
 GET_GLOBAL(random, rng, random)
 GET_GLOBAL(clock_store, clock_store, clock_store);
 GET_GLOBAL(unixsock_listen_store, unixsock_listen_store, unixsock_listen_store);
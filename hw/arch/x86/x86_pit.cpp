@@ -1,10 +1,30 @@
 #include "x86_pit.hpp"
 #include <oslibc/assert.hpp>
 #include <global.hpp>
+#include <fd/profiler.hpp>
 #include <fd/scheduler.hpp>
+#include <hw/cpu_io.hpp>
 
 using namespace cloudos;
 
+static const uint64_t PIT_FREQUENCY = 1193182 /* Hz */;
+static const uint16_t PIT_CHANNEL0 = 0x40;
+static const uint16_t PIT_CHANNEL2 = 0x42;
+static const uint16_t PIT_COMMAND = 0x43;
+// Bit 0 enables the gate of channel 2, bit 1 connects it to the speaker
+static const uint16_t PIT_CHANNEL2_GATE = 0x61;
+// Interrupt at least twice per wrap of the time base, so that a late
+// interrupt doesn't make the time base wrap unnoticed
+static const uint16_t PIT_MAX_COUNT = 0x8000;
+// Don't program interrupts closer together than this (about 10 us), so that
+// an interrupt storm is not possible
+static const uint16_t PIT_MIN_COUNT = 12;
+
+static cloudabi_timestamp_t ticks_to_ns(uint64_t ticks) {
+	// split up to prevent overflow
+	return (ticks / PIT_FREQUENCY) * 1000000000 + (ticks % PIT_FREQUENCY) * 1000000000 / PIT_FREQUENCY;
+}
+
 x86_pit::x86_pit(device *parent) : device(parent), irq_handler() {
 }
 
@@ -14,6 +34,7 @@ const char *x86_pit::description() {
 
 cloudabi_errno_t x86_pit::init() {
 	register_irq(0);
+	clock.start();
 	return 0;
 }
 
@@ -26,7 +47,7 @@ void x86_pit::handle_irq(uint8_t irq) {
 	if(!get_scheduler()->is_waiting_for_ready_task()) {
 		// this timer event occurred while already waiting for something
 		// to do, so just return immediately to prevent stack overflow
-		get_scheduler()->thread_yield();
+		get_scheduler()->thread_preempt();
 	}
 }
 
@@ -39,17 +60,88 @@ x86_pit_clock::x86_pit_clock() {
 cloudabi_timestamp_t x86_pit_clock::get_resolution() {
 	// The base tick frequency is 14.31818 MHz
 	// The default divider is 12, so that's 1.1932 MHz
-	// The soft divider frequency is 65536, so 18.207 Hz
-	// Then, the resolution is 1 / 18.207 = 54925417 ns
-	return 54925417;
+	// Then, the resolution is 1 / 1193182 = 838 ns
+	return 1000000000 / PIT_FREQUENCY;
 }
 
 cloudabi_timestamp_t x86_pit_clock::get_time(cloudabi_timestamp_t /*precision*/) {
+	update_ticks();
+	cloudabi_timestamp_t time = ticks_to_ns(ticks);
+	// never go back in time, even if the PIT counter was read badly
+	if(time < last_time) {
+		time = last_time;
+	}
+	last_time = time;
 	return time;
 }
 
+void x86_pit_clock::update_ticks() {
+	// latch the count of channel 2
+	outb(PIT_COMMAND, 0x80);
+	uint16_t count = inb(PIT_CHANNEL2);
+	count |= inb(PIT_CHANNEL2) << 8;
+
+	// it counts down, wrapping around at zero
+	ticks += static_cast<uint16_t>(reference_count - count);
+	reference_count = count;
+}
+
+void x86_pit_clock::program(uint16_t count) {
+	// channel 0, lobyte/hibyte access, mode 0 (interrupt on terminal count)
+	outb(PIT_COMMAND, 0x30);
+	outb(PIT_CHANNEL0, count & 0xff);
+	outb(PIT_CHANNEL0, count >> 8);
+}
+
+void x86_pit_clock::start() {
+	// channel 2 is the time base: enable its gate, keep the speaker off,
+	// and let it count down from 65536 (a count of 0) over and over
+	outb(PIT_CHANNEL2_GATE, (inb(PIT_CHANNEL2_GATE) & ~0x02) | 0x01);
+	// channel 2, lobyte/hibyte access, mode 2 (rate generator)
+	outb(PIT_COMMAND, 0xb4);
+	outb(PIT_CHANNEL2, 0);
+	outb(PIT_CHANNEL2, 0);
+	update_ticks();
+	ticks = 0;
+
+	program(PIT_MAX_COUNT);
+	get_scheduler()->set_quantum_timer(this);
+}
+
+void x86_pit_clock::quantum_changed() {
+	program_next_interrupt();
+}
+
+void x86_pit_clock::program_next_interrupt() {
+	update_ticks();
+	cloudabi_timestamp_t now = ticks_to_ns(ticks);
+
+	cloudabi_timestamp_t deadline = UINT64_MAX;
+	if(signalers) {
+		deadline = signalers->data->timeout;
+	}
+	cloudabi_timestamp_t quantum_end = get_scheduler()->get_quantum_end();
+	if(quantum_end < deadline) {
+		deadline = quantum_end;
+	}
+	profiler *prof = global_state_->profiler;
+	if(prof != nullptr && prof->is_enabled() && prof->get_next_sample_time() < deadline) {
+		deadline = prof->get_next_sample_time();
+	}
+
+	uint16_t count = PIT_MAX_COUNT;
+	if(deadline <= now) {
+		count = PIT_MIN_COUNT;
+	} else if(deadline - now < ticks_to_ns(PIT_MAX_COUNT)) {
+		// round up, so that the deadline has passed when the interrupt fires
+		uint64_t wait_ticks = ((deadline - now) * PIT_FREQUENCY + 999999999) / 1000000000;
+		count = wait_ticks < PIT_MIN_COUNT ? PIT_MIN_COUNT : wait_ticks;
+	}
+	program(count);
+}
+
 void x86_pit_clock::tick() {
-	time += get_resolution();
+	cloudabi_timestamp_t time = get_time(0);
 
 	while(signalers) {
 		assert(signalers->next == nullptr || signalers->next->data->timeout >= signalers->data->timeout);
@@ -65,12 +157,14 @@ void x86_pit_clock::tick() {
 		deallocate(item->data);
 		deallocate(item);
 	}
+
+	program_next_interrupt();
 }
 
 thread_condition_signaler *x86_pit_clock::get_signaler(cloudabi_timestamp_t timeout,
 	cloudabi_timestamp_t precision)
 {
-	assert(timeout > time);
+	assert(timeout > last_time);
 
 	// TODO: find existing signalers for this time range, then
 	// coalesce this request into one
@@ -88,6 +182,9 @@ thread_condition_signaler *x86_pit_clock::get_signaler(cloudabi_timestamp_t time
 	if(signalers == nullptr || signalers->data->timeout >= timeout) {
 		item->next = signalers;
 		signalers = item;
+		// this is the earliest timeout now, so the PIT may need to
+		// interrupt sooner
+		program_next_interrupt();
 		return &(sig->signaler);
 	}
 
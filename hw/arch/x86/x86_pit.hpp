@@ -6,6 +6,7 @@
 #include <oslibc/list.hpp>
 #include <concur/condition.hpp>
 #include <time/clock_store.hpp>
+#include <fd/scheduler.hpp>
 #include <stdint.h>
 
 namespace cloudos {
@@ -18,7 +19,21 @@ struct x86_pit_clock_signaler {
 
 typedef linked_list<x86_pit_clock_signaler*> x86_pit_clock_signaler_list;
 
-struct x86_pit_clock : public clock {
+/**
+ * A clock driven by the PIT in one-shot mode.
+ *
+ * Instead of interrupting at a fixed rate, channel 0 of the PIT is programmed
+ * to interrupt at the earliest timeout of a signaler, or at the end of the
+ * quantum of the running thread, whichever comes first.
+ *
+ * Reprogramming channel 0 loses the ticks between reading its counter and
+ * reloading it, so it isn't used to keep time. Instead, channel 2 runs freely
+ * as a time base, and the ticks it counted down are added up whenever the
+ * time is read. Its counter is 16 bits wide and wraps every 55 ms, so when
+ * nothing is pending, channel 0 still interrupts often enough to never miss
+ * a wrap.
+ */
+struct x86_pit_clock : public clock, public quantum_timer {
 	x86_pit_clock();
 
 	cloudabi_timestamp_t get_resolution() override;
@@ -26,10 +41,24 @@ struct x86_pit_clock : public clock {
 	thread_condition_signaler *get_signaler(cloudabi_timestamp_t timeout,
 		cloudabi_timestamp_t precision) override;
 
+	// Start the PIT in one-shot mode
+	void start();
+	// Handle a PIT interrupt: broadcast all expired signalers, then
+	// program the next interrupt
 	void tick();
 
+	void quantum_changed() override;
+
 private:
-	cloudabi_timestamp_t time = 0;
+	// Add the ticks that the time base counted since it was last read
+	void update_ticks();
+	void program(uint16_t count);
+	void program_next_interrupt();
+
+	// PIT ticks counted by the time base until it was last read
+	uint64_t ticks = 0;
+	uint16_t reference_count = 0;
+	cloudabi_timestamp_t last_time = 0;
 	x86_pit_clock_signaler_list *signalers = nullptr;
 };
 
@@ -35,6 +35,13 @@ static inline void outl(uint16_t port, uint32_t val) {
 	asm volatile("outl %0, %1" : : "a"(val), "Nd"(port) );
 }
 
+// Read the time stamp counter, which counts CPU cycles
+static inline uint64_t rdtsc() {
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return (static_cast<uint64_t>(high) << 32) | low;
+}
+
 static inline void cpuid(int page, uint32_t result[4]) {
 	asm volatile("cpuid" : "=a"(result[0]), "=b"(result[1]),
 		"=c"(result[2]), "=d"(result[3]) : "a"(page));
@@ -4,6 +4,8 @@
 #include <global.hpp>
 #include <fd/scheduler.hpp>
 #include <fd/process_fd.hpp>
+#include <fd/profiler.hpp>
+#include <fd/sched_trace.hpp>
 
 using namespace cloudos;
 
@@ -163,7 +165,11 @@ void interrupt_handler::handle_irq(uint8_t irq) {
 
 	auto handler = irq_handlers[irq];
 	if(handler != 0) {
+		sched_trace_record(TRACE_IRQ_ENTER, nullptr, irq);
+		cpu_state_t previous = get_scheduler()->set_cpu_state(CPU_IRQ);
 		handler->handle_irq(irq);
+		get_scheduler()->set_cpu_state(previous);
+		sched_trace_record(TRACE_IRQ_EXIT, nullptr, irq);
 	} else {
 		get_vga_stream() << "Unknown kernel interrupt " << irq << "\n";
 		kernel_panic("Got unknown hardware interrupt.");
@@ -181,7 +187,41 @@ void interrupt_handler::handle(interrupt_state_t *regs) {
 
 	bool in_kernel = regs->cs == 8;
 	auto running_thread = get_scheduler()->get_running_thread();
-	if(running_thread) {
+
+	// Handling an interrupt from userland is kernel time of the thread
+	if(!in_kernel) {
+		get_scheduler()->set_cpu_state(CPU_KERNEL);
+	}
+
+	// The first FPU or SSE instruction after a thread switch traps, so
+	// that the registers can be switched; the instruction is retried.
+	if(int_no == 0x07 && running_thread) {
+		get_scheduler()->fpu_trap();
+		if(!in_kernel) {
+			get_scheduler()->set_cpu_state(CPU_USER);
+		}
+		return;
+	}
+
+	// Page faults on non-present pages may be resolved by the running
+	// process, in which case the faulting instruction is retried. This
+	// happens before saving the return state, since the fault may have
+	// occurred inside a system call.
+	if(int_no == 0x0e && !(err_code & 0x01) && running_thread) {
+		uint32_t address;
+		asm volatile("mov %%cr2, %0" : "=a"(address));
+		if(running_thread->get_process()->handle_page_fault(reinterpret_cast<void*>(address))) {
+			if(!in_kernel) {
+				get_scheduler()->set_cpu_state(CPU_USER);
+			}
+			return;
+		}
+	}
+
+	// Interrupts in the kernel, which only occur at preemption points,
+	// return to the kernel, so they don't change the userland state of
+	// the thread
+	if(running_thread && !in_kernel) {
 		running_thread->set_return_state(regs);
 	}
 
@@ -190,9 +230,6 @@ void interrupt_handler::handle(interrupt_state_t *regs) {
 		fatal_exception(int_no, err_code, regs);
 	}
 
-	// TODO: handle page fault as a special case, because it can be
-	// solved by the running_thread
-
 	// Any exceptions in the userland are handled by the thread
 	if(!in_kernel && (int_no < 0x20 || int_no >= 0x30)) {
 		assert(running_thread.use_count() > 1);
@@ -206,10 +243,14 @@ void interrupt_handler::handle(interrupt_state_t *regs) {
 	}
 	// Hardware interrupts are handled normally
 	else {
+		if(int_no == 0x20) {
+			// the timer interrupt, before it may switch threads
+			profiler_timer_interrupt(regs);
+		}
 		handle_irq(int_no - 0x20);
 	}
 
-	if(running_thread) {
+	if(running_thread && !in_kernel) {
 		if(running_thread->is_exited()) {
 			// the thread we are about to reschedule has exited, so
 			// drop into the scheduler to find a new one to
@@ -220,6 +261,7 @@ void interrupt_handler::handle(interrupt_state_t *regs) {
 			kernel_panic("Returned from thread_final_yield");
 		}
 		running_thread->get_return_state(regs);
+		get_scheduler()->set_cpu_state(CPU_USER);
 	}
 }
 
@@ -26,3 +26,15 @@ void cloudos::sse_enable() {
 		"mov %%eax, %%cr4\n"
 		: : : "eax");
 }
+
+void cloudos::sse_set_task_switched() {
+	asm volatile(
+		"mov %%cr0, %%eax\n"
+		"or $0x8, %%eax\n"   // Set CR0.TS
+		"mov %%eax, %%cr0\n"
+		: : : "eax");
+}
+
+void cloudos::sse_clear_task_switched() {
+	asm volatile("clts");
+}
@@ -4,4 +4,10 @@ namespace cloudos {
 
 void sse_enable();
 
+// Make the next FPU or SSE instruction raise a Device Not Available
+// exception (#NM), by setting CR0.TS
+void sse_set_task_switched();
+// Allow FPU and SSE instructions again, by clearing CR0.TS
+void sse_clear_task_switched();
+
 }
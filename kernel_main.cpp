@@ -19,14 +19,20 @@
 #include "cloudos_version.h"
 #include "fd/process_fd.hpp"
 #include "fd/scheduler.hpp"
+#include "fd/reaper.hpp"
 #include "fd/bootfs.hpp"
 #include "fd/initrdfs.hpp"
+#include "fd/kernel_stack_pool.hpp"
+#include "fd/profiler.hpp"
+#include "fd/sched_trace.hpp"
+#include "concur/wait_table.hpp"
 #include "memory/allocator.hpp"
 #include "memory/page_allocator.hpp"
 #include "memory/map_virtual.hpp"
 #include "global.hpp"
 #include "rng/rng.hpp"
 #include <time/clock_store.hpp>
+#include <time/cputime_clock.hpp>
 #include <fd/unixsock.hpp>
 
 using namespace cloudos;
@@ -149,6 +155,18 @@ void kernel_main(uint32_t multiboot_magic, void *bi_ptr, void *end_of_kernel) {
 	scheduler sched;
 	global.scheduler = &sched;
 
+	wait_table wtable;
+	global.wait_table = &wtable;
+
+	kernel_stack_pool stack_pool;
+	global.kernel_stack_pool = &stack_pool;
+
+	sched_trace trace;
+	global.sched_trace = &trace;
+
+	profiler prof;
+	global.profiler = &prof;
+
 	rng rng;
 	rng.seed(98764);
 	global.random = &rng;
@@ -177,7 +195,13 @@ void kernel_main(uint32_t multiboot_magic, void *bi_ptr, void *end_of_kernel) {
 		global.init->add_initial_fds();
 	}
 
+	reaper reaper;
+	global.reaper = &reaper;
+	reaper.start();
+
 	global.clock_store = allocate<clock_store>();
+	process_cputime_clock process_cputime;
+	thread_cputime_clock thread_cputime;
 	global.driver_store = allocate<driver_store>();
 
 #define REGISTER_DRIVER(TYPE) \
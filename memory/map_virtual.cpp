@@ -28,6 +28,9 @@ map_virtual::map_virtual(page_allocator *p)
 
 	/* NOTE: these are physical memory Blks */
 	Blk vmem_bitmap_allocs = pa->allocate_contiguous_phys(num_vmem_buf_pages);
+	if(vmem_bitmap_allocs.ptr == 0) {
+		kernel_panic("Failed to allocate the virtual memory bitmap");
+	}
 	assert(vmem_bitmap_allocs.size == vmem_buf_size);
 
 	uint8_t *bitmap_buffer = reinterpret_cast<uint8_t*>(vmem_bitmap_allocs.ptr) + _kernel_virtual_base;
@@ -41,11 +44,11 @@ map_virtual::map_virtual(page_allocator *p)
 			kernel_panic("Failed to allocate kernel paging table");
 		}
 		assert((reinterpret_cast<uint32_t>(b.ptr) & 0xfff) == 0);
-		kernel_page_tables[i] = reinterpret_cast<uint32_t*>(reinterpret_cast<uint32_t>(b.ptr) + _kernel_virtual_base);
+		kernel_page_tables[i] = reinterpret_cast<page_entry_t*>(reinterpret_cast<uint32_t>(b.ptr) + _kernel_virtual_base);
 	}
 
 	// Allocate memory for the stage2 page directory
-	paging_directory_stage2 = pa->allocate_phys();
+	paging_directory_stage2 = pa->allocate_contiguous_phys(PAGE_DIRECTORY_ALLOC_SIZE / PAGE_SIZE);
 	if(paging_directory_stage2.ptr == 0) {
 		kernel_panic("Failed to allocate page directory for stage2 paging");
 	}
@@ -54,7 +57,7 @@ map_virtual::map_virtual(page_allocator *p)
 
 	// Lastly, ensure all physical memory for page allocations up till now is mapped onto _kernel_virtual_base
 	for(size_t i = 0; i < NUM_KERNEL_PAGE_TABLES; ++i) {
-		uint32_t *page_table = kernel_page_tables[i];
+		page_entry_t *page_table = kernel_page_tables[i];
 
 		for(size_t entry = 0; entry < PAGING_TABLE_SIZE; ++entry) {
 			uint32_t address = i * PAGING_TABLE_SIZE * PAGE_SIZE + entry * PAGE_SIZE;
@@ -88,11 +91,20 @@ void *map_virtual::to_physical_address(process_fd *fd, const void *logical) {
 		return 0;
 	}
 
-	uint16_t page_table_num = reinterpret_cast<uint64_t>(logical) >> 22;
-	uint32_t *page_table = 0;
+	uint16_t page_table_num = page_table_index(reinterpret_cast<uintptr_t>(logical));
+	page_entry_t *page_table = 0;
 	if(page_table_num >= KERNEL_PAGE_OFFSET) {
 		page_table = kernel_page_tables[page_table_num - KERNEL_PAGE_OFFSET];
 	} else if(fd) {
+		page_entry_t hugepage = fd->get_hugepage(page_table_num);
+		if(hugepage != 0) {
+			physaddr_t page_address = hugepage & HUGEPAGE_ADDRESS_MASK;
+			if(page_address >= (uint64_t(1) << 32)) {
+				return 0;
+			}
+			page_address += reinterpret_cast<uintptr_t>(logical) & (PAGE_TABLE_COVERS - 1);
+			return reinterpret_cast<void*>(page_address);
+		}
 		page_table = fd->get_page_table(page_table_num);
 	} else {
 		kernel_panic("to_physical_address for userspace page, but no process fd given");
@@ -103,16 +115,19 @@ void *map_virtual::to_physical_address(process_fd *fd, const void *logical) {
 		return 0;
 	}
 
-	uint16_t page_entry_num = reinterpret_cast<uint64_t>(logical) >> 12 & 0x03ff;
-	uint32_t page_entry = page_table[page_entry_num];
+	uint16_t page_entry_num = page_entry_index(reinterpret_cast<uintptr_t>(logical));
+	page_entry_t page_entry = page_table[page_entry_num];
 
 	if(!(page_entry & 0x1)) {
 		// not mapped
 		return 0;
 	}
 
-	uint32_t page_address = page_entry & 0xfffff000;
-	page_address += reinterpret_cast<uint64_t>(logical) & 0xfff;
+	physaddr_t page_address = page_entry & PAGE_ENTRY_ADDRESS_MASK;
+	if(page_address >= (uint64_t(1) << 32)) {
+		return 0;
+	}
+	page_address += reinterpret_cast<uintptr_t>(logical) & 0xfff;
 	return reinterpret_cast<void*>(page_address);
 }
 
@@ -143,7 +158,7 @@ Blk map_virtual::allocate_contiguous_phys(size_t size) {
 
 		assert(table < NUM_KERNEL_PAGE_TABLES);
 
-		uint32_t &entry = kernel_page_tables[table][entrynum];
+		page_entry_t &entry = kernel_page_tables[table][entrynum];
 		assert(entry == 0);
 		uint64_t ptr = reinterpret_cast<uint64_t>(phys_alloc.ptr) + i * PAGE_SIZE;
 		entry = ptr | 0x03;
@@ -176,7 +191,7 @@ Blk map_virtual::allocate(size_t size) {
 
 		assert(table < NUM_KERNEL_PAGE_TABLES);
 
-		uint32_t &entry = kernel_page_tables[table][entrynum];
+		page_entry_t &entry = kernel_page_tables[table][entrynum];
 		assert(entry == 0);
 
 		Blk b = pa->allocate_phys();
@@ -216,7 +231,37 @@ void map_virtual::deallocate(Blk b) {
 	}
 }
 
+Blk map_virtual::allocate_guarded(size_t size) {
+	Blk b = allocate(size + PAGE_SIZE);
+	if(b.ptr == 0) {
+		return {};
+	}
+
+	// Release the physical memory of the guard page, but keep its
+	// virtual address reserved
+	auto *phys_addr = to_physical_address(b.ptr);
+	unmap_page_only(b.ptr);
+	vmem_bitmap.set(kernel_page_number(b.ptr));
+	pa->deallocate_phys({reinterpret_cast<void*>(phys_addr), PAGE_SIZE});
+
+	return {reinterpret_cast<uint8_t*>(b.ptr) + PAGE_SIZE, size};
+}
+
+void map_virtual::deallocate_guarded(Blk b) {
+	deallocate(b);
+	vmem_bitmap.unset(kernel_page_number(reinterpret_cast<uint8_t*>(b.ptr) - PAGE_SIZE));
+}
+
+size_t map_virtual::kernel_page_number(void *logical_address) {
+	uint32_t addr = reinterpret_cast<uint32_t>(logical_address);
+	return (page_table_index(addr) - KERNEL_PAGE_OFFSET) * PAGING_TABLE_SIZE + page_entry_index(addr);
+}
+
 Blk map_virtual::map_pages_only(void *physaddr, size_t bytes) {
+	return map_pages_only(static_cast<physaddr_t>(reinterpret_cast<uintptr_t>(physaddr)), bytes);
+}
+
+Blk map_virtual::map_pages_only(physaddr_t physaddr, size_t bytes) {
 	assert(bytes % PAGE_SIZE == 0);
 	size_t num_pages = bytes / PAGE_SIZE;
 	size_t bit;
@@ -233,10 +278,10 @@ Blk map_virtual::map_pages_only(void *physaddr, size_t bytes) {
 
 		assert(table < NUM_KERNEL_PAGE_TABLES);
 
-		uint32_t &entry = kernel_page_tables[table][entrynum];
+		page_entry_t &entry = kernel_page_tables[table][entrynum];
 		assert(entry == 0);
 
-		entry = (reinterpret_cast<uint64_t>(physaddr) + i * PAGE_SIZE) | 0x03;
+		entry = (physaddr + i * PAGE_SIZE) | 0x03;
 		if(i == 0) {
 			table += KERNEL_PAGE_OFFSET;
 			first_ptr = reinterpret_cast<void*>(table * PAGING_TABLE_SIZE * PAGE_SIZE + entrynum * PAGE_SIZE);
@@ -255,8 +300,8 @@ void map_virtual::unmap_pages_only(Blk alloc) {
 
 void map_virtual::unmap_page_only(void *virtual_address) {
 	uint32_t addr = reinterpret_cast<uint32_t>(virtual_address);
-	uint16_t page_table_num = (addr >> 22) - KERNEL_PAGE_OFFSET;
-	uint16_t page_entry_num = addr >> 12 & 0x03ff;
+	uint16_t page_table_num = page_table_index(addr) - KERNEL_PAGE_OFFSET;
+	uint16_t page_entry_num = page_entry_index(addr);
 
 	// Mark the virtual page as unused, also flush TLB cache
 	kernel_page_tables[page_table_num][page_entry_num] = 0;
@@ -266,7 +311,7 @@ void map_virtual::unmap_page_only(void *virtual_address) {
 	vmem_bitmap.unset(page_table_num * PAGING_TABLE_SIZE + page_entry_num);
 }
 
-void map_virtual::fill_kernel_pages(uint32_t *page_directory) {
+void map_virtual::fill_kernel_pages(page_entry_t *page_directory) {
 	// page_directory is the page directory of some process
 	// we will fill it with the addresses of our kernel page tables, so that every
 	// process always sees the same kernel page tables
@@ -277,17 +322,38 @@ void map_virtual::fill_kernel_pages(uint32_t *page_directory) {
 		uint32_t address = reinterpret_cast<uint64_t>(kernel_page_tables[i]) - _kernel_virtual_base;
 		page_directory[KERNEL_PAGE_OFFSET + i] = address | 0x03 /* read-write kernel-only present table */;
 	}
+
+#ifdef PAE_ENABLED
+	// The page directory pointer table follows the page directories. Its
+	// entries may only have the present bit set.
+	page_entry_t *pointers = page_directory + PAGE_DIRECTORY_SIZE;
+	for(size_t i = 0; i < PAGE_DIRECTORY_POINTERS; ++i) {
+		auto address = reinterpret_cast<uint32_t>(to_physical_address(page_directory + i * PAGING_TABLE_SIZE));
+		assert(address != 0 && (address & 0xfff) == 0);
+		pointers[i] = address | 0x01;
+	}
+#endif
+}
+
+uint32_t map_virtual::get_paging_root(page_entry_t *page_directory) {
+#ifdef PAE_ENABLED
+	auto address = reinterpret_cast<uint32_t>(to_physical_address(page_directory + PAGE_DIRECTORY_SIZE));
+#else
+	auto address = reinterpret_cast<uint32_t>(to_physical_address(page_directory));
+#endif
+	assert(address != 0 && (address & 0xfff) == 0);
+	return address;
 }
 
 void map_virtual::load_paging_stage2() {
-	auto *page_directory = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(paging_directory_stage2.ptr) + _kernel_virtual_base);
-	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(uint32_t));
+	auto *page_directory = reinterpret_cast<page_entry_t*>(reinterpret_cast<uint8_t*>(paging_directory_stage2.ptr) + _kernel_virtual_base);
+	memset(page_directory, 0, PAGE_DIRECTORY_SIZE * sizeof(page_entry_t));
 	fill_kernel_pages(page_directory);
 
 	assert(to_physical_address(reinterpret_cast<void*>(0xc00b8000)) == reinterpret_cast<void*>(0xb8000));
 	assert(to_physical_address(reinterpret_cast<void*>(0xc01031c6)) == reinterpret_cast<void*>(0x1031c6));
 
-	asm volatile("mov %0, %%cr3" : : "a"(reinterpret_cast<uint32_t>(paging_directory_stage2.ptr)) : "memory");
+	asm volatile("mov %0, %%cr3" : : "a"(get_paging_root(page_directory)) : "memory");
 }
 
 void map_virtual::free_paging_stage2() {
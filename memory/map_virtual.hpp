@@ -8,6 +8,7 @@
 #include "hw/multiboot.hpp"
 #include "memory/allocation.hpp"
 #include "memory/page_allocator.hpp"
+#include "memory/paging.hpp"
 
 namespace cloudos {
 
@@ -21,14 +22,22 @@ struct map_virtual {
 
 	// for kernel data
 	void *to_physical_address(const void*);
-	// for userland and kernel data
+	// for userland and kernel data; returns 0 for unmapped pages and
+	// for pages above 4 GiB, which cannot be represented as a pointer
 	void *to_physical_address(process_fd*, const void*);
 
 	Blk allocate_contiguous_phys(size_t bytes);
 	Blk allocate(size_t bytes);
 	void deallocate(Blk b);
 
+	// Allocate the given number of bytes, preceded by a page that is kept
+	// unmapped, so that running off the start of the allocation faults
+	// instead of silently overwriting other kernel memory
+	Blk allocate_guarded(size_t bytes);
+	void deallocate_guarded(Blk b);
+
 	Blk map_pages_only(void *physaddr, size_t bytes);
+	Blk map_pages_only(physaddr_t physaddr, size_t bytes);
 	void unmap_pages_only(Blk alloc);
 	void unmap_page_only(void *logical_address);
 
@@ -44,7 +53,9 @@ struct map_virtual {
 		}
 	}
 
-	void fill_kernel_pages(uint32_t *page_directory);
+	void fill_kernel_pages(page_entry_t *page_directory);
+	// The value to load into cr3 to activate the given page directory
+	uint32_t get_paging_root(page_entry_t *page_directory);
 
 	void load_paging_stage2();
 	void free_paging_stage2();
@@ -52,12 +63,11 @@ struct map_virtual {
 	static constexpr int PAGE_SIZE = page_allocator::PAGE_SIZE;
 
 private:
-	static constexpr int PAGE_DIRECTORY_SIZE = 1024 /* entries */;
-	static constexpr int PAGING_TABLE_SIZE = 1024 /* entries */;
+	// The index of the given kernel virtual address in vmem_bitmap
+	static size_t kernel_page_number(void *logical_address);
+
 	static constexpr int PAGING_ALIGNMENT = 4096 /* bytes for entry alignment */;
-	static constexpr int NUM_KERNEL_PAGE_TABLES = 0x100 /* number of page tables for the kernel */;
 	static constexpr int NUM_KERNEL_PAGES = NUM_KERNEL_PAGE_TABLES * PAGING_TABLE_SIZE;
-	static constexpr int KERNEL_PAGE_OFFSET = 0x300 /* number of page tables before the kernel's */;
 
 	page_allocator *pa;
 	Bitmap vmem_bitmap;
@@ -69,7 +79,7 @@ private:
 	// the kernel. These values are copied into every process page
 	// directory, so that the kernel pages are mapped into every process.
 	// The allocations are already page-aligned.
-	uint32_t *kernel_page_tables[NUM_KERNEL_PAGE_TABLES];
+	page_entry_t *kernel_page_tables[NUM_KERNEL_PAGE_TABLES];
 };
 
 }
@@ -9,6 +9,7 @@ using namespace cloudos;
 page_allocator::page_allocator(void *h, memory_map_entry *mmap, size_t mmap_size)
 : used_pages(0)
 , free_pages(0)
+, free_high_pages(0)
 {
 	uint64_t physical_handout = reinterpret_cast<uint64_t>(h) - _kernel_virtual_base;
 
@@ -30,10 +31,13 @@ page_allocator::page_allocator(void *h, memory_map_entry *mmap, size_t mmap_size
 		begin_addr = align_up(begin_addr, PAGE_SIZE);
 
 		while(begin_addr + PAGE_SIZE <= end_addr) {
-			// if the address cannot be represented as a pointer, nevermind
+#ifndef PAE_ENABLED
+			// if the address cannot be represented as a pointer, and
+			// cannot be mapped either, nevermind
 			if(begin_addr >= (uint64_t(1) << 32)) {
 				break;
 			}
+#endif
 
 			// another page fits in this memory block, so allocate an entry
 			// TODO: this assumes the first memory block in mmap is large enough to hold the page list;
@@ -46,7 +50,11 @@ page_allocator::page_allocator(void *h, memory_map_entry *mmap, size_t mmap_size
 
 			begin_addr += PAGE_SIZE;
 
-			if(free_pages == 0) {
+			if(page_entry->data >= (uint64_t(1) << 32)) {
+				// can only be handed out by allocate_phys_page()
+				page_entry->next = free_high_pages;
+				free_high_pages = page_entry;
+			} else if(free_pages == 0) {
 				free_pages = free_pages_tail = page_entry;
 			} else {
 				assert(free_pages_tail->next == nullptr);
@@ -80,18 +88,25 @@ Blk page_allocator::allocate_phys() {
 	return {reinterpret_cast<void*>(page->data), PAGE_SIZE};
 }
 
-Blk page_allocator::allocate_contiguous_phys(size_t num) {
+Blk page_allocator::allocate_contiguous_phys(size_t num, size_t alignment) {
 	assert(num > 0);
+	assert(alignment >= PAGE_SIZE && (alignment % PAGE_SIZE) == 0);
 	// TODO: sort free_pages by ptr until we have a large enough range
 
-	page_list **head_ptr = &free_pages;
+	page_list *before_head = nullptr;
 	page_list *head = free_pages, *last = free_pages;
 	size_t num_found = 1;
 
-	while(num_found < num) {
+	// find the first page that is aligned correctly to start a range at
+	while(head != nullptr && (head->data % alignment) != 0) {
+		before_head = head;
+		head = last = head->next;
+	}
+
+	while(head != nullptr && num_found < num) {
 		if(last->next == nullptr) {
-			get_vga_stream() << __PRETTY_FUNCTION__ << " - there are no pages left\n";
-			return {};
+			head = nullptr;
+			break;
 		}
 
 		uint64_t last_ptr = last->data;
@@ -101,14 +116,31 @@ Blk page_allocator::allocate_contiguous_phys(size_t num) {
 			last = last->next;
 			num_found++;
 		} else {
-			// not contiguous, start over
-			head_ptr = &(last->next);
+			// not contiguous, start over at the next aligned page
+			before_head = last;
 			head = last = last->next;
 			num_found = 1;
+			while(head != nullptr && (head->data % alignment) != 0) {
+				before_head = head;
+				head = last = head->next;
+			}
 		}
 	}
 
-	*head_ptr = last->next;
+	if(head == nullptr) {
+		// not an error in itself; e.g. hugepages fall back to normal
+		// pages, so leave reporting it to the caller
+		return {};
+	}
+
+	if(before_head == nullptr) {
+		free_pages = last->next;
+	} else {
+		before_head->next = last->next;
+	}
+	if(free_pages_tail == last) {
+		free_pages_tail = before_head;
+	}
 	last->next = used_pages;
 	used_pages = head;
 	return {reinterpret_cast<void*>(head->data), num * PAGE_SIZE};
@@ -130,3 +162,33 @@ void page_allocator::deallocate_phys(Blk b) {
 		free_pages_tail = item;
 	}
 }
+
+physaddr_t page_allocator::allocate_phys_page() {
+	if(!empty(free_high_pages)) {
+		page_list *page = free_high_pages;
+		free_high_pages = page->next;
+
+		page->next = used_pages;
+		used_pages = page;
+		return page->data;
+	}
+
+	Blk b = allocate_phys();
+	return reinterpret_cast<uint32_t>(b.ptr);
+}
+
+void page_allocator::deallocate_phys_page(physaddr_t page) {
+	assert((page & 0xfff) == 0);
+	if(page < (uint64_t(1) << 32)) {
+		deallocate_phys({reinterpret_cast<void*>(static_cast<uint32_t>(page)), PAGE_SIZE});
+		return;
+	}
+
+	assert(!empty(used_pages));
+	page_list *item = used_pages;
+	used_pages = item->next;
+
+	item->data = page;
+	item->next = free_high_pages;
+	free_high_pages = item;
+}
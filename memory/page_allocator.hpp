@@ -6,6 +6,7 @@
 #include "oslibc/error.h"
 #include "hw/multiboot.hpp"
 #include "memory/allocation.hpp"
+#include "memory/paging.hpp"
 
 namespace cloudos {
 
@@ -44,15 +45,28 @@ inline uint64_t align_up(uint64_t value, uint64_t alignment) {
 struct page_allocator {
 	page_allocator(void *handout_start, memory_map_entry *mmap, size_t memory_map_bytes);
 
-	Blk allocate_contiguous_phys(size_t num);
+	// Allocate num physically contiguous pages. The first page will be
+	// aligned to the given alignment, which must be a multiple of PAGE_SIZE.
+	Blk allocate_contiguous_phys(size_t num, size_t alignment = PAGE_SIZE);
 	Blk allocate_phys();
 	void deallocate_phys(Blk b);
+
+	// Allocate a single page anywhere in physical memory. The Blk
+	// functions above only hand out pages below 4 GiB, while this
+	// function also returns pages above it if PAE is enabled, so it is
+	// meant for memory that is only accessed through page tables. Returns
+	// 0 if no page is left.
+	physaddr_t allocate_phys_page();
+	void deallocate_phys_page(physaddr_t page);
+
 	static const int PAGE_SIZE = 4096 /* bytes */;
 
 private:
 	page_list *used_pages;
 	page_list *free_pages;
 	page_list *free_pages_tail;
+	// pages that cannot be represented as a pointer
+	page_list *free_high_pages;
 };
 
 }
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cloudos {
+
+/**
+ * Layout of the x86 paging structures.
+ *
+ * By default, 32-bit paging is used: a page directory of 1024 32-bit entries,
+ * each pointing to a page table of 1024 entries or mapping a 4 MiB page
+ * directly.
+ *
+ * When the kernel is built with PAE_ENABLED, entries are 64 bits wide, so
+ * that physical memory above 4 GiB can be mapped. Tables then hold 512
+ * entries each, and four page directories are needed to cover the address
+ * space. These are allocated next to each other, so they can be indexed as a
+ * single page directory of 2048 entries of 2 MiB each, and they are followed
+ * by a page holding the page directory pointer table that cr3 points at. The
+ * page directory pointers are set by map_virtual::fill_kernel_pages().
+ */
+#ifdef PAE_ENABLED
+typedef uint64_t page_entry_t;
+static const int PAGING_TABLE_SIZE = 512 /* entries */;
+static const int PAGE_DIRECTORY_SIZE = 2048 /* entries, in four page directories */;
+static const int PAGE_DIRECTORY_POINTERS = 4 /* entries */;
+static const int PAGE_TABLE_SHIFT = 21;
+static const page_entry_t PAGE_ENTRY_ADDRESS_MASK = 0x000ffffffffff000ull;
+static const page_entry_t HUGEPAGE_ADDRESS_MASK = 0x000fffffffe00000ull;
+#else
+typedef uint32_t page_entry_t;
+static const int PAGING_TABLE_SIZE = 1024 /* entries */;
+static const int PAGE_DIRECTORY_SIZE = 1024 /* entries */;
+static const int PAGE_TABLE_SHIFT = 22;
+static const page_entry_t PAGE_ENTRY_ADDRESS_MASK = 0xfffff000;
+static const page_entry_t HUGEPAGE_ADDRESS_MASK = 0xffc00000;
+#endif
+
+// Physical addresses may be above 4 GiB if PAE is enabled
+typedef uint64_t physaddr_t;
+
+static const int PAGE_TABLE_COVERS = 1 << PAGE_TABLE_SHIFT /* bytes */;
+static const int KERNEL_PAGE_OFFSET = 0xc0000000u >> PAGE_TABLE_SHIFT /* number of page tables before the kernel's */;
+static const int NUM_KERNEL_PAGE_TABLES = PAGE_DIRECTORY_SIZE - KERNEL_PAGE_OFFSET;
+
+#ifdef PAE_ENABLED
+static const size_t PAGE_DIRECTORY_ALLOC_SIZE = PAGE_DIRECTORY_SIZE * sizeof(page_entry_t) + 4096 /* bytes */;
+#else
+static const size_t PAGE_DIRECTORY_ALLOC_SIZE = PAGE_DIRECTORY_SIZE * sizeof(page_entry_t) /* bytes */;
+#endif
+
+// The index of the page table (or page directory entry) for an address
+inline size_t page_table_index(uintptr_t address) {
+	return address >> PAGE_TABLE_SHIFT;
+}
+
+// The index of the entry for an address inside its page table
+inline size_t page_entry_index(uintptr_t address) {
+	return (address >> 12) & (PAGING_TABLE_SIZE - 1);
+}
+
+}
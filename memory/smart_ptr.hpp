@@ -9,37 +9,51 @@
 
 namespace cloudos {
 
-// TODO: make this entire struct respect atomics before enabling kernel
-// preemption or SMP
+// The counts are updated atomically, so that they stay correct once
+// references to the same object are taken and dropped on multiple CPUs at
+// once. The shared owners together hold one weak reference, which the last
+// of them drops after destroying the object; whoever drops the last weak
+// reference frees the control block, so that happens exactly once.
 struct shared_control_block {
-	shared_control_block(Blk b) : shared_count(1), weak_count(0), block(b) {}
+	shared_control_block(Blk b) : shared_count(1), weak_count(1), block(b) {}
 
 	void shared_increment() {
-		assert(shared_count > 0);
-		shared_count++;
+		size_t old = __atomic_fetch_add(&shared_count, 1, __ATOMIC_RELAXED);
+		assert(old > 0);
+		(void)old;
 	}
 
 	void weak_increment() {
-		weak_count++;
+		__atomic_fetch_add(&weak_count, 1, __ATOMIC_RELAXED);
 	}
 
-	bool shared_decrement() {
-		assert(shared_count > 0);
-		shared_count--;
-		return shared_count == 0;
+	// Increment the shared count, unless it already dropped to zero.
+	// Returns whether the increment happened.
+	bool shared_increment_if_nonzero() {
+		size_t count = __atomic_load_n(&shared_count, __ATOMIC_RELAXED);
+		while(count > 0) {
+			if(__atomic_compare_exchange_n(&shared_count, &count, count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return true;
+			}
+		}
+		return false;
 	}
 
-	void weak_decrement() {
-		assert(weak_count > 0);
-		weak_count--;
+	bool shared_decrement() {
+		size_t old = __atomic_fetch_sub(&shared_count, 1, __ATOMIC_ACQ_REL);
+		assert(old > 0);
+		return old == 1;
 	}
 
-	bool expired() {
-		return shared_count == 0;
+	// Returns whether this dropped the last weak reference
+	bool weak_decrement() {
+		size_t old = __atomic_fetch_sub(&weak_count, 1, __ATOMIC_ACQ_REL);
+		assert(old > 0);
+		return old == 1;
 	}
 
-	bool unreferenced() {
-		return shared_count == 0 && weak_count == 0;
+	bool expired() {
+		return __atomic_load_n(&shared_count, __ATOMIC_ACQUIRE) == 0;
 	}
 
 	void deallocate() {
@@ -47,16 +61,19 @@ struct shared_control_block {
 	}
 
 	uint64_t use_count() {
-		return shared_count;
+		return __atomic_load_n(&shared_count, __ATOMIC_RELAXED);
 	}
 
+	// The number of weak references, not counting the one held by the
+	// shared owners
 	uint64_t weak_use_count() {
-		return weak_count;
+		size_t count = __atomic_load_n(&weak_count, __ATOMIC_RELAXED);
+		return expired() ? count : count - 1;
 	}
 
 private:
-	uint64_t shared_count;
-	uint64_t weak_count;
+	size_t shared_count;
+	size_t weak_count;
 	// allocation whose lifetime is controlled by this control block;
 	// the ptr members of the shared ptrs and weak ptrs with this control
 	// block most likely point somewhere inside this block
@@ -176,18 +193,14 @@ struct shared_ptr {
 
 	void reset() {
 		shared_control_block *c = control();
-		if(c) {
-			// temporarily increase weak use count, so that
-			// the control block is not deallocated by the
-			// destructor of enable_shared_from_this if *ptr
+		if(c && c->shared_decrement()) {
+			// the weak reference of the shared owners keeps the
+			// control block alive while the destructor of
+			// enable_shared_from_this drops its own, if *ptr
 			// inherits from it
-			c->weak_increment();
-			if(c->shared_decrement()) {
-				ptr->~T();
-				c->deallocate();
-			}
-			c->weak_decrement();
-			if(c->unreferenced()) {
+			ptr->~T();
+			c->deallocate();
+			if(c->weak_decrement()) {
 				deallocate(control_block);
 			}
 		}
@@ -308,11 +321,8 @@ struct weak_ptr {
 
 	void reset() {
 		shared_control_block *c = control();
-		if(c) {
-			c->weak_decrement();
-			if(c->unreferenced()) {
-				deallocate(control_block);
-			}
+		if(c && c->weak_decrement()) {
+			deallocate(control_block);
 		}
 		control_block.ptr = nullptr;
 		ptr = nullptr;
@@ -325,9 +335,7 @@ struct weak_ptr {
 	shared_ptr<T> lock() {
 		shared_ptr<T> res;
 		auto *c = control();
-		if(c && !c->expired()) {
-			// TODO: use an atomic c->lock()
-			c->shared_increment();
+		if(c && c->shared_increment_if_nonzero()) {
 			res.control_block = control_block;
 			res.ptr = ptr;
 		}
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# Symbolize a profile, as read from /proc/kernel/profile, and write it as
+# folded stacks, which flamegraph.pl and speedscope can read.
+#
+# usage: profile_symbolize.py profile.bin cloudkernel [binary...] > profile.folded
+#
+# Kernel addresses are looked up in the given kernel ELF file. User addresses
+# are looked up in the binary whose file name matches the name of the process
+# the sample was taken in, e.g. "exec<-concur_test" uses .../concur_test, so
+# the initrd binaries can be passed here. Symbols are written as they appear
+# in the symbol table; pipe the output through c++filt to demangle them.
+
+import bisect
+import os
+import struct
+import sys
+
+MAGIC = 0x50585343
+VERSION = 1
+MAX_DEPTH = 16
+
+HEADER = struct.Struct('<IIIIIIII')
+PROCESS = struct.Struct('<I64s')
+SAMPLE = struct.Struct('<QIIHH%dI' % MAX_DEPTH)
+
+NO_PROCESS = 0xffffffff
+SAMPLE_KERNEL = 0x1
+KERNEL_BASE = 0xc0000000
+
+SHT_SYMTAB = 2
+STT_FUNC = 2
+
+class Symbols:
+  def __init__(self, path):
+    self.name = os.path.basename(path)
+    self.addresses = []
+    self.names = []
+    with open(path, 'rb') as f:
+      data = f.read()
+    if data[:4] != b'\x7fELF' or data[4] != 1:
+      raise ValueError('%s is not a 32-bit ELF file' % path)
+
+    shoff, = struct.unpack_from('<I', data, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', data, 0x2e)
+    sections = [struct.unpack_from('<IIIIIIIIII', data, shoff + i * shentsize) for i in range(shnum)]
+
+    symbols = []
+    for _, type, _, _, offset, size, link, _, _, entsize in sections:
+      if type != SHT_SYMTAB:
+        continue
+      strtab_offset = sections[link][4]
+      for i in range(size // entsize):
+        name, value, symsize, info, _, _ = struct.unpack_from('<IIIBBH', data, offset + i * entsize)
+        if info & 0xf != STT_FUNC or value == 0:
+          continue
+        end = data.index(b'\0', strtab_offset + name)
+        symbols.append((value, data[strtab_offset + name:end].decode('utf-8', 'replace')))
+    symbols.sort()
+    self.addresses = [a for a, _ in symbols]
+    self.names = [n for _, n in symbols]
+
+  def lookup(self, address):
+    i = bisect.bisect_right(self.addresses, address) - 1
+    if i < 0:
+      return '[%s] 0x%08x' % (self.name, address)
+    return self.names[i]
+
+def parse(data):
+  magic, version, sample_size, num_samples, num_processes, interval_ns, dropped, _ = \
+    HEADER.unpack_from(data, 0)
+  if magic != MAGIC:
+    raise ValueError('not a profile')
+  if version != VERSION or sample_size != SAMPLE.size:
+    raise ValueError('unsupported profile version %d' % version)
+
+  offset = HEADER.size
+  processes = []
+  for _ in range(num_processes):
+    address, name = PROCESS.unpack_from(data, offset)
+    processes.append(name.split(b'\0', 1)[0].decode('utf-8', 'replace'))
+    offset += PROCESS.size
+
+  samples = []
+  for _ in range(num_samples):
+    fields = SAMPLE.unpack_from(data, offset)
+    _, process, thread, flags, depth = fields[:5]
+    samples.append((process, thread, flags, fields[5:5 + depth]))
+    offset += SAMPLE.size
+  return processes, samples, interval_ns, dropped
+
+def binary_name(process_name):
+  # exec() names a process after the fd it executed
+  while process_name.startswith('exec<-'):
+    process_name = process_name[len('exec<-'):]
+  return os.path.basename(process_name)
+
+def main():
+  if len(sys.argv) < 3:
+    print('usage: %s profile.bin cloudkernel [binary...] > profile.folded' % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+  with open(sys.argv[1], 'rb') as f:
+    processes, samples, interval_ns, dropped = parse(f.read())
+  kernel = Symbols(sys.argv[2])
+  binaries = {}
+  for path in sys.argv[3:]:
+    binaries[os.path.basename(path)] = Symbols(path)
+
+  print('%d samples, one per %d us, %d dropped' % (len(samples), interval_ns // 1000, dropped), file=sys.stderr)
+
+  folded = {}
+  for process, thread, flags, pcs in samples:
+    if process == NO_PROCESS:
+      root = 'idle' if flags & SAMPLE_KERNEL else 'unknown'
+      binary = None
+    else:
+      root = processes[process]
+      binary = binaries.get(binary_name(root))
+
+    frames = []
+    for i, pc in enumerate(pcs):
+      # return addresses point after the call instruction
+      address = pc if i == 0 else pc - 1
+      if address >= KERNEL_BASE:
+        frames.append(kernel.lookup(address))
+      elif binary is not None:
+        frames.append(binary.lookup(address))
+      else:
+        frames.append('0x%08x' % address)
+    if flags & SAMPLE_KERNEL and process != NO_PROCESS:
+      frames.append('[kernel]')
+
+    stack = ';'.join([root] + list(reversed(frames)))
+    folded[stack] = folded.get(stack, 0) + 1
+
+  for stack, count in sorted(folded.items()):
+    print('%s %d' % (stack, count))
+
+if __name__ == '__main__':
+  main()
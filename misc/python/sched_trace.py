@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+# Convert a scheduler trace, as read from /proc/kernel/sched_trace, to the
+# Chrome trace event format, which can be loaded in chrome://tracing or
+# Perfetto.
+#
+# usage: sched_trace.py trace.bin > trace.json
+#
+# Every process is shown as a Chrome trace process, and every thread in it as
+# a Chrome trace thread, with spans for the time it was running and the system
+# calls it made. Hardware interrupts are shown per CPU under a separate "cpus"
+# process.
+
+import json
+import struct
+import sys
+
+MAGIC = 0x54585343
+VERSION = 1
+
+HEADER = struct.Struct('<IIIIQQQQ')
+CPU_HEADER = struct.Struct('<II')
+EVENT = struct.Struct('<QIIIBBH')
+
+SWITCH_IN = 1
+SWITCH_OUT = 2
+BLOCK = 3
+UNBLOCK = 4
+SIGNAL = 5
+SYSCALL_ENTER = 6
+SYSCALL_EXIT = 7
+IRQ_ENTER = 8
+IRQ_EXIT = 9
+
+SWITCH_OUT_REASONS = ['preempted', 'blocked', 'exited']
+
+# In the order of thread::handle_syscall()
+SYSCALLS = [
+  'clock_res_get', 'clock_time_get', 'condvar_signal', 'fd_close',
+  'fd_create1', 'fd_create2', 'fd_datasync', 'fd_dup', 'fd_pread',
+  'fd_pwrite', 'fd_read', 'fd_replace', 'fd_seek', 'fd_stat_get',
+  'fd_stat_put', 'fd_sync', 'fd_write', 'file_advise', 'file_allocate',
+  'file_create', 'file_link', 'file_open', 'file_readdir', 'file_readlink',
+  'file_rename', 'file_stat_fget', 'file_stat_fput', 'file_stat_get',
+  'file_stat_put', 'file_symlink', 'file_unlink', 'lock_unlock',
+  'mem_advise', 'mem_map', 'mem_protect', 'mem_sync', 'mem_unmap', 'poll',
+  'poll_fd', 'proc_exec', 'proc_exit', 'proc_fork', 'proc_raise',
+  'random_get', 'sock_accept', 'sock_bind', 'sock_connect', 'sock_listen',
+  'sock_recv', 'sock_send', 'sock_shutdown', 'sock_stat_get',
+  'thread_create', 'thread_exit', 'thread_yield',
+]
+
+# Chrome trace pid of the "cpus" process; process addresses are in the
+# kernel half of the address space, so they never collide with it
+CPUS_PID = 0
+
+def syscall_name(number):
+  if number < len(SYSCALLS):
+    return SYSCALLS[number]
+  return 'syscall %d' % number
+
+def parse(data):
+  magic, version, num_cpus, event_size, start_tsc, start_ns, end_tsc, end_ns = \
+    HEADER.unpack_from(data, 0)
+  if magic != MAGIC:
+    raise ValueError('not a scheduler trace')
+  if version != VERSION or event_size != EVENT.size:
+    raise ValueError('unsupported trace version %d' % version)
+
+  offset = HEADER.size
+  cpus = []
+  for _ in range(num_cpus):
+    cpu, num_events = CPU_HEADER.unpack_from(data, offset)
+    offset += CPU_HEADER.size
+    events = [EVENT.unpack_from(data, offset + i * EVENT.size) for i in range(num_events)]
+    offset += num_events * EVENT.size
+    cpus.append((cpu, events))
+  return (start_tsc, start_ns, end_tsc, end_ns), cpus
+
+def convert(calibration, cpus):
+  start_tsc, start_ns, end_tsc, end_ns = calibration
+  if end_tsc > start_tsc:
+    ns_per_cycle = (end_ns - start_ns) / (end_tsc - start_tsc)
+  else:
+    ns_per_cycle = 1.0
+
+  def timestamp(tsc):
+    # in microseconds, relative to the start of the trace
+    return (tsc - start_tsc) * ns_per_cycle / 1000.0
+
+  out = []
+  threads = set()
+  for cpu, events in cpus:
+    out.append({'ph': 'M', 'name': 'thread_name', 'pid': CPUS_PID, 'tid': cpu,
+                'args': {'name': 'cpu %d' % cpu}})
+
+    # The thread that was switched in last on this CPU, and the spans that
+    # are open for it
+    current = None
+    open_spans = []
+    irq_start = None
+
+    def end_open_spans(ts):
+      while open_spans:
+        pid, tid = open_spans.pop()
+        out.append({'ph': 'E', 'pid': pid, 'tid': tid, 'ts': ts})
+
+    for tsc, process, thread, arg, type, _, _ in events:
+      ts = timestamp(tsc)
+      pid_tid = (process, thread)
+      if type == SWITCH_IN:
+        current = pid_tid
+        threads.add(pid_tid)
+        out.append({'ph': 'B', 'name': 'running', 'cat': 'sched',
+                    'pid': process, 'tid': thread, 'ts': ts, 'args': {'cpu': cpu}})
+        open_spans.append(pid_tid)
+      elif type == SWITCH_OUT:
+        # a thread switched out during an interrupt handler returns from
+        # it only when it is switched in again
+        if irq_start is not None:
+          out.append({'ph': 'X', 'name': 'irq %d' % irq_start[1], 'cat': 'irq',
+                      'pid': CPUS_PID, 'tid': cpu, 'ts': irq_start[0],
+                      'dur': ts - irq_start[0]})
+          irq_start = None
+        end_open_spans(ts)
+        reason = SWITCH_OUT_REASONS[arg] if arg < len(SWITCH_OUT_REASONS) else str(arg)
+        out.append({'ph': 'i', 'name': 'switch out', 'cat': 'sched', 's': 't',
+                    'pid': process, 'tid': thread, 'ts': ts, 'args': {'reason': reason}})
+        current = None
+      elif type in (BLOCK, UNBLOCK):
+        threads.add(pid_tid)
+        out.append({'ph': 'i', 'name': 'block' if type == BLOCK else 'unblock',
+                    'cat': 'sched', 's': 't', 'pid': process, 'tid': thread, 'ts': ts})
+      elif type == SIGNAL:
+        pid, tid = current if current is not None else (CPUS_PID, cpu)
+        out.append({'ph': 'i', 'name': 'signal', 'cat': 'signal', 's': 't',
+                    'pid': pid, 'tid': tid, 'ts': ts, 'args': {'signaler': '0x%08x' % arg}})
+      elif type == SYSCALL_ENTER:
+        if pid_tid not in open_spans:
+          # the thread was running before the trace started
+          continue
+        out.append({'ph': 'B', 'name': syscall_name(arg), 'cat': 'syscall',
+                    'pid': process, 'tid': thread, 'ts': ts})
+        open_spans.append(pid_tid)
+      elif type == SYSCALL_EXIT:
+        if len(open_spans) < 2 or open_spans[-1] != pid_tid:
+          # entered before the thread was switched in, or before the trace
+          # started
+          continue
+        open_spans.pop()
+        out.append({'ph': 'E', 'pid': process, 'tid': thread, 'ts': ts,
+                    'args': {'errno': arg}})
+      elif type == IRQ_ENTER:
+        irq_start = (ts, arg)
+      elif type == IRQ_EXIT:
+        if irq_start is not None:
+          out.append({'ph': 'X', 'name': 'irq %d' % arg, 'cat': 'irq',
+                      'pid': CPUS_PID, 'tid': cpu, 'ts': irq_start[0],
+                      'dur': ts - irq_start[0]})
+          irq_start = None
+
+    if events:
+      end_open_spans(timestamp(events[-1][0]))
+
+  out.append({'ph': 'M', 'name': 'process_name', 'pid': CPUS_PID, 'args': {'name': 'cpus'}})
+  for process in set(p for p, _ in threads):
+    out.append({'ph': 'M', 'name': 'process_name', 'pid': process,
+                'args': {'name': 'process 0x%08x' % process}})
+  for process, thread in threads:
+    out.append({'ph': 'M', 'name': 'thread_name', 'pid': process, 'tid': thread,
+                'args': {'name': 'thread %d' % thread}})
+  return out
+
+def main():
+  if len(sys.argv) != 2:
+    print('usage: %s trace.bin > trace.json' % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+  with open(sys.argv[1], 'rb') as f:
+    calibration, cpus = parse(f.read())
+  json.dump({'traceEvents': convert(calibration, cpus), 'displayTimeUnit': 'ns'}, sys.stdout)
+
+if __name__ == '__main__':
+  main()
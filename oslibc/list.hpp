@@ -95,6 +95,18 @@ struct default_list_deallocator {
 	}
 };
 
+/**
+ * Deallocator for intrusive lists, whose items are embedded in the objects
+ * they refer to instead of allocated separately. It only unlinks the item, so
+ * that it can be added to a list again.
+ */
+template <typename T>
+struct intrusive_list_deallocator {
+	void operator()(linked_list<T> *item) {
+		item->next = nullptr;
+	}
+};
+
 template <typename T, typename Functor, typename Deallocator = default_list_deallocator<T>>
 inline bool remove_one(linked_list<T> **list, Functor f, Deallocator d = {}) {
 	if(*list == nullptr) {
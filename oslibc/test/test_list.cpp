@@ -335,3 +335,44 @@ TEST_CASE("remove_all") {
 	delete l2;
 	delete l1;
 }
+
+struct hooked_body {
+	hooked_body(int v) : value(v) {
+		item.data = this;
+	}
+	int value;
+	linked_list<hooked_body*> item;
+};
+
+TEST_CASE("intrusive lists") {
+	// The items are embedded in objects on the stack, so that any attempt
+	// to allocate or deallocate them would fail
+	hooked_body b1(1), b2(2), b3(3);
+	linked_list<hooked_body*> *queue = nullptr;
+	intrusive_list_deallocator<hooked_body*> unlink;
+
+	for(int round = 0; round < 3; ++round) {
+		append(&queue, &b1.item);
+		append(&queue, &b2.item);
+		append(&queue, &b3.item);
+		REQUIRE(size(queue) == 3);
+
+		REQUIRE(remove_object(&queue, &b2, unlink));
+		REQUIRE(b2.item.next == nullptr);
+		REQUIRE(queue == &b1.item);
+		REQUIRE(queue->next == &b3.item);
+
+		// a removed item can be queued again immediately
+		append(&queue, &b2.item);
+		REQUIRE(queue->next->next == &b2.item);
+
+		REQUIRE(remove_all(&queue, [](linked_list<hooked_body*> *) {
+			return true;
+		}, unlink) == 3);
+		REQUIRE(queue == nullptr);
+		REQUIRE(b1.item.next == nullptr);
+		REQUIRE(b2.item.next == nullptr);
+		REQUIRE(b3.item.next == nullptr);
+		REQUIRE(b1.item.data == &b1);
+	}
+}
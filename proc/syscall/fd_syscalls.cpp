@@ -48,14 +48,17 @@ cloudabi_errno_t cloudos::syscall_fd_create2(syscall_context &c)
 	auto type = args.first();
 
 	if(type == CLOUDABI_FILETYPE_FIFO) {
-		auto pfd = make_shared<pipe_fd>(1024, "pipe_fd");
+		// separate fds for both ends, so that each has its own flags
+		auto buffer = make_shared<pipe_buffer>(pipe_buffer::DEFAULT_CAPACITY, pipe_buffer::DEFAULT_MAX_CAPACITY);
+		auto write_end = make_shared<pipe_write_fd>(buffer, "pipe write end");
+		auto read_end = make_shared<pipe_read_fd>(buffer, "pipe read end");
 
 		auto pipe_rights = CLOUDABI_RIGHT_POLL_FD_READWRITE
 				 | CLOUDABI_RIGHT_FD_STAT_PUT_FLAGS
 				 | CLOUDABI_RIGHT_FILE_STAT_FGET;
 
-		auto a = c.process()->add_fd(pfd, pipe_rights | CLOUDABI_RIGHT_FD_WRITE, 0);
-		auto b = c.process()->add_fd(pfd, pipe_rights | CLOUDABI_RIGHT_FD_READ, 0);
+		auto a = c.process()->add_fd(write_end, pipe_rights | CLOUDABI_RIGHT_FD_WRITE, 0);
+		auto b = c.process()->add_fd(read_end, pipe_rights | CLOUDABI_RIGHT_FD_READ, 0);
 		c.set_results(a, b);
 		return 0;
 	} else if(type == CLOUDABI_FILETYPE_SOCKET_DGRAM
@@ -203,6 +206,11 @@ cloudabi_errno_t cloudos::syscall_fd_read(syscall_context &c)
 		auto len = iov[i].buf_len;
 		r = mapping->fd->read(buf, len);
 		if(mapping->fd->error) {
+			// a non-blocking read that would block still reports
+			// what was read before
+			if(mapping->fd->error == EAGAIN && read > 0) {
+				break;
+			}
 			return mapping->fd->error;
 		}
 		read += r;
@@ -305,11 +313,19 @@ cloudabi_errno_t cloudos::syscall_fd_write(syscall_context &c)
 	for(size_t i = 0; i < iovcnt; ++i) {
 		auto buf = iov[i].buf;
 		auto len = iov[i].buf_len;
-		mapping->fd->write(reinterpret_cast<const char*>(buf), len);
-		c.result += len;
+		size_t written = mapping->fd->write(reinterpret_cast<const char*>(buf), len);
 		if(mapping->fd->error) {
+			// a non-blocking write that would block still reports
+			// what was written before
+			if(mapping->fd->error == EAGAIN && c.result > 0) {
+				return 0;
+			}
 			return mapping->fd->error;
 		}
+		c.result += written;
+		if(written < len) {
+			break;
+		}
 	}
 	return 0;
 }
@@ -4,9 +4,32 @@
 
 using namespace cloudos;
 
-cloudabi_errno_t cloudos::syscall_mem_advise(syscall_context &)
+cloudabi_errno_t cloudos::syscall_mem_advise(syscall_context &c)
 {
-	return ENOSYS;
+	auto args = arguments_t<void*, size_t, cloudabi_advice_t>(c);
+	auto addr = args.first();
+	auto len = args.second();
+	auto advice = args.third();
+
+	switch(advice) {
+	case CLOUDABI_ADVICE_DONTNEED:
+	case CLOUDABI_ADVICE_NOREUSE:
+	case CLOUDABI_ADVICE_NORMAL:
+	case CLOUDABI_ADVICE_RANDOM:
+	case CLOUDABI_ADVICE_SEQUENTIAL:
+	case CLOUDABI_ADVICE_WILLNEED:
+		break;
+	default:
+		return EINVAL;
+	}
+	if((reinterpret_cast<uint32_t>(addr) % process_fd::PAGE_SIZE) != 0) {
+		return EINVAL;
+	}
+	if(len == 0) {
+		return 0;
+	}
+
+	return c.process()->mem_advise(addr, len_to_pages(len), advice);
 }
 
 cloudabi_errno_t cloudos::syscall_mem_lock(syscall_context &)
@@ -53,7 +76,14 @@ cloudabi_errno_t cloudos::syscall_mem_map(syscall_context &c)
 		// TODO: also do this if the proposed memory map already
 		// overlaps with an existing mapping, or let add_mem_mapping
 		// do the placement as well
-		address_requested = c.process()->find_free_virtual_range(len_to_pages(len));
+		// Large mappings are placed on a hugepage boundary, so that they
+		// can be backed by hugepages
+		if(len >= process_fd::HUGEPAGE_SIZE) {
+			address_requested = c.process()->find_free_virtual_range(len_to_pages(len), process_fd::HUGEPAGE_SIZE);
+		}
+		if(address_requested == nullptr) {
+			address_requested = c.process()->find_free_virtual_range(len_to_pages(len));
+		}
 		if(address_requested == nullptr) {
 			get_vga_stream() << "Failed to find virtual memory for mapping.\n";
 			return ENOMEM;
@@ -66,9 +96,14 @@ cloudabi_errno_t cloudos::syscall_mem_map(syscall_context &c)
 
 	mem_mapping_t *mapping = allocate<mem_mapping_t>(c.process(), address_requested, len_to_pages(len), nullptr, 0, prot);
 	c.process()->add_mem_mapping(mapping, fixed);
+	// Use hugepages where possible, to save on TLB entries. Hugepages are
+	// zeroed already, and the remaining pages are zeroed when they are
+	// backed below, so the mapping doesn't need to be cleared here.
+	if(len >= process_fd::HUGEPAGE_SIZE) {
+		mapping->back_with_hugepages();
+	}
 	// TODO: instead of completely backing, await the page fault and do it then
 	mapping->ensure_completely_backed();
-	memset(address_requested, 0, len);
 	c.result = reinterpret_cast<uintptr_t>(address_requested);
 	return 0;
 }
@@ -10,6 +10,41 @@ static bool return_true(void*, thread_condition*) {
 	return true;
 }
 
+// Get a signaler that is satisfied once the timeout of the given clock
+// subscription passes, or the given null signaler if it already passed
+static cloudabi_errno_t get_clock_signaler(cloudabi_subscription_t const &i, thread_condition_signaler *null_signaler, thread_condition_signaler **signaler)
+{
+	auto clock = get_clock_store()->get_clock(i.clock.clock_id);
+	if(clock == nullptr) {
+		get_vga_stream() << "Unknown clock ID " << i.clock.clock_id << "\n";
+		return ENOSYS;
+	}
+	auto timeout = i.clock.timeout;
+	auto time = clock->get_time(i.clock.precision);
+	if(!(i.clock.flags == CLOUDABI_SUBSCRIPTION_CLOCK_ABSTIME)) {
+		timeout += time;
+	}
+	if(timeout <= time) {
+		// already satisfied
+		*signaler = null_signaler;
+	} else {
+		*signaler = clock->get_signaler(timeout, i.clock.precision);
+		if(*signaler == nullptr) {
+			get_vga_stream() << "Clock ID " << i.clock.clock_id << " cannot be waited on\n";
+			return ENOSYS;
+		}
+	}
+	return 0;
+}
+
+static void set_clock_event(cloudabi_event_t &o, cloudabi_subscription_t const &i, cloudabi_errno_t error)
+{
+	o.userdata = i.userdata;
+	o.error = error;
+	o.type = CLOUDABI_EVENTTYPE_CLOCK;
+	o.clock.identifier = i.clock.identifier;
+}
+
 cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 {
 	auto args = arguments_t<const cloudabi_subscription_t*, cloudabi_event_t*, size_t, size_t*>(c);
@@ -49,51 +84,53 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 		}
 	}
 
+	// This signaler is always 'already satisfied', so if it is used, it will inhibit
+	// the actual wait(). Therefore, it can be used when poll() should immediately
+	// return, e.g. because of an error in the parameters.
+	thread_condition_signaler null_signaler;
+	null_signaler.set_already_satisfied_function(return_true, nullptr);
+
 	if(first_event == CLOUDABI_EVENTTYPE_LOCK_RDLOCK
-	|| first_event == CLOUDABI_EVENTTYPE_LOCK_WRLOCK) {
-		// acquire the lock, optionally timing out when the
-		// timeout passes.
-		auto *lock = in[0].lock.lock;
+	|| first_event == CLOUDABI_EVENTTYPE_LOCK_WRLOCK
+	|| first_event == CLOUDABI_EVENTTYPE_CONDVAR) {
+		thread_condition_signaler *timeout = nullptr;
 		if(nsubscriptions == 2) {
-			get_vga_stream() << "poll(): clocks for locks are not supported yet\n";
-			return ENOSYS;
-		}
-		if(in[0].lock.lock_scope != CLOUDABI_SCOPE_PRIVATE) {
-			get_vga_stream() << "poll(): non-private locks are not supported yet\n";
-			return ENOSYS;
+			auto res = get_clock_signaler(in[1], &null_signaler, &timeout);
+			if(res != 0) {
+				set_clock_event(out[0], in[1], res);
+				c.result = 1;
+				return 0;
+			}
 		}
-		// this call blocks this thread until the lock is acquired
-		c.thread->acquire_userspace_lock(lock, in[0].type);
-		out[0].userdata = in[0].userdata;
-		out[0].error = 0;
-		out[0].type = in[0].type;
-		out[0].lock.lock = in[0].lock.lock;
-		c.result = 1;
-		return 0;
-	} else if(first_event == CLOUDABI_EVENTTYPE_CONDVAR) {
-		// release the lock, wait() for the condvar, and
-		// re-acquire the lock when it is notified, optionally
-		// timing out when the timeout passes.
-		auto *condvar = in[0].condvar.condvar;
-		auto *lock = in[0].condvar.lock;
-		if(nsubscriptions == 2) {
-			get_vga_stream() << "poll(): clocks for condvars are not supported yet\n";
-			return ENOSYS;
+
+		cloudabi_errno_t res;
+		if(first_event == CLOUDABI_EVENTTYPE_CONDVAR) {
+			// release the lock, wait() for the condvar, and
+			// re-acquire the lock when it is notified, optionally
+			// timing out when the timeout passes. This call blocks
+			// this thread until the lock is reacquired, also if it
+			// times out.
+			res = c.thread->wait_userspace_cv(in[0].condvar.condvar, in[0].condvar.condvar_scope,
+				in[0].condvar.lock, in[0].condvar.lock_scope, timeout);
+		} else {
+			// acquire the lock, optionally timing out when the
+			// timeout passes. This call blocks this thread until
+			// the lock is acquired or the timeout passes.
+			res = c.thread->acquire_userspace_lock(in[0].lock.lock, in[0].lock.lock_scope, in[0].type, timeout);
 		}
-		if(in[0].condvar.condvar_scope != CLOUDABI_SCOPE_PRIVATE || in[0].condvar.lock_scope != CLOUDABI_SCOPE_PRIVATE) {
-			get_vga_stream() << "poll(): non-private locks or condvars are not supported yet\n";
-			return ENOSYS;
+
+		if(res == ETIMEDOUT) {
+			set_clock_event(out[0], in[1], 0);
+		} else {
+			out[0].userdata = in[0].userdata;
+			out[0].error = res;
+			out[0].type = in[0].type;
+			if(first_event == CLOUDABI_EVENTTYPE_CONDVAR) {
+				out[0].lock.lock = in[0].condvar.lock;
+			} else {
+				out[0].lock.lock = in[0].lock.lock;
+			}
 		}
-		// this call blocks this thread until the condition variable is notified
-		// TODO: this currently does not cause a race because we are UP and without
-		// kernel preemption, but will cause a race later
-		c.thread->drop_userspace_lock(lock);
-		c.thread->wait_userspace_cv(condvar);
-		c.thread->acquire_userspace_lock(lock, CLOUDABI_EVENTTYPE_LOCK_WRLOCK);
-		out[0].userdata = in[0].userdata;
-		out[0].error = 0;
-		out[0].type = in[0].type;
-		out[0].lock.lock = in[0].condvar.lock;
 		c.result = 1;
 		return 0;
 	}
@@ -110,12 +147,6 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 		cloudabi_errno_t error;
 	};
 
-	// This signaler is always 'already satisfied', so if it is used, it will inhibit
-	// the actual wait(). Therefore, it can be used when poll() should immediately
-	// return, e.g. because of an error in the parameters.
-	thread_condition_signaler null_signaler;
-	null_signaler.set_already_satisfied_function(return_true, nullptr);
-
 	for(size_t subi = 0; subi < nsubscriptions; ++subi) {
 		cloudabi_subscription_t const &i = in[subi];
 		thread_condition &condition = conditions[subi];
@@ -130,23 +161,10 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 		case CLOUDABI_EVENTTYPE_LOCK_WRLOCK:
 			kernel_panic("Eventtype cannot exist here");
 		case CLOUDABI_EVENTTYPE_CLOCK: {
-			auto clock = get_clock_store()->get_clock(i.clock.clock_id);
-			if(clock == nullptr) {
-				get_vga_stream() << "Unknown clock ID " << i.clock.clock_id << "\n";
-				userdata->error = ENOSYS;
-				signaler = &null_signaler;
-				break;
-			}
-			auto timeout = i.clock.timeout;
-			auto time = clock->get_time(i.clock.precision);
-			if(!(i.clock.flags == CLOUDABI_SUBSCRIPTION_CLOCK_ABSTIME)) {
-				timeout += time;
-			}
-			if(timeout <= time) {
-				// already satisfied
+			auto res = get_clock_signaler(i, &null_signaler, &signaler);
+			if(res != 0) {
+				userdata->error = res;
 				signaler = &null_signaler;
-			} else {
-				signaler = clock->get_signaler(timeout, i.clock.precision);
 			}
 			break;
 		}
@@ -154,22 +172,28 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 			auto fdnum = i.fd_readwrite.fd;
 			fd_mapping_t *proc_mapping;
 			auto res = c.process()->get_fd(&proc_mapping, fdnum, CLOUDABI_RIGHT_POLL_FD_READWRITE | CLOUDABI_RIGHT_FD_READ);
+			if(res == 0) {
+				res = proc_mapping->fd->get_read_signaler(&signaler);
+			}
 			if(res != 0) {
 				userdata->error = res;
 				signaler = &null_signaler;
 			}
-			res = proc_mapping->fd->get_read_signaler(&signaler);
+			break;
+		}
+		case CLOUDABI_EVENTTYPE_FD_WRITE: {
+			auto fdnum = i.fd_readwrite.fd;
+			fd_mapping_t *proc_mapping;
+			auto res = c.process()->get_fd(&proc_mapping, fdnum, CLOUDABI_RIGHT_POLL_FD_READWRITE | CLOUDABI_RIGHT_FD_WRITE);
+			if(res == 0) {
+				res = proc_mapping->fd->get_write_signaler(&signaler);
+			}
 			if(res != 0) {
 				userdata->error = res;
 				signaler = &null_signaler;
 			}
 			break;
 		}
-		case CLOUDABI_EVENTTYPE_FD_WRITE:
-			get_vga_stream() << "Unimplemented fd-write eventtype, failing\n";
-			userdata->error = ENOSYS;
-			signaler = &null_signaler;
-			break;
 		case CLOUDABI_EVENTTYPE_PROC_TERMINATE: {
 			cloudabi_fd_t proc_fdnum = i.proc_terminate.fd;
 			fd_mapping_t *proc_mapping;
@@ -209,6 +233,9 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 		o.error = userdata->error;
 		if(i->type == CLOUDABI_EVENTTYPE_CLOCK) {
 			o.clock.identifier = i->clock.identifier;
+		} else if(i->type == CLOUDABI_EVENTTYPE_FD_READ || i->type == CLOUDABI_EVENTTYPE_FD_WRITE) {
+			o.fd_readwrite.nbytes = 0;
+			o.fd_readwrite.flags = 0;
 		} else if(i->type == CLOUDABI_EVENTTYPE_PROC_TERMINATE && o.error == 0) {
 			cloudabi_fd_t proc_fdnum = o.proc_terminate.fd = i->proc_terminate.fd;
 			// TODO: store signal and exitcode in the thread_condition when the process dies,
@@ -233,7 +260,7 @@ cloudabi_errno_t cloudos::syscall_poll(syscall_context &c)
 	});
 	remove_all(&satisfied, [](thread_condition_list*){
 		return true;
-	});
+	}, intrusive_list_deallocator<thread_condition*>());
 	for(size_t subi = 0; subi < nsubscriptions; ++subi) {
 		thread_condition &condition = conditions[subi];
 		deallocate(reinterpret_cast<thread_condition_userdata*>(condition.userdata));
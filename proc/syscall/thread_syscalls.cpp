@@ -19,12 +19,8 @@ cloudabi_errno_t cloudos::syscall_thread_exit(syscall_context &c)
 	auto args = arguments_t<_Atomic(cloudabi_lock_t)*, cloudabi_scope_t>(c);
 	auto lock = args.first();
 	auto scope = args.second();
-	if(scope != CLOUDABI_SCOPE_PRIVATE) {
-		get_vga_stream() << "thread_exit(): non-private locks are not supported yet\n";
-		return ENOSYS;
-	}
 	c.thread->thread_exit();
-	c.thread->drop_userspace_lock(lock);
+	c.thread->drop_userspace_lock(lock, scope);
 
 	// Userland won't be rescheduled
 	assert(c.thread->is_exited());
@@ -24,6 +24,8 @@ struct clock {
 	 * the behaviour of this function is undefined. If the time passes
 	 * after you got the signaler, it may be destroyed, so use the pointer
 	 * immediately to add thread conditions and do not store it.
+	 *
+	 * Clocks that cannot signal at a given time return nullptr.
 	 */
 	virtual thread_condition_signaler *get_signaler(
 		cloudabi_timestamp_t timeout, cloudabi_timestamp_t precision) = 0;
@@ -35,7 +37,7 @@ struct clock_store {
 
 private:
 	static constexpr auto NUM_CLOCKS = CLOUDABI_CLOCK_THREAD_CPUTIME_ID + 1;
-	clock *clocks[NUM_CLOCKS];
+	clock *clocks[NUM_CLOCKS] = {};
 };
 
 }
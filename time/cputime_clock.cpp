@@ -0,0 +1,43 @@
+#include <time/cputime_clock.hpp>
+#include <fd/process_fd.hpp>
+#include <fd/scheduler.hpp>
+#include <global.hpp>
+
+using namespace cloudos;
+
+static cloudabi_timestamp_t get_monotonic_resolution() {
+	auto *clock = get_clock_store()->get_clock(CLOUDABI_CLOCK_MONOTONIC);
+	return clock == nullptr ? 1 : clock->get_resolution();
+}
+
+process_cputime_clock::process_cputime_clock() {
+	get_clock_store()->register_clock(CLOUDABI_CLOCK_PROCESS_CPUTIME_ID, this);
+}
+
+cloudabi_timestamp_t process_cputime_clock::get_resolution() {
+	return get_monotonic_resolution();
+}
+
+cloudabi_timestamp_t process_cputime_clock::get_time(cloudabi_timestamp_t /*precision*/) {
+	return get_scheduler()->get_running_thread()->get_process()->get_runtime();
+}
+
+thread_condition_signaler *process_cputime_clock::get_signaler(cloudabi_timestamp_t, cloudabi_timestamp_t) {
+	return nullptr;
+}
+
+thread_cputime_clock::thread_cputime_clock() {
+	get_clock_store()->register_clock(CLOUDABI_CLOCK_THREAD_CPUTIME_ID, this);
+}
+
+cloudabi_timestamp_t thread_cputime_clock::get_resolution() {
+	return get_monotonic_resolution();
+}
+
+cloudabi_timestamp_t thread_cputime_clock::get_time(cloudabi_timestamp_t /*precision*/) {
+	return get_scheduler()->get_runtime(get_scheduler()->get_running_thread().get());
+}
+
+thread_condition_signaler *thread_cputime_clock::get_signaler(cloudabi_timestamp_t, cloudabi_timestamp_t) {
+	return nullptr;
+}
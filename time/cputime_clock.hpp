@@ -0,0 +1,32 @@
+#pragma once
+
+#include <time/clock_store.hpp>
+
+namespace cloudos {
+
+/**
+ * Clocks measuring the CPU time used by the calling process or thread.
+ *
+ * The CPU time is accounted by the scheduler using the monotonic clock, so
+ * these clocks have its resolution. Waiting for a CPU time to pass is not
+ * supported, so they don't give signalers.
+ */
+struct process_cputime_clock : public clock {
+	process_cputime_clock();
+
+	cloudabi_timestamp_t get_resolution() override;
+	cloudabi_timestamp_t get_time(cloudabi_timestamp_t precision) override;
+	thread_condition_signaler *get_signaler(cloudabi_timestamp_t timeout,
+		cloudabi_timestamp_t precision) override;
+};
+
+struct thread_cputime_clock : public clock {
+	thread_cputime_clock();
+
+	cloudabi_timestamp_t get_resolution() override;
+	cloudabi_timestamp_t get_time(cloudabi_timestamp_t precision) override;
+	thread_condition_signaler *get_signaler(cloudabi_timestamp_t timeout,
+		cloudabi_timestamp_t precision) override;
+};
+
+}
@@ -11,6 +11,8 @@
 #include <random>
 #include <pthread.h>
 #include <cloudabi_types.h>
+#include <errno.h>
+#include <time.h>
 
 int stdout;
 std::atomic<int> ctr(0);
@@ -45,6 +47,91 @@ void thread_counter(int num) {
 	cv.notify_all();
 }
 
+void test_timeouts() {
+	// nobody notifies this condvar, so the wait must time out, and the
+	// lock must be held again afterwards
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		auto status = cv.wait_for(lock, std::chrono::milliseconds(100));
+		dprintf(stdout, "Condvar wait %s and lock is %s, that's %s\n",
+			status == std::cv_status::timeout ? "timed out" : "was notified",
+			lock.owns_lock() ? "held" : "not held",
+			status == std::cv_status::timeout && lock.owns_lock() ? "correct" : "wrong");
+	}
+
+	// this lock is held by the main thread, so the timed lock must fail
+	pthread_mutex_t timed_mtx = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&timed_mtx);
+	int res = -1;
+	std::thread t([&]() {
+		struct timespec abstime;
+		clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_nsec += 100000000;
+		if(abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec += 1;
+			abstime.tv_nsec -= 1000000000;
+		}
+		res = pthread_mutex_timedlock(&timed_mtx, &abstime);
+	});
+	t.join();
+	pthread_mutex_unlock(&timed_mtx);
+	dprintf(stdout, "Timed lock returned %d, that's the %s value!\n", res, res == ETIMEDOUT ? "correct" : "wrong");
+}
+
+static cloudabi_timestamp_t get_time(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void test_priority_inheritance() {
+	// A thread holds a lock for a while, running on the CPU, while hogs
+	// keep the CPU busy as well, so that both are demoted. When this
+	// thread, which mostly sleeps, waits for the lock, the holder inherits
+	// its priority and runs ahead of the hogs, so the wait is bounded by
+	// the CPU time left in its critical section instead of being
+	// stretched out by the hogs.
+	const int num_hogs = 3;
+	const cloudabi_timestamp_t critical_ns = 100000000;
+	std::mutex pi_mtx;
+	std::atomic<bool> held(false);
+	std::atomic<bool> done(false);
+
+	std::thread holder([&]() {
+		std::lock_guard<std::mutex> lock(pi_mtx);
+		held = true;
+		cloudabi_timestamp_t start = get_time(CLOCK_THREAD_CPUTIME_ID);
+		while(get_time(CLOCK_THREAD_CPUTIME_ID) - start < critical_ns) {}
+	});
+	std::vector<std::thread> hogs;
+	for(int i = 0; i < num_hogs; ++i) {
+		hogs.emplace_back([&]() {
+			while(!done) {}
+		});
+	}
+
+	// let the holder and the hogs use up some quanta
+	while(!held) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	for(int i = 0; i < 10; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	cloudabi_timestamp_t start = get_time(CLOCK_MONOTONIC);
+	pi_mtx.lock();
+	cloudabi_timestamp_t waited = get_time(CLOCK_MONOTONIC) - start;
+	pi_mtx.unlock();
+
+	done = true;
+	holder.join();
+	for(auto &hog : hogs) {
+		hog.join();
+	}
+	dprintf(stdout, "Waited %llu ms for a lock held by a busy thread, that's %s\n",
+		waited / 1000000, waited <= 2 * critical_ns ? "correct" : "wrong");
+}
+
 void program_main(const argdata_t *) {
 	stdout = 0;
 
@@ -71,5 +158,8 @@ void program_main(const argdata_t *) {
 
 	dprintf(stdout, "After all threads are joined, counter is %d, that's the %s value!\n", ctr.load(), ctr.load() == num_threads ? "correct" : "wrong");
 
+	test_timeouts();
+	test_priority_inheritance();
+
 	exit(0);
 }
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <program.h>
+#include <argdata.h>
+#include <string.h>
+#include <cloudabi_syscalls.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/procdesc.h>
+#include <time.h>
+#include <errno.h>
+
+int stdout = -1;
+
+// The hog keeps the kernel busy by forking a process with a large address
+// space, so that the kernel spends a long time copying its pages
+static const size_t HOG_MEMORY = 64 * 1024 * 1024;
+static const int SLEEPS = 100;
+static const cloudabi_timestamp_t SLEEP_NS = 2000000;
+// maximum allowed delay between the end of a sleep and the wakeup
+static const cloudabi_timestamp_t MAX_LATENCY_NS = 50000000;
+
+static volatile bool done = false;
+
+cloudabi_timestamp_t now() {
+	cloudabi_timestamp_t ts = 0;
+	cloudabi_sys_clock_time_get(CLOUDABI_CLOCK_MONOTONIC, 0, &ts);
+	return ts;
+}
+
+void *hog(void *) {
+	unsigned char *addr = reinterpret_cast<unsigned char*>(mmap(0, HOG_MEMORY, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, CLOUDABI_MAP_ANON_FD, 0));
+	if(addr == MAP_FAILED) {
+		perror("mmap failed");
+		exit(1);
+	}
+	for(size_t i = 0; i < HOG_MEMORY; i += 4096) {
+		addr[i] = 0xba;
+	}
+
+	int forks = 0;
+	while(!done) {
+		int fd;
+		int ret = pdfork(&fd);
+		if(ret < 0) {
+			perror("pdfork failed");
+			exit(1);
+		}
+		if(ret == 0) {
+			exit(0);
+		}
+		siginfo_t si;
+		pdwait(fd, &si, 0);
+		close(fd);
+		forks++;
+	}
+	dprintf(stdout, "Hog forked %d times\n", forks);
+	return nullptr;
+}
+
+void program_main(const argdata_t *ad) {
+	argdata_map_iterator_t it;
+	const argdata_t *key;
+	const argdata_t *value;
+	argdata_map_iterate(ad, &it);
+	while (argdata_map_get(&it, &key, &value)) {
+		const char *keystr;
+		if(argdata_get_str_c(key, &keystr) != 0) {
+			argdata_map_next(&it);
+			continue;
+		}
+
+		if(strcmp(keystr, "stdout") == 0) {
+			argdata_get_fd(value, &stdout);
+		}
+		argdata_map_next(&it);
+	}
+
+	FILE *out = fdopen(stdout, "w");
+	fswap(stderr, out);
+
+	pthread_t hog_thread;
+	if(pthread_create(&hog_thread, nullptr, hog, nullptr) != 0) {
+		perror("pthread_create failed");
+		exit(1);
+	}
+
+	cloudabi_timestamp_t worst = 0;
+	cloudabi_timestamp_t total = 0;
+	for(int i = 0; i < SLEEPS; ++i) {
+		cloudabi_timestamp_t start = now();
+		struct timespec ts = {.tv_sec = 0, .tv_nsec = SLEEP_NS};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts);
+		cloudabi_timestamp_t slept = now() - start;
+		cloudabi_timestamp_t latency = slept > SLEEP_NS ? slept - SLEEP_NS : 0;
+		total += latency;
+		if(latency > worst) {
+			worst = latency;
+		}
+	}
+
+	done = true;
+	pthread_join(hog_thread, nullptr);
+
+	dprintf(stdout, "Wakeup latency over %d sleeps: average %llu us, worst %llu us\n",
+		SLEEPS, total / SLEEPS / 1000, worst / 1000);
+	if(worst > MAX_LATENCY_NS) {
+		dprintf(stdout, "Worst-case wakeup latency is above %llu us\n", MAX_LATENCY_NS / 1000);
+		exit(1);
+	}
+	exit(0);
+}
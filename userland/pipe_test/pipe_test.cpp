@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 
 int stdout;
 
@@ -32,6 +34,115 @@ void *thread_handler(void *w) {
 	return nullptr;
 }
 
+static const size_t LARGE_WRITE_SIZE = 100 * 1024;
+
+void *large_write_handler(void *w) {
+	// larger than the maximum capacity of a pipe, so it is written in
+	// chunks as the reader makes room
+	int fd = *reinterpret_cast<int*>(w);
+	char *buf = reinterpret_cast<char*>(malloc(LARGE_WRITE_SIZE));
+	for(size_t i = 0; i < LARGE_WRITE_SIZE; ++i) {
+		buf[i] = i % 251;
+	}
+	ssize_t count = write(fd, buf, LARGE_WRITE_SIZE);
+	dprintf(stdout, "Large write returned %zd, that's the %s value!\n", count,
+		count == static_cast<ssize_t>(LARGE_WRITE_SIZE) ? "correct" : "wrong");
+	free(buf);
+	return nullptr;
+}
+
+void test_large_write() {
+	int fds[2];
+	if(pipe(fds) < 0) {
+		dprintf(stdout, "Failed to create pipes: %s\n", strerror(errno));
+		return;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, large_write_handler, &fds[1]);
+
+	// read in odd-sized pieces, so that reads wrap around the end of
+	// the ring buffer
+	size_t received = 0;
+	bool correct = true;
+	char buf[1000];
+	while(received < LARGE_WRITE_SIZE) {
+		ssize_t count = read(fds[0], buf, sizeof(buf));
+		if(count <= 0) {
+			dprintf(stdout, "rx failed: %s\n", strerror(errno));
+			correct = false;
+			break;
+		}
+		for(ssize_t i = 0; i < count; ++i) {
+			if(buf[i] != static_cast<char>((received + i) % 251)) {
+				correct = false;
+			}
+		}
+		received += count;
+	}
+	pthread_join(thread, NULL);
+	dprintf(stdout, "Received %zu bytes of a large write, that's %s\n", received, correct ? "correct" : "wrong");
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void test_nonblocking() {
+	int fds[2];
+	if(pipe(fds) < 0) {
+		dprintf(stdout, "Failed to create pipes: %s\n", strerror(errno));
+		return;
+	}
+	// both ends have their own flags
+	if(fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+		dprintf(stdout, "Failed to set non-blocking mode: %s\n", strerror(errno));
+		return;
+	}
+	int write_flags = fcntl(fds[1], F_GETFL);
+	dprintf(stdout, "Write end is %snon-blocking after setting the read end, that's %s\n",
+		(write_flags & O_NONBLOCK) ? "" : "not ",
+		write_flags >= 0 && (write_flags & O_NONBLOCK) == 0 ? "correct" : "wrong");
+	if(fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+		dprintf(stdout, "Failed to set non-blocking mode: %s\n", strerror(errno));
+		return;
+	}
+
+	char buf[16];
+	ssize_t count = read(fds[0], buf, sizeof(buf));
+	dprintf(stdout, "Non-blocking read from an empty pipe: %s, that's %s\n",
+		count < 0 ? strerror(errno) : "succeeded",
+		count < 0 && errno == EAGAIN ? "correct" : "wrong");
+
+	struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+	int ready = poll(&pfd, 1, 0);
+	dprintf(stdout, "Empty pipe polls as %sreadable, that's %s\n", ready == 1 ? "" : "not ",
+		ready == 0 ? "correct" : "wrong");
+
+	// fill the pipe up to its maximum capacity; the rest doesn't fit
+	char *large = reinterpret_cast<char*>(calloc(LARGE_WRITE_SIZE, 1));
+	count = write(fds[1], large, LARGE_WRITE_SIZE);
+	dprintf(stdout, "Non-blocking large write returned %zd, that's %s\n", count,
+		count > 0 && count < static_cast<ssize_t>(LARGE_WRITE_SIZE) ? "correct" : "wrong");
+	count = write(fds[1], large, LARGE_WRITE_SIZE);
+	dprintf(stdout, "Non-blocking write to a full pipe: %s, that's %s\n",
+		count < 0 ? strerror(errno) : "succeeded",
+		count < 0 && errno == EAGAIN ? "correct" : "wrong");
+	free(large);
+
+	ready = poll(&pfd, 1, 0);
+	dprintf(stdout, "Full pipe polls as %sreadable, that's %s\n", ready == 1 ? "" : "not ",
+		ready == 1 && (pfd.revents & POLLIN) ? "correct" : "wrong");
+	struct pollfd wpfd = {.fd = fds[1], .events = POLLOUT};
+	ready = poll(&wpfd, 1, 0);
+	dprintf(stdout, "Full pipe polls as %swritable, that's %s\n", ready == 1 ? "" : "not ",
+		ready == 0 ? "correct" : "wrong");
+	read(fds[0], buf, sizeof(buf));
+	ready = poll(&wpfd, 1, 0);
+	dprintf(stdout, "Drained pipe polls as %swritable, that's %s\n", ready == 1 ? "" : "not ",
+		ready == 1 && (wpfd.revents & POLLOUT) ? "correct" : "wrong");
+	close(fds[0]);
+	close(fds[1]);
+}
+
 void program_main(const argdata_t *) {
 	stdout = 0;
 	dprintf(stdout, "This is pipe_test -- Creating pipe fd's\n");
@@ -55,5 +166,8 @@ void program_main(const argdata_t *) {
 		}
 	}
 
+	test_large_write();
+	test_nonblocking();
+
 	pthread_exit(NULL);
 }
@@ -11,11 +11,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <cloudabi_syscalls.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/procdesc.h>
+#include <sys/mman.h>
 
 int stdout;
 int tmpdir;
@@ -54,6 +56,79 @@ void check_same_directory_fd(int a, int b) {
 	}
 }
 
+void *blocked_receiver(void *f) {
+	int fd = *reinterpret_cast<int*>(f);
+	// split over two iovecs, so the sender fills them in one pass
+	char first[3];
+	char second[8];
+	struct iovec iov[2] = {{.iov_base = first, .iov_len = sizeof(first)},
+			       {.iov_base = second, .iov_len = sizeof(second)}};
+	struct msghdr message = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = nullptr,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	ssize_t count = recvmsg(fd, &message, 0);
+	if(count != 6 || strncmp(first, "pin", 3) != 0 || strncmp(second, "g!", 2) != 0 || second[2] != 'x') {
+		dprintf(stdout, "[UNIXSOCK] Blocked receiver got the wrong data!\n");
+		exit(1);
+	}
+	return nullptr;
+}
+
+// Spans several pages, so that a handoff into another process faults in
+// more than one of them
+static const size_t HANDOFF_TEST_SIZE = 3 * 4096 + 100;
+
+static char handoff_test_byte(size_t i) {
+	return static_cast<char>(i % 251);
+}
+
+// Runs in a forked child: blocks in recvmsg() with a buffer whose pages aren't
+// backed yet, so that the sender has to copy into another address space and
+// fault the pages in there
+int blocked_child_receiver(int fd) {
+	char *buf = reinterpret_cast<char*>(mmap(0, HANDOFF_TEST_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, CLOUDABI_MAP_ANON_FD, 0));
+	if(buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	// give the pages back, so that the first access to them faults
+	int res = posix_madvise(buf, HANDOFF_TEST_SIZE, POSIX_MADV_DONTNEED);
+	if(res != 0) {
+		dprintf(stdout, "[UNIXSOCK] posix_madvise: %s\n", strerror(res));
+		return 1;
+	}
+
+	size_t received = 0;
+	while(received < HANDOFF_TEST_SIZE) {
+		struct iovec iov = {.iov_base = buf + received, .iov_len = HANDOFF_TEST_SIZE - received};
+		struct msghdr message = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = nullptr,
+			.msg_controllen = 0,
+			.msg_flags = 0,
+		};
+		ssize_t count = recvmsg(fd, &message, 0);
+		if(count <= 0) {
+			perror("recvmsg");
+			return 1;
+		}
+		received += count;
+	}
+	for(size_t i = 0; i < HANDOFF_TEST_SIZE; ++i) {
+		if(buf[i] != handoff_test_byte(i)) {
+			dprintf(stdout, "[UNIXSOCK] Blocked child receiver got the wrong data at %zu!\n", i);
+			return 1;
+		}
+	}
+	munmap(buf, HANDOFF_TEST_SIZE);
+	return 0;
+}
+
 void program_main(const argdata_t *ad) {
 	argdata_map_iterator_t it;
 	const argdata_t *key;
@@ -189,6 +264,123 @@ void program_main(const argdata_t *ad) {
 
 	dprintf(stdout, "[UNIXSOCK] SOCK_DGRAM test completed!\n");
 
+	dprintf(stdout, "[UNIXSOCK] Creating SOCK_STREAM socketpair\n");
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+		}
+		// small writes coalesce into one read
+		if(write(fds[0], "foo", 3) != 3 || write(fds[0], "bar", 3) != 3) {
+			perror("write");
+		}
+
+		struct iovec iov = {.iov_base = const_cast<void*>(reinterpret_cast<const void*>("baz")), .iov_len = 3};
+		alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr message = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+			.msg_flags = 0,
+		};
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		*reinterpret_cast<int*>(CMSG_DATA(cmsg)) = tmpdir;
+		if(sendmsg(fds[0], &message, 0) != 3) {
+			perror("sendmsg");
+		}
+
+		// a read stops where the data that carried fds starts
+		char buf[10];
+		if(read(fds[1], buf, sizeof(buf)) != 6) {
+			perror("read");
+		}
+		if(strncmp(buf, "foobar", 6) != 0) {
+			dprintf(stdout, "[UNIXSOCK] Received stream data is different!\n");
+			exit(1);
+		}
+
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		message.msg_controllen = sizeof(control);
+		if(recvmsg(fds[1], &message, 0) != 3) {
+			perror("recvmsg");
+		}
+		if(strncmp(buf, "baz", 3) != 0) {
+			dprintf(stdout, "[UNIXSOCK] Received stream data 2 is different!\n");
+			exit(1);
+		}
+		cmsg = CMSG_FIRSTHDR(&message);
+		if(cmsg == 0 || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+			dprintf(stdout, "[UNIXSOCK] No fds attached to stream data 2!\n");
+			exit(1);
+		}
+		int received_fd = *reinterpret_cast<int*>(CMSG_DATA(cmsg));
+		check_same_directory_fd(tmpdir, received_fd);
+		close(received_fd);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	dprintf(stdout, "[UNIXSOCK] SOCK_STREAM socketpair test completed!\n");
+
+	dprintf(stdout, "[UNIXSOCK] Sending to a blocked receiver\n");
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+		}
+		pthread_t thread;
+		pthread_create(&thread, NULL, blocked_receiver, &fds[1]);
+
+		// give the receiver time to block in recvmsg()
+		struct timespec ts = {.tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 /* 100 ms */};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts);
+		if(write(fds[0], "ping!x", 6) != 6) {
+			perror("write");
+		}
+		pthread_join(thread, NULL);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	dprintf(stdout, "[UNIXSOCK] Blocked receiver test completed!\n");
+
+	dprintf(stdout, "[UNIXSOCK] Sending to a blocked receiver in another process\n");
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+		}
+		int pfd;
+		int ret = pdfork(&pfd);
+		if(ret == 0) {
+			// I'm the child
+			close(fds[0]);
+			exit(blocked_child_receiver(fds[1]));
+		}
+
+		char *payload = reinterpret_cast<char*>(malloc(HANDOFF_TEST_SIZE));
+		for(size_t i = 0; i < HANDOFF_TEST_SIZE; ++i) {
+			payload[i] = handoff_test_byte(i);
+		}
+		// give the child time to block in recvmsg()
+		struct timespec ts = {.tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 /* 100 ms */};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts);
+		if(write(fds[0], payload, HANDOFF_TEST_SIZE) != static_cast<ssize_t>(HANDOFF_TEST_SIZE)) {
+			perror("write");
+		}
+		free(payload);
+
+		siginfo_t si;
+		pdwait(pfd, &si, 0);
+		if(si.si_status != 0) {
+			dprintf(stdout, "[UNIXSOCK] Blocked child receiver failed with status %d\n", si.si_status);
+		}
+		close(pfd);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	dprintf(stdout, "[UNIXSOCK] Blocked child receiver test completed!\n");
+
 	dprintf(stdout, "[UNIXSOCK] Performing on-filesystem SOCK_STREAM test\n");
 	{
 		int fd1 = socket(AF_UNIX, SOCK_STREAM, 0);